@@ -3,10 +3,14 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <memory>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <chrono>
-#include <random>
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
@@ -16,7 +20,7 @@
 #define M_PI 3.1415926535897932384626433832795028842
 #endif
 
-static const size_t BUFSIZE = 1 << 20;
+static const size_t BUFSIZE = 1 << 20, MINBUFSIZE = 1 << 12;
 
 #include "ArrayQueue.hpp"
 
@@ -50,6 +54,18 @@ const unordered_map<string, ContainerFormat> availableContainers = {
   { "W64" , ContainerFormat::W64  },
   { "rf64", ContainerFormat::RF64 },
   { "RF64", ContainerFormat::RF64 },
+  { "raw" , ContainerFormat::RAW  },
+  { "RAW" , ContainerFormat::RAW  },
+};
+
+// The sample formats of --rawIn and --rawOut, by the value of --bits
+const unordered_map<string, int64_t> availableRawFormats = {
+  { "u8" ,   8 },
+  { "s16",  16 },
+  { "s24",  24 },
+  { "s32",  32 },
+  { "f32", -32 },
+  { "f64", -64 },
 };
 
 void showProfileOptions() {
@@ -81,14 +97,15 @@ void showDitherOptions() {
 }
 
 void showContainerOptions() {
-  cerr << "Available containers : riff, w64, rf64" << endl;
+  cerr << "Available containers : riff, w64, rf64, raw" << endl;
   exit(-1);
 }
 
 void showUsage(const string& argv0, const string& mes = "") {
   cerr << ("Shibatch Sample Rate Converter  Version " + versionString()) << endl;
   cerr << endl;
-  cerr << "Usage: " << argv0 << " [<options>] <source file name> <destination file name>" << endl;
+  cerr << "Usage: " << argv0 << " [<options>] <source file name> <destination file name> [<source> <destination> ...]" << endl;
+  cerr << "       " << argv0 << " [<options>] --batch <list file>" << endl;
   cerr << endl;
   cerr << "Options : --rate <sampling rate(Hz)> Specify a sample rate" << endl;
   cerr << "          --att <attenuation(dB)>    Specify an attenuation level of the output signal" << endl;
@@ -104,7 +121,7 @@ void showUsage(const string& argv0, const string& mes = "") {
   cerr << "          --pdf <type> [<amp>]       Select a probability distribution function for dithering" << endl;
   cerr << "                                       0 : Rectangular" << endl;
   cerr << "                                       1 : Triangular" << endl;
-  //cerr << "                                       2 : Gaussian" << endl;
+  cerr << "                                       2 : Gaussian" << endl;
   //cerr << "                                       3 : Two-level (experimental)" << endl;
   cerr << "          --profile <name>           Select a conversion profile" << endl;
   cerr << "                                       fast : Enough quality for almost every purpose" << endl;
@@ -112,10 +129,32 @@ void showUsage(const string& argv0, const string& mes = "") {
   cerr << "          --minPhase                 Use minimum phase filters instead of linear phase filters" << endl;
   cerr << "          --partConv <log2len>       Divide a long filter into smaller sub-filters so that they"<< endl;
   cerr << "                                     can be applied without significant processing delays." << endl;
+  cerr << "          --start <seconds>          Convert from the given time of the output on" << endl;
+  cerr << "          --length <seconds>         Convert only the given length of the output" << endl;
   cerr << "          --st                       Disable multithreading" << endl;
+  cerr << "          --segments <n>             Divide the source file into time segments and" << endl;
+  cerr << "                                     convert n of them in parallel" << endl;
+  cerr << "          --threads <n>              Limit the number of worker threads to n" << endl;
+  cerr << "          --pipeline <depth>         Run the filters of each channel on separate threads," << endl;
+  cerr << "                                     queueing up to depth blocks between them" << endl;
+  cerr << "          --memLimit <MiB>           Size the buffers to fit in about the given amount" << endl;
+  cerr << "                                     of memory, shared among the jobs of a batch" << endl;
+  cerr << "          --affinity <cpus>          Pin the threads to the given CPUs in turn, e.g. 0-3,8" << endl;
+  cerr << "          --numaNode <n>             Run the threads on the CPUs of NUMA node n" << endl;
+  cerr << "          --rtPriority <n>           Run the threads with SCHED_FIFO priority n" << endl;
+  cerr << "          --flushDenormals           Flush denormal numbers to zero" << endl;
+  cerr << "          --asyncIO                  Write the output file with io_uring (Linux)" << endl;
+  cerr << "          --directIO                 Write the output file with io_uring, bypassing" << endl;
+  cerr << "                                     the page cache (Linux)" << endl;
+  cerr << "          --batch <list file>        Convert the pairs of source and destination file names" << endl;
+  cerr << "                                     listed in the file, one pair per line" << endl;
+  cerr << "          --jobs <n>                 Convert up to n files at the same time" << endl;
   cerr << "          --dstContainer <name>      Select a container of output file" << endl;
   cerr << "                                       riff : The most common WAV format" << endl;
   cerr << "                                       help : Show all available options" << endl;
+  cerr << "          --rawIn <fmt>,<nch>,<fs>   Read headerless PCM in format fmt (u8, s16, s24, s32," << endl;
+  cerr << "                                     f32 or f64) with nch channels at fs Hz" << endl;
+  cerr << "          --rawOut <fmt>             Write headerless PCM in format fmt" << endl;
   cerr << "          --genImpulse <fs> <nch> <period>" << endl;
   cerr << "                                     Generate an impulse signal" << endl;
   cerr << "          --genSweep <fs> <nch> <length> <startfs> <endfs>" << endl;
@@ -129,15 +168,6 @@ void showUsage(const string& argv0, const string& mes = "") {
   exit(-1);
 }
 
-class RectangularRNG : public DoubleRNG {
-  const double min, max;
-  default_random_engine rng;
-  uniform_real_distribution<double> dist{0.0, 1.0};
-public:
-  RectangularRNG(double min_, double max_, uint64_t seed) : min(min_), max(max_), rng(seed) {}
-  double nextDouble() { return min + dist(rng) * (max - min); }
-};
-
 template<typename T>
 class ImpulseGenerator : public ssrc::OutletProvider<T> {
   class Outlet : public ssrc::StageOutlet<T> {
@@ -236,36 +266,77 @@ public:
   WavFormat getFormat() { return format; }
 };
 
+// Gives a list of outlets, e.g. those of the resamplers, to ChannelMixer
 template<typename T>
-class BufferStage : public StageOutlet<T> {
-  shared_ptr<ssrc::StageOutlet<T>> inlet;
-  const size_t N;
-  vector<T> buf;
-  size_t pos = 0;
+class OutletList : public ssrc::OutletProvider<T> {
+  vector<shared_ptr<ssrc::StageOutlet<T>>> v;
+  WavFormat format;
+
 public:
-  BufferStage(shared_ptr<ssrc::StageOutlet<T>> in_, size_t N_ = 65536) : inlet(in_), N(N_) {}
+  OutletList(const vector<shared_ptr<ssrc::StageOutlet<T>>> &v_, const WavFormat& format_) : v(v_), format(format_) {
+    format.channels = v.size();
+  }
 
-  size_t size() { return buf.size(); }
+  shared_ptr<ssrc::StageOutlet<T>> getOutlet(uint32_t c) { return v[c]; }
+  WavFormat getFormat() { return format; }
+};
 
-  bool atEnd() { return pos == buf.size(); }
+/**
+ * Splits the mixing matrix into the matrix applied before resampling
+ * and the one applied after it. Since mixing and resampling are both
+ * linear, the channels can be mixed on either side, and the side with
+ * fewer channels to resample is taken. Identical rows are resampled
+ * once and fanned out after resampling. An empty matrix is not
+ * applied.
+ */
+struct MixPlan {
+  vector<vector<double>> pre, post;
+  int nResampled;
+
+  MixPlan(const vector<vector<double>> &m, int snch) : nResampled(snch) {
+    if (m.size() == 0) return;
+
+    vector<vector<double>> rows;
+    vector<size_t> rowOf(m.size());
+    for(size_t oc=0;oc<m.size();oc++) {
+      rowOf[oc] = find(rows.begin(), rows.end(), m[oc]) - rows.begin();
+      if (rowOf[oc] == rows.size()) rows.push_back(m[oc]);
+    }
 
-  void execute() {
-    pos = 0;
-    for(;;) {
-      buf.resize(buf.size() + N);
-      size_t z = inlet->read(buf.data() + pos, N);
-      pos += z;
-      buf.resize(pos);
-      if (z == 0) break;
+    vector<int> cols;
+    for(int ic=0;ic<snch;ic++) {
+      for(auto &r : m) {
+	if (r[ic] != 0) {
+	  cols.push_back(ic);
+	  break;
+	}
+      }
     }
-    pos = 0;
-  }
 
-  size_t read(T *out, size_t nSamples) {
-    nSamples = min(buf.size() - pos, nSamples);
-    for(size_t i = 0;i < nSamples;i++) out[i] = buf[i + pos];
-    pos += nSamples;
-    return nSamples;
+    if (cols.size() > 0 && cols.size() < rows.size()) {
+      // Resample the input channels that are used, and mix after
+      if (cols.size() < (size_t)snch) {
+	for(int ic : cols) {
+	  pre.push_back(vector<double>(snch));
+	  pre.back()[ic] = 1;
+	}
+      }
+      for(auto &r : m) {
+	post.push_back(vector<double>());
+	for(int ic : cols) post.back().push_back(r[ic]);
+      }
+      nResampled = cols.size();
+    } else {
+      // Mix the distinct rows, and fan them out after resampling
+      pre = rows;
+      if (rows.size() < m.size()) {
+	for(size_t oc=0;oc<m.size();oc++) {
+	  post.push_back(vector<double>(rows.size()));
+	  post.back()[rowOf[oc]] = 1;
+	}
+      }
+      nResampled = rows.size();
+    }
   }
 };
 
@@ -287,6 +358,7 @@ struct Pipeline {
   double att, peak;
   bool minPhase, quiet, debug, mt;
   int l2mindftflen;
+  unsigned nSegments, nThreads, pipelineDepth;
 
   enum SrcType src;
   enum DstType dst;
@@ -297,18 +369,35 @@ struct Pipeline {
 
   ConversionProfile profile;
 
+  // Shared by the pipelines of a batch conversion
+  shared_ptr<Executor> sharedExecutor;
+
+  // WavWriter::ASYNC_IO and the like
+  unsigned ioFlags = 0;
+
+  // The format of the source if it is headerless raw PCM
+  bool rawIn = false;
+  WavFormat rawInFormat;
+
+  // The time range of the output to convert, in seconds. A negative
+  // length means up to the end.
+  double rangeStart = 0, rangeLength = -1;
+
+  // The memory for the buffers in bytes, or 0 for no limit
+  size_t memLimit = 0;
+
   Pipeline(const string& argv0_, const string &srcfn_, const string &dstfn_,
 	   const string &profileName_, const string &dstContainerName_, uint64_t dstChannelMask_,
 	   int64_t rate_, int64_t bits_, int64_t dither_, int64_t pdf_, const vector<vector<double>>& mixMatrix_,
 	   uint64_t seed_, double att_, double peak_, bool minPhase_, bool quiet_, bool debug_, bool mt_,
-	   int l2mindftflen_,
+	   int l2mindftflen_, unsigned nSegments_, unsigned nThreads_, unsigned pipelineDepth_,
 	   enum SrcType src_, enum DstType dst_, size_t impulsePeriod_, size_t sweepLength_,
 	   double sweepStart_, double sweepEnd_, int generatorNch_, int generatorFs_, ConversionProfile profile_) :
     argv0(argv0_), srcfn(srcfn_), dstfn(dstfn_),
     profileName(profileName_), dstContainerName(dstContainerName_), dstChannelMask(dstChannelMask_),
     rate(rate_), bits(bits_), dither(dither_), pdf(pdf_), mixMatrix(mixMatrix_),
     seed(seed_), att(att_), peak(peak_), minPhase(minPhase_), quiet(quiet_), debug(debug_), mt(mt_),
-    l2mindftflen(l2mindftflen_), src(src_), dst(dst_), impulsePeriod(impulsePeriod_), sweepLength(sweepLength_),
+    l2mindftflen(l2mindftflen_), nSegments(nSegments_), nThreads(nThreads_), pipelineDepth(pipelineDepth_), src(src_), dst(dst_), impulsePeriod(impulsePeriod_), sweepLength(sweepLength_),
     sweepStart(sweepStart_), sweepEnd(sweepEnd_), generatorNch(generatorNch_), generatorFs(generatorFs_), profile(profile_) {}
 
   void execute() {
@@ -319,14 +408,29 @@ struct Pipeline {
     const int32_t clipMax = bits != 8 ? +(1LL << (bits - 1)) - 1 : 0xff;
     const int32_t offset  = bits != 8 ? 0 : 0x80;
 
+    shared_ptr<Executor> executor = sharedExecutor ? sharedExecutor : nThreads != 0 ? make_shared<Executor>(nThreads) : nullptr;
+
+    // With --memLimit, the source is read ahead in up to a quarter of
+    // the budget. The rest is given to the blocks passed to the writer
+    // once the filters are set up.
+    const size_t readAheadBytes = memLimit / 4;
+
     shared_ptr<OutletProvider<REAL>> origin;
 
     switch(src) {
     case FILEIN:
-      origin = make_shared<WavReader<REAL>>(srcfn, mt);
+      if (rawIn) {
+	origin = make_shared<WavReader<REAL>>(srcfn, rawInFormat, mt, executor, readAheadBytes);
+      } else {
+	origin = make_shared<WavReader<REAL>>(srcfn, mt && nSegments == 0, 0, executor, readAheadBytes);
+      }
       break;
     case STDIN:
-      origin = make_shared<WavReader<REAL>>(mt);
+      if (rawIn) {
+	origin = make_shared<WavReader<REAL>>("", rawInFormat, mt, executor, readAheadBytes);
+      } else {
+	origin = make_shared<WavReader<REAL>>(mt, executor, readAheadBytes);
+      }
       break;
     case IMPULSE:
       origin = make_shared<ImpulseGenerator<REAL>>
@@ -345,13 +449,15 @@ struct Pipeline {
     const int snch = srcFormat.channels, dnch = mixMatrix.size() == 0 ? snch : mixMatrix.size();
 
     if (mixMatrix.size() != 0 && mixMatrix[0].size() != (size_t)snch)
-      showUsage(argv0, "The number of channels in the source and the matrix you specified with --mixChannels do not match");
+      throw(runtime_error("The number of channels in the source and the matrix you specified with --mixChannels do not match"));
 
-    if (dstContainerName == "" && srcContainer.c == 0) dstContainerName = "RIFF";
+    const MixPlan mixPlan(mixMatrix, snch);
+
+    if (dstContainerName == "" && (srcContainer.c == 0 || srcContainer.c == ContainerFormat::RAW)) dstContainerName = "RIFF";
     if (dstContainerName == "" && srcContainer.c != 0) dstContainerName = to_string(srcContainer);
 
     if (availableContainers.count(dstContainerName) == 0)
-      showUsage(argv0, "There is no container of name \"" + dstContainerName + "\"");
+      throw(runtime_error(("There is no container of name \"" + dstContainerName + "\"").c_str()));
 
     const ContainerFormat dstContainer = availableContainers.at(dstContainerName);
 
@@ -366,7 +472,7 @@ struct Pipeline {
       break;
     case WavFormat::EXTENSIBLE:
       if (dstChannelMask == ~0ULL && mixMatrix.size() != 0)
-	showUsage(argv0, "You have to specify --channelMask because you specified --mixChannels and the source format tag is extensible");
+	throw(runtime_error("You have to specify --channelMask because you specified --mixChannels and the source format tag is extensible"));
 
       dstFormat =
 	WavFormat(WavFormat::EXTENSIBLE, dnch, dfs, abs(bits), srcFormat.channelMask,
@@ -374,7 +480,7 @@ struct Pipeline {
       if (dstChannelMask != ~0ULL) dstFormat.channelMask = dstChannelMask;
       break;
     default:
-      showUsage(argv0, "Unsupported format tag in the source wav");
+      throw(runtime_error("Unsupported format tag in the source wav"));
       break;
     }
 
@@ -390,7 +496,7 @@ struct Pipeline {
     }
 
     if (dither != -1 && shaperid == -1)
-      showUsage(argv0, "Dither type " + to_string(dither) + " is not available for destination sampling frequency " + to_string(dfs) + "Hz");
+      throw(runtime_error(("Dither type " + to_string(dither) + " is not available for destination sampling frequency " + to_string(dfs) + "Hz").c_str()));
 
     if (l2mindftflen < 0) l2mindftflen += profile.log2dftfilterlen + 1;
 
@@ -433,7 +539,10 @@ struct Pipeline {
 	  }
 	  cerr << "];";
 	}
-	cerr << endl << endl;
+	cerr << endl;
+	cerr << "mixBefore = "    << mixPlan.pre.size() << " channels" << endl;
+	cerr << "mixAfter = "     << mixPlan.post.size() << " channels" << endl;
+	cerr << "nResampled = "   << mixPlan.nResampled << endl << endl;
       }
 
       cerr << "profileName = "  << profileName << endl;
@@ -458,6 +567,12 @@ struct Pipeline {
       cerr << "minPhase = "     << minPhase << endl;
       cerr << "l2mindftflen = " << l2mindftflen << endl;
       cerr << "mt = "           << mt << endl;
+      cerr << "nSegments = "    << nSegments << endl;
+      cerr << "nThreads = "     << nThreads << endl;
+      cerr << "pipelineDepth = " << pipelineDepth << endl;
+      cerr << "rangeStart = "   << rangeStart << endl;
+      cerr << "rangeLength = "  << rangeLength << endl;
+      cerr << "memLimit = "     << memLimit << endl;
       cerr << endl;
 
       if (src == IMPULSE || src == SWEEP) {
@@ -471,77 +586,155 @@ struct Pipeline {
       timeBeforeInit = timeus();
     }
 
+    // The stages whose buffers are accounted for, with their names
+    vector<pair<string, function<size_t()>>> stages;
+
+    stages.emplace_back("source", [origin]() { return origin->getMemoryUsage(); });
+
     shared_ptr<OutletProvider<REAL>> in = origin;
 
-    if (mixMatrix.size() != 0) in = make_shared<ChannelMixer<REAL>>(in, mixMatrix);
+    if (mixPlan.pre.size() != 0) {
+      in = make_shared<ChannelMixer<REAL>>(in, mixPlan.pre);
+      stages.emplace_back("mixer", [in]() { return in->getMemoryUsage(); });
+    }
 
     double delay = 0;
 
-    if (shaperid == -1 || bits < 0) {
-      vector<shared_ptr<ssrc::StageOutlet<REAL>>> out(dnch);
-      size_t nFrames = 0;
-
-      for(int i=0;i<dnch;i++) {
-	auto ssrc = make_shared<SSRC<REAL>>(in->getOutlet(i), sfs, dfs,
-					    profile.log2dftfilterlen, profile.aa, profile.guard, pow(10, att/-20.0), minPhase, l2mindftflen, mt);
-	out[i] = ssrc;
-	delay = ssrc->getDelay();
-
-	if (dst == STDOUT) {
-	  auto buf = make_shared<BufferStage<REAL>>(ssrc);
-	  out[i] = buf;
-	  buf->execute();
-	  nFrames = max(nFrames, buf->size());
+    shared_ptr<SegmentedSSRC<REAL>> segmented;
+    shared_ptr<RangeSSRC<REAL>> ranged;
+
+    if (nSegments != 0) {
+      auto openAt = [this, &mixPlan](uint64_t pos) {
+	shared_ptr<OutletProvider<REAL>> p = make_shared<WavReader<REAL>>(srcfn, false, pos);
+	if (mixPlan.pre.size() != 0) p = make_shared<ChannelMixer<REAL>>(p, mixPlan.pre);
+	return p;
+      };
+
+      segmented = make_shared<SegmentedSSRC<REAL>>(openAt, dynamic_pointer_cast<WavReader<REAL>>(origin)->getNFrames(),
+						   sfs, dfs, nSegments, profile.log2dftfilterlen, profile.aa, profile.guard,
+						   pow(10, att/-20.0), minPhase, l2mindftflen, mt, executor);
+      stages.emplace_back("segments", [segmented]() { return segmented->getMemoryUsage(); });
+    }
+
+    if (rangeStart != 0 || rangeLength >= 0) {
+      // Only a source file is opened again at a later frame. The other
+      // sources are converted from the start, which is all they need
+      // without --start.
+      auto openAt = [this, in, executor, readAheadBytes, &stages, &mixPlan](uint64_t pos) {
+	if (pos == 0) return in;
+	auto r = make_shared<WavReader<REAL>>(srcfn, mt, pos, executor, readAheadBytes);
+	stages.emplace_back("source at " + to_string(pos), [r]() { return r->getMemoryUsage(); });
+	shared_ptr<OutletProvider<REAL>> p = r;
+	if (mixPlan.pre.size() != 0) {
+	  p = make_shared<ChannelMixer<REAL>>(p, mixPlan.pre);
+	  stages.emplace_back("mixer at " + to_string(pos), [p]() { return p->getMemoryUsage(); });
 	}
+	return p;
+      };
+
+      ranged = make_shared<RangeSSRC<REAL>>(openAt, sfs, dfs, llround(rangeStart * dfs),
+					    rangeLength < 0 ? UINT64_MAX : (uint64_t)llround(rangeLength * dfs),
+					    profile.log2dftfilterlen, profile.aa, profile.guard, pow(10, att/-20.0),
+					    minPhase, l2mindftflen, mt, executor, pipelineDepth);
+      stages.emplace_back("range", [ranged]() { return ranged->getMemoryUsage(); });
+    }
+
+    auto resampler = [&](int i) -> shared_ptr<StageOutlet<REAL>> {
+      if (ranged) {
+	delay = ranged->getDelay();
+	return ranged->getOutlet(i);
       }
 
-      auto writer = dst == FILEOUT ? make_shared<WavWriter<REAL>>(dstfn, dstFormat, dstContainer, out, 0, BUFSIZE, mt) :
-	make_shared<WavWriter<REAL>>("", dstFormat, dstContainer, out, nFrames, BUFSIZE, mt);
+      if (segmented) {
+	delay = segmented->getDelay();
+	return segmented->getOutlet(i);
+      }
 
-      timeBeforeExec = timeus();
+      auto ssrc = make_shared<SSRC<REAL>>(in->getOutlet(i), sfs, dfs,
+					  profile.log2dftfilterlen, profile.aa, profile.guard, pow(10, att/-20.0), minPhase, l2mindftflen, mt,
+					  executor, mt ? pipelineDepth : 0);
+      stages.emplace_back("ssrc " + to_string(i), [ssrc]() { return ssrc->getMemoryUsage(); });
+      delay = ssrc->getDelay();
+      return ssrc;
+    };
 
-      writer->execute();
-    } else {
-      vector<shared_ptr<ssrc::StageOutlet<int32_t>>> out(dnch);
-      size_t nFrames = 0;
-
-      for(int i=0;i<dnch;i++) {
-	std::shared_ptr<DoubleRNG> rng;
-	if (pdf == 0) {
-	  rng = createTriangularRNG(peak, seed + i);
-	} else {
-	  rng = make_shared<RectangularRNG>(-peak, peak, seed + i);
-	}
+    // The writer holds depth blocks per channel in memory and in the
+    // file format. The scratch buffers of the filters grow to hold a
+    // block at the rates inside the filters, and the queues of the
+    // source may be depth blocks ahead.
+    const unsigned depth = 3;
 
-	auto ssrc = make_shared<SSRC<REAL>>(in->getOutlet(i), sfs, dfs,
-					    profile.log2dftfilterlen, profile.aa, profile.guard, pow(10, att/-20.0), minPhase, l2mindftflen, mt);
+    auto blockFrames = [&](size_t sampleSize) -> size_t {
+      if (memLimit == 0) return BUFSIZE;
 
-	delay = ssrc->getDelay();
+      size_t used = 0;
+      for(auto &s : stages) used += s.second();
 
-	auto dither = make_shared<Dither<int32_t, REAL>>(ssrc, gain, offset, clipMin, clipMax, &ssrc::noiseShaperCoef[shaperid], rng);
-	out[i] = dither;
+      const size_t perFrame = depth * (dnch * sampleSize + dstFormat.blockAlign) + sampleSize +
+	mixPlan.nResampled * sizeof(REAL) * 4 * ((sfs + dfs - 1) / dfs) +
+	(depth + 1) * ((sfs + dfs - 1) / dfs) * (snch + mixPlan.pre.size()) * sizeof(REAL);
+      const size_t n = used < memLimit ? (memLimit - used) / perFrame : 0;
 
-	if (dst == STDOUT) {
-	  auto buf = make_shared<BufferStage<int32_t>>(dither);
-	  out[i] = buf;
-	  buf->execute();
-	  nFrames = max(nFrames, buf->size());
-	}
+      if (n < MINBUFSIZE)
+	throw(runtime_error(("--memLimit must be at least " +
+			     to_string((used + MINBUFSIZE * perFrame + (1 << 20) - 1) >> 20) + " for this conversion.").c_str()));
+
+      return min(n, BUFSIZE);
+    };
+
+    auto showMemoryUsage = [&]() {
+      size_t total = 0;
+      cerr << endl;
+      for(auto &s : stages) {
+	const size_t n = s.second();
+	cerr << "Memory : " << s.first << " : " << n << " bytes" << endl;
+	total += n;
       }
+      cerr << "Memory : total : " << total << " bytes" << endl;
+    };
 
-      auto writer = dst == FILEOUT ? make_shared<WavWriter<int32_t>>(dstfn, dstFormat, dstContainer, out, 0, BUFSIZE, mt) :
-	make_shared<WavWriter<int32_t>>("", dstFormat, dstContainer, out, nFrames, BUFSIZE, mt);
+    vector<shared_ptr<ssrc::StageOutlet<REAL>>> out(mixPlan.nResampled);
+    for(int i=0;i<mixPlan.nResampled;i++) out[i] = resampler(i);
 
-      timeBeforeExec = timeus();
+    if (mixPlan.post.size() != 0) {
+      auto mixer = make_shared<ChannelMixer<REAL>>(make_shared<OutletList<REAL>>(out, dstFormat), mixPlan.post);
+      stages.emplace_back("mixer after ssrc", [mixer]() { return mixer->getMemoryUsage(); });
+      out.resize(dnch);
+      for(int i=0;i<dnch;i++) out[i] = mixer->getOutlet(i);
+    }
 
-      writer->execute();
+    // The writer dithers and packs the resampled blocks in one pass
+    shared_ptr<WriterDither> writerDither;
+
+    if (shaperid != -1 && bits >= 0) {
+      writerDither = make_shared<WriterDither>();
+      writerDither->gain = gain;
+      writerDither->offset = offset;
+      writerDither->clipMin = clipMin;
+      writerDither->clipMax = clipMax;
+      writerDither->coef = &ssrc::noiseShaperCoef[shaperid];
+
+      // Each channel takes its own stream of the same seed
+      const DitherPDF ditherPDF = pdf == 0 ? DitherPDF::TRIANGULAR : pdf == 1 ? DitherPDF::RECTANGULAR : DitherPDF::GAUSSIAN;
+      for(int i=0;i<dnch;i++) writerDither->rng.push_back(createDitherRNG(ditherPDF, peak, seed, i));
     }
 
+    // An empty file name streams to STDOUT
+    auto writer = make_shared<WavWriter<REAL>>(dst == FILEOUT ? dstfn : "", dstFormat, dstContainer, out, 0,
+					       blockFrames(sizeof(REAL)), mt, executor, depth, ioFlags, writerDither);
+    stages.emplace_back("writer", [writer]() { return writer->getMemoryUsage(); });
+
+    timeBeforeExec = timeus();
+
+    writer->execute();
+
+    if (debug) showMemoryUsage();
+
     if (debug) {
       cerr << endl << "Delay : " << delay << " samples" << endl;
       int64_t timeEnd = timeus();
       cerr << endl << "Elapsed time : " << ((timeEnd - timeBeforeInit) * 0.000001) << " seconds" << endl;
-      if (dst != STDOUT) cerr << "Processing time : " << ((timeEnd - timeBeforeExec) * 0.000001) << " seconds" << endl;
+      cerr << "Processing time : " << ((timeEnd - timeBeforeExec) * 0.000001) << " seconds" << endl;
     }
   }
 };
@@ -576,6 +769,42 @@ vector<vector<double>> parseMixString(const string &s) {
   }
 }
 
+vector<pair<string, string>> readBatchList(const string &fn) {
+  ifstream ifs(fn);
+  if (!ifs) throw(runtime_error(("readBatchList : could not open " + fn).c_str()));
+
+  vector<pair<string, string>> ret;
+  string line;
+
+  for(int lineNo = 1;getline(ifs, line);lineNo++) {
+    const string where = "readBatchList : " + fn + ":" + to_string(lineNo) + " : ";
+    vector<string> w;
+
+    for(size_t p = 0;;) {
+      p = line.find_first_not_of(" \t\r", p);
+      if (p == string::npos || (w.empty() && line[p] == '#')) break;
+
+      size_t q;
+      if (line[p] == '"') {
+	q = line.find('"', p + 1);
+	if (q == string::npos) throw(runtime_error((where + "unterminated quote").c_str()));
+	w.push_back(line.substr(p + 1, q - p - 1));
+	q++;
+      } else {
+	q = min(line.find_first_of(" \t\r", p), line.size());
+	w.push_back(line.substr(p, q - p));
+      }
+      p = q;
+    }
+
+    if (w.empty()) continue;
+    if (w.size() != 2) throw(runtime_error((where + "a source and a destination file name are expected").c_str()));
+    ret.push_back({ w[0], w[1] });
+  }
+
+  return ret;
+}
+
 int main(int argc, char **argv) {
   if (argc < 2) showUsage(argv[0], "");
 
@@ -587,10 +816,19 @@ int main(int argc, char **argv) {
   vector<vector<double>> mixMatrix;
   bool mt = true, quiet = false, debug = false;
   int l2mindftflen = 0;
+  unsigned nSegments = 0, nThreads = 0, pipelineDepth = 0, nJobs = 0, ioFlags = 0;
+  size_t memLimit = 0;
+  ThreadPolicy threadPolicy;
+  string batchfn;
 
   enum SrcType src = FILEIN;
   enum DstType dst = FILEOUT;
 
+  bool rawIn = false;
+  WavFormat rawInFormat;
+
+  double rangeStart = 0, rangeLength = -1;
+
   size_t impulsePeriod = 0, sweepLength = 0;
   double sweepStart = 0, sweepEnd = 0;
   int generatorNch = 1, generatorFs = 0;
@@ -702,6 +940,30 @@ int main(int argc, char **argv) {
     } else if (string(argv[nextArg]) == "--stdout") {
       dst = STDOUT;
       dstfn = "[STDOUT]";
+    } else if (string(argv[nextArg]) == "--rawIn") {
+      const string mes = "A format, the number of channels and a sampling rate are expected after --rawIn, e.g. s16,2,44100.";
+      if (nextArg+1 >= argc) showUsage(argv[0], mes);
+      const string arg = argv[nextArg+1];
+      const size_t c = arg.find(',');
+      if (c == string::npos || availableRawFormats.count(arg.substr(0, c)) == 0) showUsage(argv[0], mes);
+      const int64_t b = availableRawFormats.at(arg.substr(0, c));
+      char *p;
+      const unsigned long nch = strtoul(arg.c_str() + c + 1, &p, 0);
+      if (p == arg.c_str() + c + 1 || *p != ',' || nch == 0 || nch > 0xffff) showUsage(argv[0], mes);
+      char *q;
+      const unsigned long fs = strtoul(p + 1, &q, 0);
+      if (q == p + 1 || *q || fs == 0) showUsage(argv[0], mes);
+      rawInFormat = b < 0 ?
+	WavFormat(WavFormat::IEEE_FLOAT, nch, fs, -b) :
+	WavFormat(WavFormat::PCM       , nch, fs,  b);
+      rawIn = true;
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--rawOut") {
+      if (nextArg+1 >= argc || availableRawFormats.count(argv[nextArg+1]) == 0)
+	showUsage(argv[0], "A format (u8, s16, s24, s32, f32 or f64) is expected after --rawOut.");
+      bits = availableRawFormats.at(argv[nextArg+1]);
+      dstContainerName = "RAW";
+      nextArg++;
     } else if (string(argv[nextArg]) == "--dstContainer") {
       if (nextArg == 1 && argc == 2) showContainerOptions();
       if (nextArg+1 >= argc) showUsage(argv[0], "Specify a format/container name after --dstContainer");
@@ -712,6 +974,20 @@ int main(int argc, char **argv) {
       quiet = true;
     } else if (string(argv[nextArg]) == "--debug") {
       debug = true;
+    } else if (string(argv[nextArg]) == "--start") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      rangeStart = strtod(argv[nextArg+1], &p);
+      if (p == argv[nextArg+1] || *p || rangeStart < 0)
+	showUsage(argv[0], "A non-negative number is expected after --start.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--length") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      rangeLength = strtod(argv[nextArg+1], &p);
+      if (p == argv[nextArg+1] || *p || rangeLength < 0)
+	showUsage(argv[0], "A non-negative number is expected after --length.");
+      nextArg++;
     } else if (string(argv[nextArg]) == "--st") {
       mt = false;
     } else if (string(argv[nextArg]) == "--minPhase") {
@@ -723,6 +999,45 @@ int main(int argc, char **argv) {
       if (p == argv[nextArg+1] || *p)
 	showUsage(argv[0], "An integer is expected after --partConv.");
       nextArg++;
+    } else if (string(argv[nextArg]) == "--segments") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      nSegments = strtoul(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || nSegments == 0)
+	showUsage(argv[0], "A positive integer is expected after --segments.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--threads") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      nThreads = strtoul(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || nThreads == 0)
+	showUsage(argv[0], "A positive integer is expected after --threads.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--pipeline") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      pipelineDepth = strtoul(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || pipelineDepth == 0)
+	showUsage(argv[0], "A positive integer is expected after --pipeline.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--memLimit") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      memLimit = strtoull(argv[nextArg+1], &p, 0) << 20;
+      if (p == argv[nextArg+1] || *p || memLimit == 0)
+	showUsage(argv[0], "A positive integer is expected after --memLimit.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--batch") {
+      if (nextArg+1 >= argc) showUsage(argv[0], "Specify a list file name after --batch");
+      batchfn = argv[nextArg+1];
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--jobs") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      nJobs = strtoul(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || nJobs == 0)
+	showUsage(argv[0], "A positive integer is expected after --jobs.");
+      nextArg++;
     } else if (string(argv[nextArg]) == "--seed") {
       if (nextArg+1 >= argc) showUsage(argv[0]);
       char *p;
@@ -737,6 +1052,35 @@ int main(int argc, char **argv) {
       if (p == argv[nextArg+1] || *p)
 	showUsage(argv[0], "A positive integer is expected after --channelMask.");
       nextArg++;
+    } else if (string(argv[nextArg]) == "--affinity") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      try {
+	threadPolicy.cpus = ThreadPolicy::parseCPUList(argv[nextArg+1]);
+      } catch(exception &ex) {
+	showUsage(argv[0], ex.what());
+      }
+      if (threadPolicy.cpus.empty()) showUsage(argv[0], "A list of CPUs is expected after --affinity.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--numaNode") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      threadPolicy.numaNode = strtol(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || threadPolicy.numaNode < 0)
+	showUsage(argv[0], "A non-negative integer is expected after --numaNode.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--rtPriority") {
+      if (nextArg+1 >= argc) showUsage(argv[0]);
+      char *p;
+      threadPolicy.rtPriority = strtol(argv[nextArg+1], &p, 0);
+      if (p == argv[nextArg+1] || *p || threadPolicy.rtPriority <= 0)
+	showUsage(argv[0], "A positive integer is expected after --rtPriority.");
+      nextArg++;
+    } else if (string(argv[nextArg]) == "--flushDenormals") {
+      threadPolicy.flushDenormals = true;
+    } else if (string(argv[nextArg]) == "--asyncIO") {
+      ioFlags |= WavWriter<float>::ASYNC_IO | WavWriter<float>::PREALLOCATE;
+    } else if (string(argv[nextArg]) == "--directIO") {
+      ioFlags |= WavWriter<float>::ASYNC_IO | WavWriter<float>::PREALLOCATE | WavWriter<float>::DIRECT_IO;
     } else if (string(argv[nextArg]) == "--mixChannels") {
       if (nextArg+1 >= argc) showUsage(argv[0]);
       try {
@@ -758,27 +1102,70 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (src == FILEIN) {
-    if (nextArg < argc) {
-      srcfn = argv[nextArg++];
-    } else {
-      showUsage(argv[0], "Specify a source file name.");
+  vector<pair<string, string>> files;
+
+  if (src == FILEIN && dst == FILEOUT) {
+    for(;nextArg < argc;nextArg += 2) {
+      if (nextArg+1 >= argc) showUsage(argv[0], "Specify a destination file name.");
+      files.push_back({ argv[nextArg], argv[nextArg+1] });
     }
-  } else if (!quiet && src == STDIN) {
-    cerr << "Warning : --stdin is an experimental feature. This function may not work in every environment." << endl;
-  }
 
-  if (dst == FILEOUT) {
-    if (nextArg < argc) {
-      dstfn = argv[nextArg++];
-    } else {
-      showUsage(argv[0], "Specify a destination file name.");
+    if (batchfn != "") {
+      try {
+	auto v = readBatchList(batchfn);
+	files.insert(files.end(), v.begin(), v.end());
+      } catch(exception &ex) {
+	showUsage(argv[0], ex.what());
+      }
+      if (files.empty()) showUsage(argv[0], "No file is listed in " + batchfn);
+    }
+
+    if (files.empty()) showUsage(argv[0], "Specify a source file name.");
+
+    srcfn = files[0].first;
+    dstfn = files[0].second;
+  } else {
+    if (batchfn != "") showUsage(argv[0], "--batch cannot be used with --stdin, --stdout or a generator.");
+
+    if (src == FILEIN) {
+      if (nextArg < argc) {
+	srcfn = argv[nextArg++];
+      } else {
+	showUsage(argv[0], "Specify a source file name.");
+      }
+    } else if (!quiet && src == STDIN && !rawIn) {
+      cerr << "Warning : --stdin is an experimental feature. This function may not work in every environment." << endl;
+    }
+
+    if (dst == FILEOUT) {
+      if (nextArg < argc) {
+	dstfn = argv[nextArg++];
+      } else {
+	showUsage(argv[0], "Specify a destination file name.");
+      }
     }
+
+    if (nextArg != argc) showUsage(argv[0], "Extra arguments after the destination file name.");
   }
 
-  if (nextArg != argc) showUsage(argv[0], "Extra arguments after the destination file name.");
+  if (nSegments != 0 && (src != FILEIN || rawIn))
+    showUsage(argv[0], "--segments can be used only when the source is a WAV file.");
+
+  if (rangeStart != 0 && (src != FILEIN || rawIn))
+    showUsage(argv[0], "--start can be used only when the source is a WAV file.");
+
+  if (nSegments != 0 && (rangeStart != 0 || rangeLength >= 0))
+    showUsage(argv[0], "--segments cannot be used with --start or --length.");
+
+  // The segments hold their output until it is written, which the
+  // buffer sizes chosen for --memLimit do not take into account
+  if (nSegments != 0 && memLimit != 0)
+    showUsage(argv[0], "--segments cannot be used with --memLimit.");
 
-  if (pdf > 1)
+  if (rawIn && src != FILEIN && src != STDIN)
+    showUsage(argv[0], "--rawIn cannot be used with a generator.");
+
+  if (pdf > 2)
     showUsage(argv[0], "PDF ID " + to_string(pdf) + " is not supported");
 
   if (bits != 8 && bits != 16 && bits != 24 && bits != 32 && bits != -32 && bits != -64)
@@ -800,26 +1187,88 @@ int main(int argc, char **argv) {
 
   //
 
-  try {
+  // The main thread and the batch drivers take the CPUs in turn with
+  // the threads of the library
+  setThreadPolicy(threadPolicy);
+  if (!applyThreadPolicy())
+    cerr << "Warning : The thread policy could not be fully applied." << endl;
+
+  auto convert = [&](const string &srcfn, const string &dstfn, shared_ptr<Executor> executor) {
     if (!profile.doublePrecision) {
       Pipeline<float> pipeline(argv[0], srcfn, dstfn, profileName, dstContainerName,
 			       dstChannelMask, rate, bits, dither, pdf, mixMatrix,
-			       seed, att, peak, minPhase, quiet, debug, mt, l2mindftflen,
+			       seed, att, peak, minPhase, quiet, debug, mt, l2mindftflen, nSegments, nThreads, pipelineDepth,
 			       src, dst, impulsePeriod, sweepLength,
 			       sweepStart, sweepEnd, generatorNch, generatorFs, profile);
+      pipeline.sharedExecutor = executor;
+      pipeline.ioFlags = ioFlags;
+      pipeline.rawIn = rawIn;
+      pipeline.rawInFormat = rawInFormat;
+      pipeline.rangeStart = rangeStart;
+      pipeline.rangeLength = rangeLength;
+      pipeline.memLimit = files.size() <= 1 ? memLimit : memLimit / nJobs;
       pipeline.execute();
     } else {
       Pipeline<double> pipeline(argv[0], srcfn, dstfn, profileName, dstContainerName,
 				dstChannelMask, rate, bits, dither, pdf, mixMatrix,
-				seed, att, peak, minPhase, quiet, debug, mt, l2mindftflen,
+				seed, att, peak, minPhase, quiet, debug, mt, l2mindftflen, nSegments, nThreads, pipelineDepth,
 				src, dst, impulsePeriod, sweepLength,
 				sweepStart, sweepEnd, generatorNch, generatorFs, profile);
+      pipeline.sharedExecutor = executor;
+      pipeline.ioFlags = ioFlags;
+      pipeline.rawIn = rawIn;
+      pipeline.rawInFormat = rawInFormat;
+      pipeline.rangeStart = rangeStart;
+      pipeline.rangeLength = rangeLength;
+      pipeline.memLimit = files.size() <= 1 ? memLimit : memLimit / nJobs;
       pipeline.execute();
     }
-  } catch(exception &ex) {
-    cerr << argv[0] << " Error : " << ex.what() << endl;
-    return -1;
+  };
+
+  if (files.size() <= 1) {
+    try {
+      convert(srcfn, dstfn, nullptr);
+    } catch(exception &ex) {
+      cerr << argv[0] << " Error : " << ex.what() << endl;
+      return -1;
+    }
+
+    return 0;
   }
 
-  return 0;
+  // Batch conversion. All files share one pool, so that the filters,
+  // the DFT plans and the threads are set up only once, and the pool
+  // bounds the number of threads doing the work. Up to nJobs files are
+  // converted at the same time.
+
+  shared_ptr<Executor> executor = nThreads != 0 ? make_shared<Executor>(nThreads) : Executor::getDefault();
+  if (nJobs == 0) nJobs = executor->getNThreads();
+  nJobs = min<size_t>(nJobs, files.size());
+
+  atomic<size_t> nextFile = 0;
+  atomic<bool> failed = false;
+  mutex mtx;
+
+  auto worker = [&]() {
+    for(size_t i;(i = nextFile++) < files.size();) {
+      try {
+	convert(files[i].first, files[i].second, executor);
+	if (!quiet) {
+	  unique_lock lock(mtx);
+	  cerr << files[i].first << " -> " << files[i].second << endl;
+	}
+      } catch(exception &ex) {
+	unique_lock lock(mtx);
+	cerr << argv[0] << " Error : " << files[i].first << " : " << ex.what() << endl;
+	failed = true;
+      }
+    }
+  };
+
+  vector<thread> th;
+  for(unsigned j=1;j<nJobs;j++) th.emplace_back([&]() { applyThreadPolicy(); worker(); });
+  worker();
+  for(auto &t : th) t.join();
+
+  return failed ? -1 : 0;
 }
@@ -4,10 +4,17 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <coroutine>
+
+namespace shibatch { class BGExecutor; }
 
 namespace ssrc {
   struct WavFormat {
@@ -47,6 +54,9 @@ namespace ssrc {
     static const inline uint16_t RIFF = 0x1000, RIFX = 0x1001, W64 = 0x1002;
     static const inline uint16_t RF64 = 0x1003, AIFF = 0x1004;
 
+    /** Headerless interleaved little-endian PCM */
+    static const inline uint16_t RAW = 0x1005;
+
     uint16_t c;
 
     ContainerFormat(uint16_t c_) : c(c_) {}
@@ -60,6 +70,7 @@ namespace ssrc {
     case ContainerFormat::W64:  return "W64";
     case ContainerFormat::RF64: return "RF64";
     case ContainerFormat::AIFF: return "AIFF";
+    case ContainerFormat::RAW:  return "RAW";
     default:                    return "N/A";
     }
   }
@@ -82,6 +93,62 @@ namespace ssrc {
      * If not EOF and no data is available for reading, it must block.
      */
     virtual size_t read(T *ptr, size_t n) = 0;
+
+    /**
+     * Returns the bytes held by the buffers of this stage, excluding
+     * the stages it reads from.
+     */
+    virtual size_t getMemoryUsage() { return 0; }
+  };
+
+  /**
+   * The non-blocking counterpart of StageOutlet. readAsync() starts
+   * reading up to n samples into ptr and returns at once. done is
+   * called when the read finishes, possibly on another thread. It gets
+   * the number of samples read, which is 0 only when EOF, or the
+   * exception thrown by the read. Only one read may be in progress at
+   * a time. Inside a coroutine, co_await read(ptr, n) suspends until
+   * the read finishes and returns the number of samples read.
+   */
+  template<typename T>
+  class AsyncStageOutlet {
+  public:
+    virtual ~AsyncStageOutlet() = default;
+    virtual bool atEnd() = 0;
+    virtual void readAsync(T *ptr, size_t n, std::function<void(size_t, std::exception_ptr)> done) = 0;
+
+    class ReadAwaiter {
+      AsyncStageOutlet &outlet;
+      T *const ptr;
+      const size_t n;
+      size_t z = 0;
+      std::exception_ptr ex = nullptr;
+
+      // Whichever of await_suspend() and the completion comes last
+      // resumes the coroutine
+      std::atomic<bool> arrived = false;
+
+    public:
+      ReadAwaiter(AsyncStageOutlet &outlet_, T *ptr_, size_t n_) : outlet(outlet_), ptr(ptr_), n(n_) {}
+
+      bool await_ready() { return false; }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+	outlet.readAsync(ptr, n, [this, h](size_t z_, std::exception_ptr ex_) {
+	  z = z_;
+	  ex = ex_;
+	  if (arrived.exchange(true)) h.resume();
+	});
+	return !arrived.exchange(true);
+      }
+
+      size_t await_resume() {
+	if (ex) std::rethrow_exception(ex);
+	return z;
+      }
+    };
+
+    ReadAwaiter read(T *ptr, size_t n) { return ReadAwaiter(*this, ptr, n); }
   };
 
   template<typename T>
@@ -91,6 +158,12 @@ namespace ssrc {
     virtual std::shared_ptr<StageOutlet<T>> getOutlet(uint32_t channel) = 0;
     virtual WavFormat getFormat() = 0;
     virtual ContainerFormat getContainer() { return ContainerFormat(0); }
+
+    /**
+     * Returns the bytes held by the buffers of this stage, excluding
+     * the stages it reads from.
+     */
+    virtual size_t getMemoryUsage() { return 0; }
   };
 
   class DoubleRNG {
@@ -99,50 +172,301 @@ namespace ssrc {
     virtual void fill(double *ptr, size_t n) {
       for(;n>0;n--) *ptr++ = nextDouble();
     }
+
+    /** Makes the next number the position-th one of the sequence */
+    virtual void seek(uint64_t position) { throw(std::runtime_error("DoubleRNG::seek not supported")); }
+
     virtual ~DoubleRNG() = default;
   };
 
+  /**
+   * A pool of worker threads that runs the background jobs of the
+   * stages. Stages that are not given an executor share the default
+   * pool, which has as many threads as there are hardware threads.
+   * Jobs with a higher priority are started first; a running job is
+   * never preempted.
+   */
+  class Executor {
+  public:
+    class ExecutorImpl;
+    enum Priority { HIGH = 0, NORMAL = 1, LOW = 2 };
+
+    /** Creates a pool of nThreads_ threads. 0 means the number of hardware threads. */
+    Executor(unsigned nThreads_ = 0, Priority priority_ = NORMAL);
+
+    /** Shares the threads of pool_, submitting jobs with priority_ */
+    Executor(const Executor &pool_, Priority priority_);
+
+    ~Executor();
+    unsigned getNThreads();
+    Priority getPriority();
+
+    static std::shared_ptr<Executor> getDefault();
+  private:
+    std::shared_ptr<class ExecutorImpl> impl;
+    Priority priority;
+    friend class shibatch::BGExecutor;
+  };
+
+  /**
+   * Makes a blocking outlet awaitable. Each read runs as a job on the
+   * executor, so many streams can be read by coroutines while only the
+   * threads of the executor block.
+   */
+  template<typename T>
+  class AsyncOutletAdapter : public AsyncStageOutlet<T> {
+  public:
+    class AsyncOutletAdapterImpl;
+    AsyncOutletAdapter(std::shared_ptr<StageOutlet<T>> in_, std::shared_ptr<Executor> executor_ = nullptr);
+    ~AsyncOutletAdapter();
+    bool atEnd();
+    void readAsync(T *ptr, size_t n, std::function<void(size_t, std::exception_ptr)> done);
+  private:
+    std::shared_ptr<class AsyncOutletAdapterImpl> impl;
+  };
+
+  /**
+   * Makes an AsyncStageOutlet usable as an ordinary inlet by blocking
+   * until each read finishes. It must not be read from a thread that
+   * the asynchronous outlet needs in order to finish the read.
+   */
+  template<typename T>
+  class BlockingOutletAdapter : public StageOutlet<T> {
+  public:
+    class BlockingOutletAdapterImpl;
+    BlockingOutletAdapter(std::shared_ptr<AsyncStageOutlet<T>> in_);
+    ~BlockingOutletAdapter();
+    bool atEnd();
+    size_t read(T *ptr, size_t n);
+  private:
+    std::shared_ptr<class BlockingOutletAdapterImpl> impl;
+  };
+
+  /**
+   * Settings applied to every thread the library creates, when the
+   * thread starts. Threads that are already running are not affected.
+   * Settings that the system refuses, e.g. SCHED_FIFO without the
+   * privilege, are silently skipped for the library threads.
+   */
+  struct ThreadPolicy {
+    /** The threads are pinned to these CPUs in turn. Empty means no pinning. */
+    std::vector<unsigned> cpus;
+
+    /** If cpus is empty, the threads are confined to the CPUs of this NUMA node. -1 means any node. */
+    int numaNode = -1;
+
+    /** SCHED_FIFO priority. 0 leaves the scheduling policy unchanged. */
+    int rtPriority = 0;
+
+    /** Flush denormal results and operands to zero (FTZ and DAZ) */
+    bool flushDenormals = false;
+
+    /** Applies the policy to the calling thread. Returns false if any setting failed. */
+    bool apply(unsigned index = 0) const;
+
+    /** Parses a CPU list such as "0-3,8,10-11" */
+    static std::vector<unsigned> parseCPUList(const std::string &list);
+
+    /** Returns the CPUs of a NUMA node, or an empty list if unknown */
+    static std::vector<unsigned> getNumaNodeCPUs(unsigned node);
+  };
+
+  void setThreadPolicy(const ThreadPolicy &policy);
+  ThreadPolicy getThreadPolicy();
+
+  /**
+   * Applies the policy given to setThreadPolicy() to the calling
+   * thread, which takes the next of the CPUs in turn together with the
+   * library threads. Returns false if any setting failed.
+   */
+  bool applyThreadPolicy();
+
+  /**
+   * Converts the sampling rate of one channel. If pipelineDepth_ is not
+   * zero, the polyphase filter and the DFT filter are decoupled by a
+   * queue of that many blocks and run on different threads.
+   */
   template<typename REAL>
   class SSRC : public StageOutlet<REAL> {
   public:
     class SSRCImpl;
     SSRC(std::shared_ptr<StageOutlet<REAL>> inlet_, int64_t sfs_, int64_t dfs_,
 	 unsigned log2dftfilterlen_ = 10, double aa_ = 80, double guard_ = 1, double gain_ = 1,
-	 bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true);
+	 bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+	 std::shared_ptr<Executor> executor_ = nullptr, unsigned pipelineDepth_ = 0);
     ~SSRC();
     bool atEnd();
     size_t read(REAL *ptr, size_t n);
     double getDelay();
+    size_t getMemoryUsage();
   private:
     std::shared_ptr<class SSRCImpl> impl;
   };
 
+  /**
+   * Converts the sampling rate of one channel in push mode. process()
+   * converts the given input on the calling thread and returns as much
+   * of the output that has become available as fits in out; the rest
+   * is returned first by the next call. flush() marks the end of the
+   * input and returns the remaining output, and is called until it
+   * returns 0. No thread is started and no lock is taken. The output
+   * counts depend only on the sequence of calls.
+   */
+  template<typename REAL>
+  class PushSSRC {
+  public:
+    class PushSSRCImpl;
+    PushSSRC(int64_t sfs_, int64_t dfs_, unsigned log2dftfilterlen_ = 10, double aa_ = 80, double guard_ = 1, double gain_ = 1,
+	     bool minPhase_ = false, unsigned l2mindftflen_ = 0);
+    ~PushSSRC();
+    size_t process(const REAL *in, size_t nIn, REAL *out, size_t outCap);
+    size_t flush(REAL *out, size_t outCap);
+    bool atEnd();
+    double getDelay();
+  private:
+    std::shared_ptr<class PushSSRCImpl> impl;
+  };
+
+  /**
+   * Converts a seekable source by dividing it into time segments,
+   * nSegments_ of which are converted in parallel. openAt_(pos) must
+   * return a provider whose outlets start at frame pos of the source.
+   * The output is bit-identical to that of SSRC with the same
+   * parameters. A segment gives at most about 2^20 output frames per
+   * channel, which are held until every channel has read them.
+   */
+  template<typename REAL>
+  class SegmentedSSRC : public OutletProvider<REAL> {
+  public:
+    class SegmentedSSRCImpl;
+    SegmentedSSRC(std::function<std::shared_ptr<OutletProvider<REAL>>(uint64_t)> openAt_, uint64_t nFrames_,
+		  int64_t sfs_, int64_t dfs_, unsigned nSegments_,
+		  unsigned log2dftfilterlen_ = 10, double aa_ = 80, double guard_ = 1, double gain_ = 1,
+		  bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+		  std::shared_ptr<Executor> executor_ = nullptr);
+    ~SegmentedSSRC();
+    std::shared_ptr<StageOutlet<REAL>> getOutlet(uint32_t channel);
+    WavFormat getFormat();
+    double getDelay();
+    size_t getMemoryUsage();
+  private:
+    std::shared_ptr<class SegmentedSSRCImpl> impl;
+  };
+
+  /**
+   * Converts only the part of a seekable source that gives the output
+   * samples [outStart_, outStart_ + outLength_) of SSRC with the same
+   * parameters. openAt_(pos) must return a provider whose outlets
+   * start at frame pos of the source. The source is opened just early
+   * enough for the filters to warm up, so the cost is proportional to
+   * the length of the range. The output is bit-identical to that range
+   * of the output of SSRC. UINT64_MAX for outLength_ means up to the
+   * end.
+   */
+  template<typename REAL>
+  class RangeSSRC : public OutletProvider<REAL> {
+  public:
+    class RangeSSRCImpl;
+    RangeSSRC(std::function<std::shared_ptr<OutletProvider<REAL>>(uint64_t)> openAt_,
+	      int64_t sfs_, int64_t dfs_, uint64_t outStart_, uint64_t outLength_,
+	      unsigned log2dftfilterlen_ = 10, double aa_ = 80, double guard_ = 1, double gain_ = 1,
+	      bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+	      std::shared_ptr<Executor> executor_ = nullptr, unsigned pipelineDepth_ = 0);
+    ~RangeSSRC();
+    std::shared_ptr<StageOutlet<REAL>> getOutlet(uint32_t channel);
+    WavFormat getFormat();
+    double getDelay();
+    size_t getMemoryUsage();
+  private:
+    std::shared_ptr<class RangeSSRCImpl> impl;
+  };
+
+  /**
+   * Reads a WAV file, or STDIN. In MT mode, a source that cannot be
+   * mapped is read ahead in two chunks of 1M frames each, or of
+   * readAheadBytes_ bytes in total if it is not zero.
+   */
   template<typename T>
   class WavReader : public OutletProvider<T> {
   public:
     class WavReaderImpl;
     WavReader(const std::string &filename, bool mt_ = true);
-    WavReader(bool mt_ = true);
+    WavReader(const std::string &filename, bool mt_, uint64_t startFrame_, std::shared_ptr<Executor> executor_ = nullptr,
+	      size_t readAheadBytes_ = 0);
+    WavReader(bool mt_ = true, std::shared_ptr<Executor> executor_ = nullptr, size_t readAheadBytes_ = 0);
+
+    /**
+     * Reads headerless raw PCM of format rawFormat_ from filename, or
+     * from STDIN if filename is empty. The frames are read in large
+     * chunks without seeking, so that STDIN can be a pipe.
+     */
+    WavReader(const std::string &filename, const WavFormat &rawFormat_, bool mt_ = true,
+	      std::shared_ptr<Executor> executor_ = nullptr, size_t readAheadBytes_ = 0);
     ~WavReader();
     std::shared_ptr<StageOutlet<T>> getOutlet(uint32_t channel);
     WavFormat getFormat();
     ContainerFormat getContainer();
+    uint64_t getNFrames();
+    size_t getMemoryUsage();
   private:
     std::shared_ptr<class WavReaderImpl> impl;
   };
 
+  /**
+   * Dither applied by WavWriter as it packs the samples, with the
+   * parameters of Dither and an RNG per channel. The file is the same
+   * as when the outlets of Dither<int32_t, T> are written.
+   */
+  struct WriterDither {
+    double gain = 1;
+    int32_t offset = 0, clipMin = 0, clipMax = 0;
+    const NoiseShaperCoef *coef = nullptr;
+    std::vector<std::shared_ptr<DoubleRNG>> rng;
+  };
+
   template<typename T>
   class WavWriter {
   public:
     class WavWriterImpl;
+
+    /**
+     * Flags for ioFlags_, which take effect on Linux when writing to a
+     * file. ASYNC_IO keeps several writes in flight with io_uring,
+     * DIRECT_IO bypasses the page cache, and PREALLOCATE allocates the
+     * space ahead of the writes. The latter two require ASYNC_IO.
+     */
+    static const inline unsigned ASYNC_IO = 1, DIRECT_IO = 2, PREALLOCATE = 4;
+
     WavWriter(const std::string &filename, const WavFormat& fmt, const ContainerFormat& cont_,
-	      const std::vector<std::shared_ptr<StageOutlet<T>>> &in_, uint64_t nFrames = 0, size_t bufsize_ = 65536, bool mt_ = true);
+	      const std::vector<std::shared_ptr<StageOutlet<T>>> &in_, uint64_t nFrames = 0, size_t bufsize_ = 65536, bool mt_ = true,
+	      std::shared_ptr<Executor> executor_ = nullptr, unsigned depth_ = 3, unsigned ioFlags_ = 0,
+	      std::shared_ptr<WriterDither> dither_ = nullptr);
     ~WavWriter();
     void execute();
+
+    /**
+     * Returns the bytes held by the buffers, which are about
+     * depth_ * bufsize_ times the size of a sample in memory and in the
+     * file, per channel, in MT mode.
+     */
+    size_t getMemoryUsage();
   private:
     std::shared_ptr<class WavWriterImpl> impl;
   };
 
+  /** The probability distribution functions of dither */
+  enum class DitherPDF { RECTANGULAR, TRIANGULAR, GAUSSIAN };
+
+  /**
+   * Creates a counter-based RNG. The n-th number of a sequence is
+   * computed from seed, stream and n alone, so that each channel is
+   * given its own stream, seek() moves to any block, and fill() runs
+   * in SIMD lanes. The numbers range over [-peak, peak] with the
+   * rectangular and triangular PDFs. The Gaussian PDF has the power
+   * of the triangular PDF of the same peak.
+   */
+  std::shared_ptr<DoubleRNG> createDitherRNG(DitherPDF pdf, double peak, uint64_t seed, uint64_t stream = 0);
+
   std::shared_ptr<DoubleRNG> createTriangularRNG(double peak = 1.0,
     uint64_t seed = std::chrono::high_resolution_clock::now().time_since_epoch().count());
 
@@ -155,10 +479,38 @@ namespace ssrc {
     ~Dither();
     bool atEnd();
     size_t read(OUTTYPE *ptr, size_t n);
+    size_t getMemoryUsage();
   private:
     std::shared_ptr<class DitherImpl> impl;
   };
 
+  /**
+   * Dithers several channels with the same noise shaper, processing
+   * the channels side by side. Each channel is given its own RNG. The
+   * inlets are read a chunk at a time by whichever outlet needs more
+   * samples, so they are pulled on one thread. The output of each
+   * channel is identical to that of Dither.
+   */
+  template<typename OUTTYPE, typename INTYPE>
+  class MultiChannelDither {
+  public:
+    class MultiChannelDitherImpl;
+    MultiChannelDither(const std::vector<std::shared_ptr<StageOutlet<INTYPE>>> &in_, double gain_, int32_t offset_,
+		       int32_t clipMin_, int32_t clipMax_, const ssrc::NoiseShaperCoef *coef_,
+		       const std::vector<std::shared_ptr<DoubleRNG>> &rng_);
+    ~MultiChannelDither();
+    std::shared_ptr<StageOutlet<OUTTYPE>> getOutlet(uint32_t c);
+    size_t getMemoryUsage();
+  private:
+    std::shared_ptr<class MultiChannelDitherImpl> impl;
+  };
+
+  /**
+   * Mixes the input channels into matrix_.size() output channels,
+   * each row giving the gains of the input channels. An output that
+   * passes one input through unscaled may be given the outlet of the
+   * input itself.
+   */
   template<typename T>
   class ChannelMixer : public OutletProvider<T> {
   public:
@@ -167,6 +519,7 @@ namespace ssrc {
     ~ChannelMixer();
     std::shared_ptr<ssrc::StageOutlet<T>> getOutlet(uint32_t c);
     WavFormat getFormat();
+    size_t getMemoryUsage();
   private:
     std::shared_ptr<class ChannelMixerImpl> impl;
   };
@@ -15,6 +15,13 @@ typedef char const * ssrc_soxr_error_t;
 typedef enum {
   SSRC_SOXR_FLOAT32, SSRC_SOXR_FLOAT32_I = SSRC_SOXR_FLOAT32,
   SSRC_SOXR_FLOAT64, SSRC_SOXR_FLOAT64_I = SSRC_SOXR_FLOAT64,
+  SSRC_SOXR_INT32, SSRC_SOXR_INT32_I = SSRC_SOXR_INT32,
+  SSRC_SOXR_INT16, SSRC_SOXR_INT16_I = SSRC_SOXR_INT16,
+
+  // The buffers of the split types are arrays of pointers to the
+  // samples of each channel
+  SSRC_SOXR_SPLIT = 4,
+  SSRC_SOXR_FLOAT32_S = SSRC_SOXR_SPLIT, SSRC_SOXR_FLOAT64_S, SSRC_SOXR_INT32_S, SSRC_SOXR_INT16_S,
 } ssrc_soxr_datatype_t;
 
 // io_spec
@@ -31,6 +38,8 @@ ssrc_soxr_io_spec_t ssrc_soxr_io_spec(
   ssrc_soxr_datatype_t itype,
   ssrc_soxr_datatype_t otype);
 
+// INT16 output is dithered with TPDF noise unless SSRC_SOXR_NO_DITHER
+// is given in flags or ditherType
 #define SSRC_SOXR_TPDF 0
 #define SSRC_SOXR_NO_DITHER 8
 
@@ -104,6 +113,15 @@ typedef enum {
   SOXR_FLOAT32_I = SSRC_SOXR_FLOAT32,
   SOXR_FLOAT64   = SSRC_SOXR_FLOAT64,
   SOXR_FLOAT64_I = SSRC_SOXR_FLOAT64,
+  SOXR_INT32     = SSRC_SOXR_INT32,
+  SOXR_INT32_I   = SSRC_SOXR_INT32,
+  SOXR_INT16     = SSRC_SOXR_INT16,
+  SOXR_INT16_I   = SSRC_SOXR_INT16,
+  SOXR_SPLIT     = SSRC_SOXR_SPLIT,
+  SOXR_FLOAT32_S = SSRC_SOXR_FLOAT32_S,
+  SOXR_FLOAT64_S = SSRC_SOXR_FLOAT64_S,
+  SOXR_INT32_S   = SSRC_SOXR_INT32_S,
+  SOXR_INT16_S   = SSRC_SOXR_INT16_S,
 } soxr_datatype_t;
 
 static inline soxr_io_spec_t soxr_io_spec(soxr_datatype_t itype, soxr_datatype_t otype) {
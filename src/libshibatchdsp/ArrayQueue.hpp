@@ -17,6 +17,8 @@ namespace shibatch {
   public:
     size_t size() { return sumsize - pos; }
 
+    size_t getMemoryUsage() { return sumsize * sizeof(T); }
+
     void write(std::vector<T> &&v) {
       sumsize += v.size();
       queue.push_back(std::move(v));
@@ -0,0 +1,98 @@
+#ifndef ASYNCOUTLET_HPP
+#define ASYNCOUTLET_HPP
+
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <functional>
+
+#include "BGExecutor.hpp"
+
+#include "shibatch/ssrc.hpp"
+
+template<typename T> class ssrc::AsyncOutletAdapter<T>::AsyncOutletAdapterImpl {
+public:
+  virtual ~AsyncOutletAdapterImpl() = default;
+};
+
+template<typename T> class ssrc::BlockingOutletAdapter<T>::BlockingOutletAdapterImpl {
+public:
+  virtual ~BlockingOutletAdapterImpl() = default;
+};
+
+namespace shibatch {
+  /**
+   * Runs each read of a blocking outlet as a job on the executor. The
+   * job owns the state it needs, so the adapter can be destroyed from
+   * within the completion of its last read.
+   */
+  template<typename T>
+  class AsyncOutletAdapterStage : public ssrc::AsyncOutletAdapter<T>::AsyncOutletAdapterImpl {
+    struct State {
+      std::shared_ptr<ssrc::StageOutlet<T>> inlet;
+      std::atomic<bool> endReached = false;
+
+      State(std::shared_ptr<ssrc::StageOutlet<T>> inlet_) : inlet(inlet_) {}
+    };
+
+    std::shared_ptr<State> state;
+    std::shared_ptr<ssrc::Executor> executor;
+
+  public:
+    AsyncOutletAdapterStage(std::shared_ptr<ssrc::StageOutlet<T>> in_, std::shared_ptr<ssrc::Executor> executor_) :
+      state(std::make_shared<State>(in_)), executor(executor_ ? executor_ : ssrc::Executor::getDefault()) {}
+
+    bool atEnd() { return state->endReached; }
+
+    void readAsync(T *ptr, size_t n, std::function<void(size_t, std::exception_ptr)> done) {
+      BGExecutor::post(executor, Runnable::factory([s = state, ptr, n, done](void *) {
+	size_t z = 0;
+	std::exception_ptr ex = nullptr;
+	try {
+	  z = s->inlet->read(ptr, n);
+	  if (z == 0) s->endReached = true;
+	} catch(...) {
+	  ex = std::current_exception();
+	}
+	done(z, ex);
+      }));
+    }
+  };
+
+  template<typename T>
+  class BlockingOutletAdapterStage : public ssrc::BlockingOutletAdapter<T>::BlockingOutletAdapterImpl {
+    struct Result {
+      size_t z = 0;
+      std::exception_ptr ex = nullptr;
+      std::atomic<bool> done = false;
+    };
+
+    std::shared_ptr<ssrc::AsyncStageOutlet<T>> inlet;
+    bool endReached = false;
+
+  public:
+    BlockingOutletAdapterStage(std::shared_ptr<ssrc::AsyncStageOutlet<T>> in_) : inlet(in_) {}
+
+    bool atEnd() { return endReached; }
+
+    size_t read(T *ptr, size_t n) {
+      if (endReached || n == 0) return 0;
+
+      // The completion may still be running when read() returns, so the
+      // result is kept alive by the completion itself
+      auto r = std::make_shared<Result>();
+      inlet->readAsync(ptr, n, [r](size_t z, std::exception_ptr ex) {
+	r->z = z;
+	r->ex = ex;
+	r->done.store(true, std::memory_order_release);
+	r->done.notify_one();
+      });
+
+      r->done.wait(false, std::memory_order_acquire);
+      if (r->ex) std::rethrow_exception(r->ex);
+      if (r->z == 0) endReached = true;
+      return r->z;
+    }
+  };
+}
+#endif // #ifndef ASYNCOUTLET_HPP
@@ -2,8 +2,18 @@
 #define BGEXECUTOR_HPP
 
 #include <queue>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <functional>
 
+#include "shibatch/ssrc.hpp"
+
+class ssrc::Executor::ExecutorImpl {
+public:
+  virtual ~ExecutorImpl() = default;
+};
+
 namespace shibatch {
   class Runnable {
     class BGExecutor* belongsTo = nullptr;
@@ -13,21 +23,52 @@ namespace shibatch {
     virtual ~Runnable() {}
 
     friend class BGExecutor;
-    friend class BGExecutorStatic;
+    friend class WorkStealingPool;
 
     static class std::shared_ptr<Runnable> factory(std::function<void(void *)> run, void *p=nullptr,
 						   std::function<void(void *, void *)> post = nullptr, void *q=nullptr);
   };
 
+  /**
+   * Jobs pushed to a BGExecutor are run by the pool of the given
+   * ssrc::Executor, or by the default pool. pop() returns finished jobs in the order of completion and must be
+   * called from one thread at a time; push() may be called from any thread.
+   */
   class BGExecutor {
+    struct Completion {
+      std::shared_ptr<Runnable> job;
+      Completion *next;
+    };
+
+    // Finished jobs are pushed here by the workers without taking a lock
+    std::atomic<Completion *> completed = nullptr;
+    std::atomic<uint32_t> nCompleted = 0;
+    std::atomic<void *> waiter = nullptr;
+    std::atomic<unsigned> nCompleting = 0;
+
     std::queue<std::shared_ptr<Runnable>> que;
-    size_t size_ = 0;
+    std::atomic<size_t> size_ = 0;
+
+    const std::shared_ptr<ssrc::Executor> executor;
+    class WorkStealingPool *pool;
+
+    void complete(std::shared_ptr<Runnable> job);
+    bool drain();
   public:
+    BGExecutor(std::shared_ptr<ssrc::Executor> executor_ = nullptr);
+    ~BGExecutor();
     void push(std::shared_ptr<Runnable> job);
     std::shared_ptr<Runnable> pop();
+
+    /** Returns a finished job without blocking, or nullptr if there is none */
+    std::shared_ptr<Runnable> tryPop();
     size_t size();
+    unsigned getNThreads();
+
+    /** Runs job on the pool of executor without keeping track of its completion */
+    static void post(std::shared_ptr<ssrc::Executor> executor, std::shared_ptr<Runnable> job);
 
-    friend class BGExecutorStatic;
+    friend class WorkStealingPool;
   };
 }
 #endif // #ifndef BGEXECUTOR_HPP
@@ -6,6 +6,8 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <algorithm>
+#include <stdexcept>
 
 #include "shibatch/ssrc.hpp"
 #include "ArrayQueue.hpp"
@@ -16,77 +18,196 @@ public:
 };
 
 namespace shibatch {
+  /**
+   * The matrix is compiled into a plan that keeps the nonzero
+   * coefficients of each row. An output that takes one input as it
+   * is, where no other output reads that input, is given the outlet
+   * of the input itself, so its samples are not copied. This is done
+   * only if every input is read by some output, since the source may
+   * keep buffering the samples of an input that is never read.
+   *
+   * The other outputs are computed a chunk at a time from the inputs
+   * they use, one coefficient at a time over the chunk, and queued in
+   * their outlets. Each queue has its own lock, so that an outlet with
+   * samples queued is read without touching the inputs. The inputs
+   * are read under another lock by whichever outlet runs out of
+   * samples.
+   */
   template<typename T>
   class ChannelMixerStage : public ssrc::OutletProvider<T>, public ssrc::ChannelMixer<T>::ChannelMixerImpl {
     class Outlet : public ssrc::StageOutlet<T> {
       ChannelMixerStage &parent;
       shibatch::ArrayQueue<T> queue;
+      std::mutex mtx;
     public:
       Outlet(ChannelMixerStage &parent_) : parent(parent_) {}
 
       bool atEnd() {
-	std::unique_lock lock(parent.mtx);
+	{
+	  std::unique_lock lock(mtx);
+	  if (queue.size() != 0) return false;
+	}
+	std::unique_lock plock(parent.mtx);
+	std::unique_lock lock(mtx);
 	return queue.size() == 0 && parent.allInputAtEnd();
       }
 
       size_t read(T *ptr, size_t n) {
-	std::unique_lock lock(parent.mtx);
-	size_t s = queue.size();
-	if (s < n) s += parent.refill(n - s);
-	if (s > n) s = n;
-	return queue.read(ptr, s);
+	{
+	  std::unique_lock lock(mtx);
+	  if (queue.size() != 0) return queue.read(ptr, n);
+	}
+	{
+	  // The queues are only locked after parent.mtx
+	  std::unique_lock plock(parent.mtx);
+	  std::unique_lock lock(mtx);
+	  if (queue.size() == 0) {
+	    lock.unlock();
+	    parent.refill(n);
+	  }
+	}
+	std::unique_lock lock(mtx);
+	return queue.read(ptr, n);
       }
 
       friend ChannelMixerStage;
     };
-    
+
+    struct Term {
+      unsigned slot; // Index into src
+      double coef;
+    };
+
+    static const size_t N = 4096;
+
     std::shared_ptr<ssrc::OutletProvider<T>> in;
     const std::vector<std::vector<double>> matrix;
     ssrc::WavFormat format;
     const unsigned snch, dnch;
-    std::vector<std::shared_ptr<Outlet>> out;
-    std::vector<std::vector<T>> buf;
+    std::vector<std::shared_ptr<ssrc::StageOutlet<T>>> outlet;
+
+    // The inputs read by refill() and the outputs computed from them
+    std::vector<unsigned> src;
+    std::vector<std::shared_ptr<Outlet>> mixed;
+    std::vector<std::vector<Term>> plan;
+
+    std::vector<std::vector<T>> ibuf;
+    std::vector<double> acc;
+    std::vector<T> obuf;
     std::mutex mtx;
 
+    void compile() {
+      std::vector<unsigned> nUse(snch);
+      for(unsigned oc=0;oc<dnch;oc++)
+	for(unsigned ic=0;ic<snch;ic++) if (matrix[oc][ic] != 0) nUse[ic]++;
+
+      const bool allUsed = std::find(nUse.begin(), nUse.end(), 0) == nUse.end();
+
+      std::vector<int> slot(snch, -1);
+      outlet.resize(dnch);
+
+      for(unsigned oc=0;oc<dnch;oc++) {
+	std::vector<Term> t;
+	for(unsigned ic=0;ic<snch;ic++) if (matrix[oc][ic] != 0) t.push_back({ ic, matrix[oc][ic] });
+
+	if (allUsed && t.size() == 1 && t[0].coef == 1 && nUse[t[0].slot] == 1) {
+	  outlet[oc] = in->getOutlet(t[0].slot);
+	  continue;
+	}
+
+	for(auto &e : t) {
+	  if (slot[e.slot] == -1) {
+	    slot[e.slot] = src.size();
+	    src.push_back(e.slot);
+	  }
+	  e.slot = slot[e.slot];
+	}
+
+	mixed.push_back(std::make_shared<Outlet>(*this));
+	plan.push_back(t);
+	outlet[oc] = mixed.back();
+      }
+
+      // Inputs that no output reads are still read and discarded
+      if (!mixed.empty()) {
+	for(unsigned ic=0;ic<snch;ic++) if (nUse[ic] == 0) src.push_back(ic);
+      }
+
+      ibuf.resize(src.size(), std::vector<T>(N));
+      if (!mixed.empty()) {
+	acc.resize(N);
+	obuf.resize(N);
+      }
+    }
+
+    // Queues up to n samples of each mixed output. Returns 0 at the end
+    // of all inputs.
     size_t refill(size_t n) {
-      for(unsigned c=0;c<buf.size();c++) buf[c].resize(n);
+      const size_t m = std::min(n, N);
 
       size_t nRead = 0;
-      for(unsigned ic=0;ic<snch;ic++) {
-	size_t z = in->getOutlet(ic)->read(buf[ic].data(), n);
-	memset(buf[ic].data() + z, 0, (n - z) * sizeof(T));
+      for(unsigned s=0;s<src.size();s++) {
+	auto inlet = in->getOutlet(src[s]);
+	size_t z = 0;
+	for(size_t r;z < m && (r = inlet->read(ibuf[s].data() + z, m - z)) != 0;) z += r;
+	memset(ibuf[s].data() + z, 0, (m - z) * sizeof(T));
 	nRead = std::max(nRead, z);
       }
 
-      std::vector<T> v(dnch);
-      for(size_t pos = 0;pos < nRead;pos++) {
-	for(unsigned oc = 0;oc < dnch;oc++) {
-	  double s = 0;
-	  for(unsigned ic = 0;ic < snch;ic++) s += buf[ic][pos] * matrix[oc][ic];
-	  v[oc] = s;
+      if (nRead == 0) return 0;
+
+      for(unsigned k=0;k<mixed.size();k++) {
+	const std::vector<Term> &t = plan[k];
+
+	if (t.size() == 1 && t[0].coef == 1) {
+	  memcpy(obuf.data(), ibuf[t[0].slot].data(), nRead * sizeof(T));
+	} else {
+	  std::fill(acc.begin(), acc.begin() + nRead, 0.0);
+	  for(const Term &e : t) {
+	    const T *x = ibuf[e.slot].data();
+	    const double coef = e.coef;
+	    for(size_t p=0;p<nRead;p++) acc[p] += x[p] * coef;
+	  }
+	  for(size_t p=0;p<nRead;p++) obuf[p] = acc[p];
 	}
-	for(unsigned oc = 0;oc < dnch;oc++) buf[oc][pos] = v[oc];
-      }
 
-      for(unsigned oc = 0;oc < dnch;oc++) out[oc]->queue.write(buf[oc].data(), nRead);
+	std::unique_lock lock(mixed[k]->mtx);
+	mixed[k]->queue.write(obuf.data(), nRead);
+      }
 
       return nRead;
     }
 
     bool allInputAtEnd() {
-      for(unsigned ic = 0;ic < snch;ic++) if (!in->getOutlet(ic)->atEnd()) return false;
+      for(unsigned ic : src) if (!in->getOutlet(ic)->atEnd()) return false;
       return true;
     }
   public:
     ChannelMixerStage(std::shared_ptr<ssrc::OutletProvider<T>> in_, const std::vector<std::vector<double>>& matrix_) :
       in(in_), matrix(matrix_), format(in_->getFormat()), snch(format.channels), dnch(matrix.size()) {
+      for(auto &row : matrix)
+	if (row.size() != snch) throw(std::runtime_error("ChannelMixerStage::ChannelMixerStage row size != number of input channels"));
       format.channels = dnch;
-      buf.resize(std::max(snch, dnch));
-      for(unsigned i=0;i<dnch;i++) out.push_back(std::make_shared<Outlet>(*this));
+      compile();
+    }
+
+    std::shared_ptr<ssrc::StageOutlet<T>> getOutlet(uint32_t c) {
+      if (c >= outlet.size()) throw(std::runtime_error("ChannelMixerStage::getOutlet channel too large"));
+      return outlet[c];
     }
 
-    std::shared_ptr<ssrc::StageOutlet<T>> getOutlet(uint32_t c) { return out[c]; }
     ssrc::WavFormat getFormat() { return format; }
+
+    size_t getMemoryUsage() {
+      std::unique_lock lock(mtx);
+      size_t n = acc.capacity() * sizeof(double) + obuf.capacity() * sizeof(T);
+      for(auto &b : ibuf) n += b.capacity() * sizeof(T);
+      for(auto o : mixed) {
+	std::unique_lock olock(o->mtx);
+	n += o->queue.getMemoryUsage();
+      }
+      return n;
+    }
   };
 }
 #endif // #ifndef MIXER_HPP
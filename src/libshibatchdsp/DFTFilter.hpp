@@ -61,6 +61,10 @@ namespace shibatch {
 
     bool atEnd() { return fractionLen > 0 || !endReached; }
 
+    size_t getMemoryUsage() {
+      return (dftlen * 2 + overlapbuf.capacity() + fractionBuf.capacity()) * sizeof(REAL);
+    }
+
     size_t read(REAL *RESTRICT out, size_t nSamples) {
       size_t ret = 0;
 
@@ -4,26 +4,159 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <stdexcept>
 #include <cstdint>
+#include <cstring>
 #include <cmath>
 
 #include "shibatch/ssrc.hpp"
 #include "RNG.hpp"
+#include "ArrayQueue.hpp"
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932384626433832795028842
+#endif
 
 template<typename OUTTYPE, typename INTYPE> class ssrc::Dither<OUTTYPE, INTYPE>::DitherImpl {
 public:
   virtual ~DitherImpl() = default;
 };
 
+template<typename OUTTYPE, typename INTYPE> class ssrc::MultiChannelDither<OUTTYPE, INTYPE>::MultiChannelDitherImpl {
+public:
+  virtual ~MultiChannelDitherImpl() = default;
+};
+
 namespace shibatch {
-  class TriangularDoubleRNG : public ssrc::DoubleRNG {
+  /**
+   * A DoubleRNG over Philox4x32. The n-th number is made from the
+   * block of the counter whose lower half is n and whose upper half is
+   * the stream, under the seed as the key. fill() computes the blocks
+   * of a run of counters at a time.
+   */
+  class CounterDoubleRNG : public ssrc::DoubleRNG {
+    static const size_t N = 256;
+
+    const ssrc::DitherPDF pdf;
     const double peak;
-    std::shared_ptr<shibatch::RNG> rng;
+    const uint64_t seed, stream;
+    uint64_t position = 0;
+    uint32_t x0[N], x1[N], x2[N], x3[N];
+
+    // Takes the upper 52 bits to [0, 1)
+    static double toDouble(uint32_t lo, uint32_t hi) {
+      uint64_t u = (((uint64_t(hi) << 32) | lo) >> 12) | 0x3ff0000000000000ULL;
+      double d;
+      memcpy(&d, &u, sizeof(double));
+      return d - 1.0;
+    }
+
   public:
-    TriangularDoubleRNG(double peak_, std::shared_ptr<shibatch::RNG> rng_ = std::make_shared<shibatch::TLCG64>()) :
-      peak(peak_), rng(rng_) {}
-    double nextDouble() { return rng->nextTriangularDouble(peak); }
-    ~TriangularDoubleRNG() {}
+    CounterDoubleRNG(ssrc::DitherPDF pdf_, double peak_, uint64_t seed_, uint64_t stream_) :
+      pdf(pdf_), peak(peak_), seed(seed_), stream(stream_) {}
+
+    void seek(uint64_t position_) { position = position_; }
+
+    double nextDouble() {
+      double d = 0;
+      fill(&d, 1);
+      return d;
+    }
+
+    void fill(double *ptr, size_t n) {
+      while(n > 0) {
+	const size_t m = std::min(n, N);
+
+	for(size_t i=0;i<m;i++) {
+	  x0[i] = uint32_t(position + i);
+	  x1[i] = uint32_t((position + i) >> 32);
+	  x2[i] = uint32_t(stream);
+	  x3[i] = uint32_t(stream >> 32);
+	}
+
+	Philox4x32::generate(x0, x1, x2, x3, m, seed);
+
+	switch(pdf) {
+	case ssrc::DitherPDF::RECTANGULAR:
+	  for(size_t i=0;i<m;i++) ptr[i] = -peak + toDouble(x0[i], x1[i]) * (2 * peak);
+	  break;
+	case ssrc::DitherPDF::TRIANGULAR:
+	  for(size_t i=0;i<m;i++) ptr[i] = (toDouble(x0[i], x1[i]) - toDouble(x2[i], x3[i])) * peak;
+	  break;
+	case ssrc::DitherPDF::GAUSSIAN: {
+	  // Box-Muller, with the variance peak^2/6 of the triangular PDF
+	  const double sigma = peak / sqrt(6.0);
+	  for(size_t i=0;i<m;i++)
+	    ptr[i] = sigma * sqrt(-2 * log(1.0 - toDouble(x0[i], x1[i]))) * cos(2 * M_PI * toDouble(x2[i], x3[i]));
+	} break;
+	}
+
+	ptr += m;
+	n -= m;
+	position += m;
+      }
+    }
+  };
+
+  /**
+   * Quantizes interleaved frames of nch channels, feeding the errors
+   * back through the noise shaper. The channels share the
+   * coefficients, and the inner loops run across the channels, so
+   * that each channel takes a SIMD lane. Each row of the circular
+   * buffer of the errors is stored twice, so that the last len rows
+   * are always contiguous and nothing is shifted.
+   */
+  template<typename OUTTYPE, typename INTYPE>
+  class NoiseShaper {
+    const size_t nch;
+    const int32_t clipMin, clipMax;
+    const ssrc::NoiseShaperCoef *coef;
+    std::vector<INTYPE> hist;
+    std::vector<double> h;
+    size_t pos = 0;
+
+  public:
+    NoiseShaper(size_t nch_, int32_t clipMin_, int32_t clipMax_, const ssrc::NoiseShaperCoef *coef_) :
+      nch(nch_), clipMin(clipMin_), clipMax(clipMax_), coef(coef_), hist(coef->len * 2 * nch_), h(nch_) {}
+
+    size_t getMemoryUsage() { return hist.capacity() * sizeof(INTYPE) + h.capacity() * sizeof(double); }
+
+    // x holds the scaled input and rnd the dither, nch values per frame
+    void process(OUTTYPE *out, const double *x, const double *rnd, size_t nFrames) {
+      const double *shaperCoefs = coef->coefs;
+      const int shaperLen = coef->len;
+
+      if (shaperLen == 0) {
+	for(size_t i=0;i<nFrames * nch;i++) out[i] = rint(x[i] + rnd[i]);
+	return;
+      }
+
+      for(size_t p=0;p<nFrames;p++, x += nch, rnd += nch, out += nch) {
+	const INTYPE *w = hist.data() + pos * nch;
+
+	for(size_t c=0;c<nch;c++) h[c] = shaperCoefs[shaperLen-1] * w[(shaperLen-1) * nch + c];
+
+	for(int i=shaperLen-2;i>=0;i--) {
+	  const double k = shaperCoefs[i];
+	  const INTYPE *e = w + i * nch;
+	  for(size_t c=0;c<nch;c++) h[c] += k * e[c];
+	}
+
+	pos = pos == 0 ? shaperLen - 1 : pos - 1;
+	INTYPE *e0 = hist.data() + pos * nch, *e1 = e0 + shaperLen * nch;
+
+	for(size_t c=0;c<nch;c++) {
+	  const double xc = x[c] + h[c];
+	  const double q = rint(xc + rnd[c]);
+	  const double qc = std::min(std::max(q, (double)clipMin), (double)clipMax);
+	  INTYPE e = qc - xc;
+	  if (qc != q) e = std::min(std::max(e, (INTYPE)-1), (INTYPE)1);
+	  e0[c] = e1[c] = e;
+	  out[c] = qc;
+	}
+      }
+    }
   };
 
   template<typename OUTTYPE, typename INTYPE>
@@ -31,59 +164,139 @@ namespace shibatch {
   public:
     std::shared_ptr<ssrc::StageOutlet<INTYPE>> inlet;
     const double gain;
-    const int32_t offset, clipMin, clipMax;
-    const ssrc::NoiseShaperCoef *coef;
+    const int32_t offset;
     std::shared_ptr<ssrc::DoubleRNG> rng;
-    std::vector<INTYPE> buf, in;
-    std::vector<double> rndbuf;
+    NoiseShaper<OUTTYPE, INTYPE> shaper;
+    std::vector<INTYPE> in;
+    std::vector<double> x, rndbuf;
 
     DitherStage(std::shared_ptr<ssrc::StageOutlet<INTYPE>> in_, double gain_, int32_t offset_, int32_t clipMin_, int32_t clipMax_,
 	       const ssrc::NoiseShaperCoef *coef_, std::shared_ptr<ssrc::DoubleRNG> rng_) :
-      inlet(in_), gain(gain_), offset(offset_), clipMin(clipMin_), clipMax(clipMax_), coef(coef_), rng(rng_) {
-      buf.resize(coef->len);
-    }
+      inlet(in_), gain(gain_), offset(offset_), rng(rng_), shaper(1, clipMin_, clipMax_, coef_) {}
 
     bool atEnd() { return inlet->atEnd(); }
 
-    size_t read(OUTTYPE *out, size_t nSamples) {
-      const double *shaperCoefs = coef->coefs;
-      const int shaperLen = coef->len;
+    size_t getMemoryUsage() {
+      return in.capacity() * sizeof(INTYPE) + (x.capacity() + rndbuf.capacity()) * sizeof(double) + shaper.getMemoryUsage();
+    }
 
+    size_t read(OUTTYPE *out, size_t nSamples) {
       if (in.size() < nSamples) in.resize(nSamples);
       nSamples = inlet->read(in.data(), nSamples);
 
+      x.resize(std::max(x.size(), nSamples));
       rndbuf.resize(std::max(rndbuf.size(), nSamples));
       rng->fill(rndbuf.data(), nSamples);
 
-      if (shaperLen != 0) {
-	for(size_t p=0;p<nSamples;p++) {
-	  double h = shaperCoefs[shaperLen-1] * buf[shaperLen-1];
+      for(size_t p=0;p<nSamples;p++) x[p] = gain * in[p] + offset;
+      shaper.process(out, x.data(), rndbuf.data(), nSamples);
 
-	  for(int i=shaperLen-2;i>=0;i--) {
-	    h += shaperCoefs[i] * buf[i];
-	    buf[i+1] = buf[i];
-	  }
+      return nSamples;
+    }
+  };
 
-	  double x = gain * in[p] + offset + h;
-	  double q = rint(x + rndbuf[p]);
-	  buf[0] = q - x;
+  /**
+   * Dithers all channels together with NoiseShaper. The outlets read
+   * all inlets under one lock, as ChannelMixerStage does, a chunk at a
+   * time, and the samples of the other channels are queued. Channels
+   * that end earlier are padded with zeros, and the samples made from
+   * the padding are not queued. The output of each channel is that of
+   * DitherStage.
+   */
+  template<typename OUTTYPE, typename INTYPE>
+  class MultiChannelDitherStage : public ssrc::MultiChannelDither<OUTTYPE, INTYPE>::MultiChannelDitherImpl {
+    class Outlet : public ssrc::StageOutlet<OUTTYPE> {
+      MultiChannelDitherStage &parent;
+      shibatch::ArrayQueue<OUTTYPE> queue;
+    public:
+      Outlet(MultiChannelDitherStage &parent_) : parent(parent_) {}
 
-	  if (q < clipMin || q > clipMax) {
-	    if (q < clipMin) q = clipMin;
-	    if (q > clipMax) q = clipMax;
-	    buf[0] = q - x;
-	    if (buf[0] < -1) buf[0] = -1;
-	    if (buf[0] >  1) buf[0] =  1;
-	  }
+      bool atEnd() {
+	std::unique_lock lock(parent.mtx);
+	return queue.size() == 0 && parent.allInputAtEnd();
+      }
 
-	  out[p] = q;
-	}
-      } else {
-	for(size_t p=0;p<nSamples;p++)
-	  out[p] = rint(gain * in[p] + offset + rndbuf[p]);
+      size_t read(OUTTYPE *ptr, size_t n) {
+	std::unique_lock lock(parent.mtx);
+	while(queue.size() < n && parent.refill()) ;
+	return queue.read(ptr, n);
       }
 
-      return nSamples;
+      friend MultiChannelDitherStage;
+    };
+
+    static const size_t N = 4096;
+
+    const std::vector<std::shared_ptr<ssrc::StageOutlet<INTYPE>>> inlet;
+    const size_t nch;
+    const double gain;
+    const int32_t offset;
+    const std::vector<std::shared_ptr<ssrc::DoubleRNG>> rng;
+    std::vector<std::shared_ptr<Outlet>> out;
+    NoiseShaper<OUTTYPE, INTYPE> shaper;
+
+    std::vector<INTYPE> in;
+    std::vector<size_t> nIn;
+    std::vector<double> x, rnd, rndbuf;
+    std::vector<OUTTYPE> q, obuf;
+    std::mutex mtx;
+
+    bool allInputAtEnd() {
+      for(auto i : inlet) if (!i->atEnd()) return false;
+      return true;
+    }
+
+    // Returns false at the end of all inlets
+    bool refill() {
+      size_t m = 0;
+      for(size_t c=0;c<nch;c++) {
+	size_t z = 0;
+	for(size_t r;z < N && (r = inlet[c]->read(in.data() + z, N - z)) != 0;) z += r;
+	nIn[c] = z;
+	m = std::max(m, z);
+	for(size_t p=0;p<z;p++) x[p * nch + c] = gain * in[p] + offset;
+	for(size_t p=z;p<N;p++) x[p * nch + c] = offset;
+      }
+
+      if (m == 0) return false;
+
+      for(size_t c=0;c<nch;c++) {
+	rng[c]->fill(rndbuf.data(), m);
+	for(size_t p=0;p<m;p++) rnd[p * nch + c] = rndbuf[p];
+      }
+
+      shaper.process(q.data(), x.data(), rnd.data(), m);
+
+      for(size_t c=0;c<nch;c++) {
+	if (nIn[c] == 0) continue;
+	for(size_t p=0;p<nIn[c];p++) obuf[p] = q[p * nch + c];
+	out[c]->queue.write(obuf.data(), nIn[c]);
+      }
+
+      return true;
+    }
+
+  public:
+    MultiChannelDitherStage(const std::vector<std::shared_ptr<ssrc::StageOutlet<INTYPE>>> &in_, double gain_, int32_t offset_,
+			    int32_t clipMin_, int32_t clipMax_, const ssrc::NoiseShaperCoef *coef_,
+			    const std::vector<std::shared_ptr<ssrc::DoubleRNG>> &rng_) :
+      inlet(in_), nch(in_.size()), gain(gain_), offset(offset_), rng(rng_), shaper(in_.size(), clipMin_, clipMax_, coef_),
+      in(N), nIn(in_.size()), x(N * in_.size()), rnd(N * in_.size()), rndbuf(N), q(N * in_.size()), obuf(N) {
+      if (rng.size() != nch) throw(std::runtime_error("MultiChannelDitherStage::MultiChannelDitherStage rng_.size() != in_.size()"));
+      for(size_t c=0;c<nch;c++) out.push_back(std::make_shared<Outlet>(*this));
+    }
+
+    std::shared_ptr<ssrc::StageOutlet<OUTTYPE>> getOutlet(uint32_t c) {
+      if (c >= out.size()) throw(std::runtime_error("MultiChannelDitherStage::getOutlet channel too large"));
+      return out[c];
+    }
+
+    size_t getMemoryUsage() {
+      std::unique_lock lock(mtx);
+      size_t n = in.capacity() * sizeof(INTYPE) + (x.capacity() + rnd.capacity() + rndbuf.capacity()) * sizeof(double) +
+	(q.capacity() + obuf.capacity()) * sizeof(OUTTYPE) + shaper.getMemoryUsage();
+      for(auto o : out) n += o->queue.getMemoryUsage();
+      return n;
     }
   };
 }
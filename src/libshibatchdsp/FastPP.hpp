@@ -25,17 +25,26 @@ namespace shibatch {
       fircoef.resize(sstep);
       for(size_t i=0;i<sstep;i++) fircoef[i].resize((firlen + sstep - 1) / sstep);
       for(size_t i=0;i<firlen;i++) fircoef[i % sstep][i / sstep] = fircoef_[firlen - 1 - i];
-
-      buf.resize((firlen + N * dstep) / sstep + 2);
     }
 
     bool atEnd() {
       return dpos >= dsize;
     }
 
+    size_t getMemoryUsage() {
+      size_t n = buf.capacity();
+      for(auto &v : fircoef) n += v.capacity();
+      return n * sizeof(REAL);
+    }
+
     size_t read(REAL *out, size_t nSamples) {
       size_t nOut = 0;
 
+      // The buffer grows to hold the input for the largest block
+      // requested, up to N samples of output
+      const size_t bufSize = (firlen + std::min(nSamples, N) * dstep) / sstep + 2;
+      if (buf.size() < bufSize) buf.resize(bufSize);
+
       while(nSamples > 0) {
 	size_t nRead = inlet->read(buf.data() + buflast, buf.size() - buflast);
 	ssize += nRead;
@@ -0,0 +1,100 @@
+#include <cstring>
+#include <cstdint>
+
+#include "Fiber.hpp"
+
+#if defined(SHIBATCH_FIBER_SWITCH)
+
+// shibatch_fiber_switch() pushes the callee-saved registers, switches
+// the stack and pops them from the other stack. The control registers
+// of the FPU are left alone. A new stack is made to look as if it had
+// been switched away from just before shibatch_fiber_start, which
+// calls entry(arg) with the registers set up by shibatch_fiber_init().
+
+#if defined(__APPLE__)
+#define FIBER_FUNCTION(name) ".globl _" #name "\n.private_extern _" #name "\n.p2align 4\n_" #name ":\n"
+#else
+#define FIBER_FUNCTION(name) ".globl " #name "\n.hidden " #name "\n.type " #name ", %function\n.p2align 4\n" #name ":\n"
+#endif
+
+extern "C" void shibatch_fiber_start();
+
+#if defined(__x86_64__)
+asm(".text\n"
+    FIBER_FUNCTION(shibatch_fiber_switch)
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    FIBER_FUNCTION(shibatch_fiber_start)
+    "  movq %r12, %rdi\n"
+    "  callq *%r13\n"
+    "  ud2\n");
+
+extern "C" void *shibatch_fiber_init(void *stackTop, void (*entry)(void *), void *arg) {
+  // r15, r14, r13, r12, rbx, rbp and the return address. The stack is
+  // 16-byte aligned at the call in shibatch_fiber_start.
+  void **sp = (void **)((((uintptr_t)stackTop) & ~(uintptr_t)15) - 72);
+  memset(sp, 0, 9 * sizeof(void *));
+  sp[2] = (void *)entry;
+  sp[3] = arg;
+  sp[6] = (void *)shibatch_fiber_start;
+  return sp;
+}
+#elif defined(__aarch64__)
+asm(".text\n"
+    FIBER_FUNCTION(shibatch_fiber_switch)
+    "  sub sp, sp, #160\n"
+    "  stp x19, x20, [sp, #0]\n"
+    "  stp x21, x22, [sp, #16]\n"
+    "  stp x23, x24, [sp, #32]\n"
+    "  stp x25, x26, [sp, #48]\n"
+    "  stp x27, x28, [sp, #64]\n"
+    "  stp x29, x30, [sp, #80]\n"
+    "  stp d8, d9, [sp, #96]\n"
+    "  stp d10, d11, [sp, #112]\n"
+    "  stp d12, d13, [sp, #128]\n"
+    "  stp d14, d15, [sp, #144]\n"
+    "  mov x2, sp\n"
+    "  str x2, [x0]\n"
+    "  mov sp, x1\n"
+    "  ldp x19, x20, [sp, #0]\n"
+    "  ldp x21, x22, [sp, #16]\n"
+    "  ldp x23, x24, [sp, #32]\n"
+    "  ldp x25, x26, [sp, #48]\n"
+    "  ldp x27, x28, [sp, #64]\n"
+    "  ldp x29, x30, [sp, #80]\n"
+    "  ldp d8, d9, [sp, #96]\n"
+    "  ldp d10, d11, [sp, #112]\n"
+    "  ldp d12, d13, [sp, #128]\n"
+    "  ldp d14, d15, [sp, #144]\n"
+    "  add sp, sp, #160\n"
+    "  ret\n"
+    FIBER_FUNCTION(shibatch_fiber_start)
+    "  mov x0, x19\n"
+    "  blr x20\n"
+    "  brk #0\n");
+
+extern "C" void *shibatch_fiber_init(void *stackTop, void (*entry)(void *), void *arg) {
+  // x19 to x30 and d8 to d15, with x30 pointing to shibatch_fiber_start
+  void **sp = (void **)((((uintptr_t)stackTop) & ~(uintptr_t)15) - 160);
+  memset(sp, 0, 160);
+  sp[0] = arg;
+  sp[1] = (void *)entry;
+  sp[11] = (void *)shibatch_fiber_start;
+  return sp;
+}
+#endif
+
+#endif // #if defined(SHIBATCH_FIBER_SWITCH)
@@ -0,0 +1,196 @@
+#ifndef FIBER_HPP
+#define FIBER_HPP
+
+#include <memory>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+// Where the stack is switched by shibatch_fiber_switch() in Fiber.cpp.
+// It is not used with shadow stacks, which a plain stack switch would
+// throw out of step.
+#if !defined(_WIN32) && \
+  ((defined(__x86_64__) && !(defined(__CET__) && (__CET__ & 2))) || \
+   (defined(__aarch64__) && !defined(__ARM_FEATURE_GCS_DEFAULT)))
+#define SHIBATCH_FIBER_SWITCH
+#endif
+
+#if defined(SHIBATCH_FIBER_SWITCH)
+extern "C" {
+  /** Saves the callee-saved registers on the stack, stores the stack pointer to *from and resumes to */
+  void shibatch_fiber_switch(void **from, void *to);
+
+  /** Returns the stack pointer of a fiber that calls entry(arg) when it is switched to */
+  void *shibatch_fiber_init(void *stackTop, void (*entry)(void *), void *arg);
+}
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#endif
+#include <ucontext.h>
+#endif
+
+namespace shibatch {
+  /** Returns the floating-point control register, MXCSR or FPCR, of the calling thread */
+  static inline uint64_t getFPMode() {
+#if defined(__SSE__) || defined(_M_X64)
+    return _mm_getcsr();
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+    uint64_t fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+    return fpcr;
+#else
+    return 0;
+#endif
+  }
+
+  static inline void setFPMode(uint64_t m) {
+#if defined(__SSE__) || defined(_M_X64)
+    _mm_setcsr((unsigned)m);
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+    __asm__ __volatile__("msr fpcr, %0" : : "r" (m));
+#else
+    (void)m;
+#endif
+  }
+
+  /**
+   * A coroutine with its own stack, switched on the calling thread.
+   * resume() runs the body until it calls yield() or returns, and
+   * rethrows anything the body throws. A fiber that is destroyed while
+   * suspended is simply abandoned, so the body must not hold anything
+   * on its stack that needs a destructor to run at that point.
+   *
+   * The body runs with the floating-point mode, e.g. FTZ/DAZ, of the
+   * thread that resumes it, which may differ between calls. Where
+   * possible, only the callee-saved registers are switched, which
+   * leaves the mode alone and takes no system call. swapcontext() and
+   * the fibers of Windows restore the mode saved with the context, so
+   * the mode of the caller is handed to the body on each switch.
+   */
+  class Fiber {
+    std::function<void()> body;
+    bool finished_ = false;
+    std::exception_ptr ex = nullptr;
+
+    void run() {
+      try {
+	body();
+      } catch(...) {
+	ex = std::current_exception();
+      }
+      finished_ = true;
+    }
+
+#if defined(SHIBATCH_FIBER_SWITCH)
+    std::unique_ptr<char[]> stack;
+    void *fiberSP = nullptr, *callerSP = nullptr;
+
+    static void entry(void *p) {
+      Fiber *f = (Fiber *)p;
+      f->run();
+      shibatch_fiber_switch(&f->fiberSP, f->callerSP);
+    }
+#else
+    // MXCSR or FPCR of the thread that called resume()
+    uint64_t fpMode = 0;
+
+#if defined(_WIN32)
+    LPVOID fiber = nullptr, caller = nullptr;
+
+    static VOID CALLBACK entry(LPVOID p) {
+      Fiber *f = (Fiber *)p;
+      setFPMode(f->fpMode);
+      f->run();
+      SwitchToFiber(f->caller);
+    }
+#else
+    std::unique_ptr<char[]> stack;
+    ucontext_t fiberCtx, callerCtx;
+
+    // makecontext() only passes int arguments
+    static void entry(unsigned lo, unsigned hi) {
+      Fiber *f = (Fiber *)(((uintptr_t)hi << 16 << 16) | lo);
+      setFPMode(f->fpMode);
+      f->run();
+    }
+#endif
+#endif
+
+  public:
+    Fiber(std::function<void()> body_, size_t stackSize = 256 * 1024) : body(body_) {
+#if defined(SHIBATCH_FIBER_SWITCH)
+      stack.reset(new char[stackSize]);
+      fiberSP = shibatch_fiber_init(stack.get() + stackSize, entry, this);
+#elif defined(_WIN32)
+      fiber = CreateFiber(stackSize, entry, this);
+      if (!fiber) throw(std::runtime_error("Fiber::Fiber CreateFiber failed"));
+#else
+      stack.reset(new char[stackSize]);
+      if (getcontext(&fiberCtx) != 0) throw(std::runtime_error("Fiber::Fiber getcontext failed"));
+      fiberCtx.uc_stack.ss_sp = stack.get();
+      fiberCtx.uc_stack.ss_size = stackSize;
+      fiberCtx.uc_link = &callerCtx;
+      const uintptr_t p = (uintptr_t)this;
+      makecontext(&fiberCtx, (void (*)())entry, 2, (unsigned)p, (unsigned)(p >> 16 >> 16));
+#endif
+    }
+
+    ~Fiber() {
+#if defined(_WIN32) && !defined(SHIBATCH_FIBER_SWITCH)
+      if (fiber) DeleteFiber(fiber);
+#endif
+    }
+
+    Fiber(const Fiber &) = delete;
+    Fiber &operator=(const Fiber &) = delete;
+
+    bool finished() const { return finished_; }
+
+    /** Runs the body until it yields or returns */
+    void resume() {
+      if (finished_) return;
+#if defined(SHIBATCH_FIBER_SWITCH)
+      shibatch_fiber_switch(&callerSP, fiberSP);
+#elif defined(_WIN32)
+      fpMode = getFPMode();
+      const bool converted = !IsThreadAFiber();
+      caller = converted ? ConvertThreadToFiber(nullptr) : GetCurrentFiber();
+      SwitchToFiber(fiber);
+      if (converted) ConvertFiberToThread();
+#else
+      fpMode = getFPMode();
+      swapcontext(&callerCtx, &fiberCtx);
+#endif
+      if (ex) {
+	std::exception_ptr e = ex;
+	ex = nullptr;
+	std::rethrow_exception(e);
+      }
+    }
+
+    /** Called from the body to return to the caller of resume() */
+    void yield() {
+#if defined(SHIBATCH_FIBER_SWITCH)
+      shibatch_fiber_switch(&fiberSP, callerSP);
+#elif defined(_WIN32)
+      SwitchToFiber(caller);
+      setFPMode(fpMode);
+#else
+      swapcontext(&fiberCtx, &callerCtx);
+      setFPMode(fpMode);
+#endif
+    }
+  };
+}
+#endif // #ifndef FIBER_HPP
@@ -0,0 +1,98 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace shibatch {
+  /**
+   * A read-only mapping of a whole regular file. The kernel is told
+   * that the file will be read sequentially, so that it reads ahead
+   * and drops the pages behind.
+   */
+  class MappedFile {
+    const uint8_t *ptr = nullptr;
+    uint64_t size_ = 0;
+
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+
+  public:
+    MappedFile(const std::string &filename) {
+#if defined(_WIN32)
+      file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+	throw(std::runtime_error(("MappedFile::MappedFile Could not open " + filename).c_str()));
+
+      LARGE_INTEGER li;
+      if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &li) || li.QuadPart == 0) {
+	CloseHandle(file);
+	throw(std::runtime_error(("MappedFile::MappedFile Could not map " + filename).c_str()));
+      }
+      size_ = li.QuadPart;
+
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping) ptr = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      if (!ptr) {
+	if (mapping) CloseHandle(mapping);
+	CloseHandle(file);
+	throw(std::runtime_error(("MappedFile::MappedFile Could not map " + filename).c_str()));
+      }
+#else
+      int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) throw(std::runtime_error(("MappedFile::MappedFile Could not open " + filename).c_str()));
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+	close(fd);
+	throw(std::runtime_error(("MappedFile::MappedFile Could not map " + filename).c_str()));
+      }
+      size_ = st.st_size;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (p == MAP_FAILED) throw(std::runtime_error(("MappedFile::MappedFile Could not map " + filename).c_str()));
+      ptr = (const uint8_t *)p;
+
+      madvise(p, size_, MADV_SEQUENTIAL);
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+      UnmapViewOfFile(ptr);
+      CloseHandle(mapping);
+      CloseHandle(file);
+#else
+      munmap((void *)ptr, size_);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return ptr; }
+    uint64_t size() const { return size_; }
+  };
+}
+#endif // #ifndef MAPPEDFILE_HPP
@@ -98,6 +98,12 @@ namespace shibatch {
 
     bool atEnd() { return fractionLen > 0 || !endReached; }
 
+    size_t getMemoryUsage() {
+      size_t n = inBuf.capacity() + overlapBuf.capacity() + fractionBuf.capacity() + mindftlen + maxdftlen;
+      for(unsigned l2dftlen = l2mindftlen;l2dftlen <= l2maxdftlen;l2dftlen++) n += size_t(1) << l2dftlen;
+      return n * sizeof(REAL);
+    }
+
     size_t read(REAL *RESTRICT out, size_t nSamples) {
       size_t ret = 0;
 
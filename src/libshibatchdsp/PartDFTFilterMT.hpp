@@ -6,6 +6,7 @@
 #include <cassert>
 
 #include "ObjectCache.hpp"
+#include "BGExecutor.hpp"
 
 #include "shibatch/ssrc.hpp"
 
@@ -16,6 +17,11 @@
 #endif
 
 namespace shibatch {
+  /**
+   * Same as PartDFTFilter, except that the long partitions are
+   * convolved by jobs on an executor. The partial results are added
+   * in the same order as in PartDFTFilter, so the output is identical.
+   */
   template<typename REAL>
   class PartDFTFilterMT : public ssrc::StageOutlet<REAL> {
     static constexpr const size_t toPow2(size_t n) {
@@ -49,8 +55,39 @@ namespace shibatch {
 
     size_t dftCount = 0;
 
+    // Partitions at least this long are convolved on the executor
+    static const size_t minJobDFTLen = 1 << 14;
+
+    std::shared_ptr<BGExecutor> executor;
+    std::vector<std::shared_ptr<void>> jobbuf_;
+    std::vector<REAL *> jobbuf;
+    std::vector<unsigned> offloaded;
+
+    void convolve(unsigned l2dftlen, REAL *RESTRICT buf) {
+      const size_t dftlen = size_t(1) << l2dftlen, dftleno2 = dftlen / 2;
+
+      memcpy(buf           , inBuf.data() + maxdftleno2 - dftleno2, dftleno2 * sizeof(REAL));
+      memset(buf + dftleno2, 0                                    , dftleno2 * sizeof(REAL));
+
+      SleefDFT_execute(dftf[l2dftlen].get(), buf, buf);
+
+      buf[0] = dftfilter[l2dftlen][0] * buf[0];
+      buf[1] = dftfilter[l2dftlen][1] * buf[1]; 
+
+      for(unsigned i=1;i<dftleno2;i++) {
+	REAL re = dftfilter[l2dftlen][i*2  ] * buf[i*2] - dftfilter[l2dftlen][i*2+1] * buf[i*2+1];
+	REAL im = dftfilter[l2dftlen][i*2+1] * buf[i*2] + dftfilter[l2dftlen][i*2  ] * buf[i*2+1];
+
+	buf[i*2  ] = re;
+	buf[i*2+1] = im;
+      }
+
+      SleefDFT_execute(dftb[l2dftlen].get(), buf, buf);
+    }
+
   public:
-    PartDFTFilterMT(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, const REAL *fircoef_, size_t firlen_, size_t mindftlen_) :
+    PartDFTFilterMT(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, const REAL *fircoef_, size_t firlen_, size_t mindftlen_,
+		    std::shared_ptr<ssrc::Executor> executor_ = nullptr) :
       in(in_), firlen(firlen_), maxdftleno2(toPow2(firlen_)/2), maxdftlen(maxdftleno2 * 2), l2maxdftlen(ilog2(maxdftlen)),
       mindftlen(toPow2(mindftlen_)), mindftleno2(mindftlen / 2), l2mindftlen(ilog2(mindftlen)) {
 
@@ -94,10 +131,28 @@ namespace shibatch {
 
 	SleefDFT_execute(dftf[l2mindftlen].get(), dftfilter0, dftfilter0);
       }
+
+      jobbuf_.resize(l2maxdftlen+1);
+      jobbuf.resize(l2maxdftlen+1);
+
+      for(unsigned l2dftlen = l2mindftlen;l2dftlen <= l2maxdftlen;l2dftlen++) {
+	if ((size_t(1) << l2dftlen) < minJobDFTLen) continue;
+	jobbuf_[l2dftlen] = std::shared_ptr<void>(Sleef_malloc((size_t(1) << l2dftlen) * sizeof(REAL)), Sleef_free);
+	jobbuf[l2dftlen] = (REAL *)jobbuf_[l2dftlen].get();
+      }
+
+      executor = std::make_shared<BGExecutor>(executor_);
     }
 
     bool atEnd() { return fractionLen > 0 || !endReached; }
 
+    size_t getMemoryUsage() {
+      size_t n = inBuf.capacity() + overlapBuf.capacity() + fractionBuf.capacity() + mindftlen + maxdftlen;
+      for(unsigned l2dftlen = l2mindftlen;l2dftlen <= l2maxdftlen;l2dftlen++) n += size_t(1) << l2dftlen;
+      for(unsigned l2dftlen = l2mindftlen;l2dftlen <= l2maxdftlen;l2dftlen++) if (jobbuf[l2dftlen]) n += size_t(1) << l2dftlen;
+      return n * sizeof(REAL);
+    }
+
     size_t read(REAL *RESTRICT out, size_t nSamples) {
       size_t ret = 0;
 
@@ -166,34 +221,32 @@ namespace shibatch {
 
 	for(unsigned level = 0;level <= (l2maxdftlen - l2mindftlen);level++) {
 	  const unsigned l2dftlen = l2mindftlen + level;
-	  const size_t dftlen = size_t(1) << l2dftlen, dftleno2 = dftlen / 2;
+	  const size_t dftlen = size_t(1) << l2dftlen;
 
 	  if (!(level == 0 || (dftCount & ((1U << level) - 1)) == 0)) continue;
 
-	  memcpy(dftbuf           , inBuf.data() + maxdftleno2 - dftleno2, dftleno2 * sizeof(REAL));
-	  memset(dftbuf + dftleno2, 0                                    , dftleno2 * sizeof(REAL));
-
-	  SleefDFT_execute(dftf[l2dftlen].get(), dftbuf, dftbuf);
-
-	  dftbuf[0] = dftfilter[l2dftlen][0] * dftbuf[0];
-	  dftbuf[1] = dftfilter[l2dftlen][1] * dftbuf[1]; 
-
-	  for(unsigned i=1;i<dftleno2;i++) {
-	    REAL re = dftfilter[l2dftlen][i*2  ] * dftbuf[i*2] - dftfilter[l2dftlen][i*2+1] * dftbuf[i*2+1];
-	    REAL im = dftfilter[l2dftlen][i*2+1] * dftbuf[i*2] + dftfilter[l2dftlen][i*2  ] * dftbuf[i*2+1];
-
-	    dftbuf[i*2  ] = re;
-	    dftbuf[i*2+1] = im;
+	  if (jobbuf[l2dftlen]) {
+	    executor->push(Runnable::factory([this, l2dftlen](void *) { convolve(l2dftlen, jobbuf[l2dftlen]); }));
+	    offloaded.push_back(l2dftlen);
+	    continue;
 	  }
 
-	  SleefDFT_execute(dftb[l2dftlen].get(), dftbuf, dftbuf);
-
-	  //
+	  convolve(l2dftlen, dftbuf);
 
 	  for(size_t i=0;i<dftlen;i++) overlapBuf[i] += dftbuf[i];
 	  overlapLen = std::max(overlapLen, dftlen);
 	}
 
+	// The offloaded partitions are longer than all the others
+	for(size_t i=0;i<offloaded.size();i++) executor->pop();
+
+	for(unsigned l2dftlen : offloaded) {
+	  const size_t dftlen = size_t(1) << l2dftlen;
+	  for(size_t i=0;i<dftlen;i++) overlapBuf[i] += jobbuf[l2dftlen][i];
+	  overlapLen = std::max(overlapLen, dftlen);
+	}
+	offloaded.clear();
+
 	const size_t nOut = std::min(nRead, nSamples);
 
 	for(size_t i=0;i<nOut;i++) out[i] = overlapBuf[i];
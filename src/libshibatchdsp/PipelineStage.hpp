@@ -0,0 +1,122 @@
+#ifndef PIPELINESTAGE_HPP
+#define PIPELINESTAGE_HPP
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+#include "SPSCRing.hpp"
+#include "BGExecutor.hpp"
+
+#include "shibatch/ssrc.hpp"
+
+namespace shibatch {
+  /**
+   * Passes the output of the inlet through unchanged, but reads it
+   * ahead into a ring of depth blocks with jobs run on the executor.
+   * The stages before and after this one can thus run on different
+   * threads at the same time.
+   */
+  template<typename REAL>
+  class PipelineStage : public ssrc::StageOutlet<REAL> {
+    static const size_t N = 65536;
+
+    std::shared_ptr<ssrc::StageOutlet<REAL>> inlet;
+    SPSCRing<REAL> ring;
+    size_t ringPos = 0;
+    bool endReached = false;
+
+    BGExecutor executor;
+    std::shared_ptr<Runnable> job;
+
+    // mtx serializes the producer side of the ring between the job and
+    // read(), which reads the block itself if the ring is empty
+    std::mutex mtx;
+    std::atomic<bool> end = false, closed = false, scheduled = false;
+
+    void readBlock() {
+      REAL *ptr = ring.acquireWrite();
+      size_t z = inlet->read(ptr, N);
+      if (z == 0) end = true;
+      ring.releaseWrite(z);
+    }
+
+    bool fillable() { return !closed && !end && !ring.full(); }
+
+    void readAhead() {
+      // The lock is only tried, since the reader may hold it while
+      // waiting for jobs that cannot run while this job blocks a thread.
+      // The reader schedules the job again after reading the block.
+      bool busy = false;
+      do {
+	for(;;) {
+	  std::unique_lock lock(mtx, std::try_to_lock);
+	  if (!lock.owns_lock()) { busy = true; break; }
+	  if (!fillable()) break;
+	  readBlock();
+	}
+	scheduled = false;
+      } while(!busy && fillable() && !scheduled.exchange(true));
+    }
+
+    void schedule() {
+      if (end || ring.full() || scheduled.exchange(true)) return;
+      while(executor.tryPop()) ;
+      executor.push(job);
+    }
+
+  public:
+    PipelineStage(std::shared_ptr<ssrc::StageOutlet<REAL>> inlet_, unsigned depth = 4,
+		  std::shared_ptr<ssrc::Executor> executor_ = nullptr) :
+      inlet(inlet_), ring(depth, N), executor(executor_) {
+      if (depth < 1) throw(std::runtime_error("PipelineStage::PipelineStage depth < 1"));
+      job = Runnable::factory([this](void *) { readAhead(); });
+    }
+
+    ~PipelineStage() {
+      closed = true;
+      while(executor.size() > 0) executor.pop();
+    }
+
+    bool atEnd() { return endReached; }
+
+    size_t getMemoryUsage() { return ring.getMemoryUsage(); }
+
+    size_t read(REAL *out, size_t nSamples) {
+      if (endReached || nSamples == 0) return 0;
+
+      schedule();
+
+      if (ring.empty()) {
+	std::unique_lock lock(mtx);
+	if (ring.empty()) readBlock();
+      }
+
+      size_t size = 0;
+      const REAL *ptr = ring.acquireRead(size);
+
+      // The empty block marking the end stays in the ring
+      if (size == 0) {
+	endReached = true;
+	return 0;
+      }
+
+      const size_t z = std::min(nSamples, size - ringPos);
+      memcpy(out, ptr + ringPos, z * sizeof(REAL));
+      ringPos += z;
+
+      if (ringPos == size) {
+	ring.releaseRead();
+	ringPos = 0;
+      }
+
+      schedule();
+
+      return z;
+    }
+  };
+}
+#endif // #ifndef PIPELINESTAGE_HPP
@@ -0,0 +1,141 @@
+#ifndef PUSHSRC_HPP
+#define PUSHSRC_HPP
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "SRC.hpp"
+#include "Fiber.hpp"
+
+#include "shibatch/ssrc.hpp"
+
+template<typename REAL> class ssrc::PushSSRC<REAL>::PushSSRCImpl {
+public:
+  virtual ~PushSSRCImpl() = default;
+};
+
+namespace shibatch {
+  /**
+   * Runs the pull chain of SSRCStage inside a fiber. The inlet of the
+   * chain reads the buffer given to process(), and switches back to
+   * the caller when the buffer is used up. The output is collected in
+   * a buffer from which process() copies as much as fits.
+   */
+  template<typename REAL>
+  class PushSSRCStage : public ssrc::PushSSRC<REAL>::PushSSRCImpl {
+    class Feed : public ssrc::StageOutlet<REAL> {
+      PushSSRCStage &stage;
+      bool endReached = false;
+    public:
+      Feed(PushSSRCStage &stage_) : stage(stage_) {}
+
+      bool atEnd() { return endReached; }
+
+      size_t read(REAL *out, size_t nSamples) {
+	if (endReached || nSamples == 0) return 0;
+
+	while(stage.inPos == stage.inLen) {
+	  if (stage.flushing) {
+	    endReached = true;
+	    return 0;
+	  }
+	  stage.fiber.yield();
+	}
+
+	const size_t z = std::min(nSamples, stage.inLen - stage.inPos);
+	memcpy(out, stage.in + stage.inPos, z * sizeof(REAL));
+	stage.inPos += z;
+	return z;
+      }
+    };
+
+    static constexpr size_t N = 65536;
+
+    const int64_t sfs, dfs;
+
+    const REAL *in = nullptr;
+    size_t inLen = 0, inPos = 0;
+    bool flushing = false;
+
+    // Output of the chain waiting to be copied out is obuf[opos, olast)
+    std::vector<REAL> obuf;
+    size_t opos = 0, olast = 0, quantum = 1;
+    bool endReached = false;
+
+    std::shared_ptr<SSRCStage<REAL>> ssrc;
+    Fiber fiber;
+
+    // Everything on the stack of the fiber is trivially destructible,
+    // so the fiber can be abandoned while it waits for input. Only the
+    // fiber moves the output, since a read may be under way into it.
+    void body() {
+      for(;;) {
+	const size_t q = quantum;
+	if (opos == olast) opos = olast = 0;
+	if (obuf.size() - olast < q) {
+	  memmove(obuf.data(), obuf.data() + opos, (olast - opos) * sizeof(REAL));
+	  olast -= opos;
+	  opos = 0;
+	  if (obuf.size() - olast < q) obuf.resize(olast + q);
+	}
+
+	const size_t z = ssrc->read(obuf.data() + olast, q);
+	if (z == 0) break;
+	olast += z;
+      }
+      endReached = true;
+    }
+
+    size_t copyOut(REAL *out, size_t outCap) {
+      const size_t z = std::min(outCap, olast - opos);
+      memcpy(out, obuf.data() + opos, z * sizeof(REAL));
+      opos += z;
+      return z;
+    }
+
+  public:
+    PushSSRCStage(int64_t sfs_, int64_t dfs_, unsigned l2dftflen_ = 12, double aa_ = 96, double guard_ = 1, double gain_ = 1,
+		  bool minPhase_ = false, unsigned l2mindftflen_ = 0) :
+      sfs(sfs_), dfs(dfs_), obuf(N), fiber([this]() { body(); }) {
+      ssrc = std::make_shared<SSRCStage<REAL>>(std::make_shared<Feed>(*this), sfs, dfs, l2dftflen_, aa_, guard_, gain_,
+					       minPhase_, l2mindftflen_, false);
+    }
+
+    size_t process(const REAL *in_, size_t nIn, REAL *out, size_t outCap) {
+      if (flushing) throw(std::runtime_error("PushSSRCStage::process called after flush"));
+
+      if (nIn > 0) {
+	// Reading about as much output as the input makes keeps the
+	// latency added by the reads in the fiber within one call
+	quantum = std::clamp<size_t>((nIn * dfs + sfs - 1) / sfs, 1, N);
+
+	in = in_;
+	inLen = nIn;
+	inPos = 0;
+	fiber.resume();
+	in = nullptr;
+	inLen = inPos = 0;
+      }
+
+      return copyOut(out, outCap);
+    }
+
+    size_t flush(REAL *out, size_t outCap) {
+      if (!flushing) {
+	flushing = true;
+	quantum = N;
+      }
+
+      while(olast - opos < outCap && !fiber.finished()) fiber.resume();
+
+      return copyOut(out, outCap);
+    }
+
+    bool atEnd() { return endReached && opos == olast; }
+    double getDelay() { return ssrc->getDelay(); }
+  };
+}
+#endif // #ifndef PUSHSRC_HPP
@@ -154,5 +154,35 @@ namespace shibatch {
       return u | (uint64_t(next32()) << 32);
     }
   };
+
+  /**
+   * The counter-based generator Philox4x32-10 of Salmon et al. Each
+   * block of 128 bits is a function of the key and the counter alone,
+   * so any block is computed without going through the preceding
+   * ones, and the blocks of many counters are computed side by side
+   * in SIMD lanes.
+   */
+  class Philox4x32 {
+    static const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57, W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+
+  public:
+    /** Computes the blocks of n counters. The four words of the counters are given in separate arrays and replaced with the blocks. */
+    static void generate(uint32_t *x0, uint32_t *x1, uint32_t *x2, uint32_t *x3, size_t n, uint64_t key) {
+      uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+
+      for(int r=0;r<10;r++) {
+	for(size_t i=0;i<n;i++) {
+	  const uint64_t p0 = uint64_t(M0) * x0[i], p1 = uint64_t(M1) * x2[i];
+	  const uint32_t y0 = uint32_t(p1 >> 32) ^ x1[i] ^ k0, y2 = uint32_t(p0 >> 32) ^ x3[i] ^ k1;
+	  x0[i] = y0;
+	  x1[i] = uint32_t(p1);
+	  x2[i] = y2;
+	  x3[i] = uint32_t(p0);
+	}
+	k0 += W0;
+	k1 += W1;
+      }
+    }
+  };
 }
 #endif // #ifndef RNG_HPP
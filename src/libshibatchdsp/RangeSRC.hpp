@@ -0,0 +1,115 @@
+#ifndef RANGESRC_HPP
+#define RANGESRC_HPP
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+#include "SRC.hpp"
+
+#include "shibatch/ssrc.hpp"
+
+template<typename REAL> class ssrc::RangeSSRC<REAL>::RangeSSRCImpl {
+public:
+  virtual ~RangeSSRCImpl() = default;
+};
+
+namespace shibatch {
+  /**
+   * Converts only the part of a seekable source that gives a range of
+   * the output. The source is opened at the alignment unit that is
+   * the warm-up of SegmentedSSRCStage before the range, and the output
+   * up to the start of the range is discarded. The output is
+   * bit-identical to the same range of the output of SSRCStage.
+   */
+  template<typename REAL>
+  class RangeSSRCStage : public ssrc::RangeSSRC<REAL>::RangeSSRCImpl {
+    class RangeOutlet : public ssrc::StageOutlet<REAL> {
+      std::shared_ptr<SSRCStage<REAL>> ssrc;
+      uint64_t nDiscard, nLeft;
+
+    public:
+      RangeOutlet(std::shared_ptr<SSRCStage<REAL>> ssrc_, uint64_t nDiscard_, uint64_t nLeft_) :
+	ssrc(ssrc_), nDiscard(nDiscard_), nLeft(nLeft_) {}
+
+      bool atEnd() { return nLeft == 0 || (nDiscard == 0 && ssrc->atEnd()); }
+
+      size_t read(REAL *out, size_t nSamples) {
+	if (nDiscard > 0) {
+	  std::vector<REAL> buf(std::min<uint64_t>(nDiscard, N));
+	  while(nDiscard > 0) {
+	    size_t z = ssrc->read(buf.data(), std::min<uint64_t>(nDiscard, buf.size()));
+	    if (z == 0) {
+	      nLeft = 0;
+	      break;
+	    }
+	    nDiscard -= z;
+	  }
+	}
+
+	if (nLeft == 0) return 0;
+
+	size_t z = ssrc->read(out, std::min<uint64_t>(nSamples, nLeft));
+	nLeft -= z;
+	return z;
+      }
+    };
+
+    static const size_t N = 65536;
+
+    ssrc::WavFormat format;
+    double delay = 0;
+    uint64_t startFrame = 0;
+
+    std::shared_ptr<ssrc::OutletProvider<REAL>> in;
+    std::vector<std::shared_ptr<SSRCStage<REAL>>> stage;
+    std::vector<std::shared_ptr<ssrc::StageOutlet<REAL>>> outlet;
+
+  public:
+    RangeSSRCStage(std::function<std::shared_ptr<ssrc::OutletProvider<REAL>>(uint64_t)> openAt_,
+		   int64_t sfs_, int64_t dfs_, uint64_t outStart_, uint64_t outLength_,
+		   unsigned l2dftflen_ = 12, double aa_ = 96, double guard_ = 1, double gain_ = 1,
+		   bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+		   std::shared_ptr<ssrc::Executor> executor_ = nullptr, unsigned pipelineDepth_ = 0) {
+      SSRCStage<REAL> probe(nullptr, sfs_, dfs_, l2dftflen_, aa_, guard_, gain_, minPhase_, l2mindftflen_, false);
+
+      delay = probe.getDelay();
+      const uint64_t inUnit = probe.getSegmentInputUnit(), outUnit = probe.getSegmentOutputUnit();
+      const uint64_t u = outStart_ / outUnit, u0 = u - std::min<uint64_t>(u, probe.getSegmentWarmUp());
+
+      startFrame = u0 * inUnit;
+      in = openAt_(startFrame);
+
+      format = in->getFormat();
+      format.sampleRate = dfs_;
+      format.avgBytesPerSec = dfs_ * format.blockAlign;
+
+      stage.resize(format.channels);
+      outlet.resize(format.channels);
+      for(uint32_t c=0;c<format.channels;c++) {
+	stage[c] = std::make_shared<SSRCStage<REAL>>(in->getOutlet(c), sfs_, dfs_, l2dftflen_, aa_, guard_, gain_,
+						     minPhase_, l2mindftflen_, mt_, executor_, mt_ ? pipelineDepth_ : 0);
+	outlet[c] = std::make_shared<RangeOutlet>(stage[c], outStart_ - u0 * outUnit, outLength_);
+      }
+    }
+
+    std::shared_ptr<ssrc::StageOutlet<REAL>> getOutlet(uint32_t channel) {
+      if (channel >= outlet.size()) throw(std::runtime_error("RangeSSRCStage::getOutlet channel too large"));
+      return outlet[channel];
+    }
+
+    ssrc::WavFormat getFormat() { return format; }
+    double getDelay() { return delay; }
+    uint64_t getStartFrame() { return startFrame; }
+
+    // The source returned by openAt is not counted
+    size_t getMemoryUsage() {
+      size_t n = 0;
+      for(auto s : stage) n += s->getMemoryUsage();
+      return n;
+    }
+  };
+}
+#endif // #ifndef RANGESRC_HPP
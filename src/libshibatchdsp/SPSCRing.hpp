@@ -0,0 +1,107 @@
+#ifndef SPSCRING_HPP
+#define SPSCRING_HPP
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+namespace shibatch {
+  /**
+   * A lock-free ring of preallocated buffers for one producer and one
+   * consumer. The producer fills the buffer returned by acquireWrite()
+   * and publishes it with releaseWrite(). The consumer reads the buffer
+   * returned by acquireRead() in place and hands it back with
+   * releaseRead(). Several threads may take the producer role as long
+   * as they are serialized by a lock, and likewise for the consumer.
+   */
+  template<typename T>
+  class SPSCRing {
+    struct Slot {
+      std::vector<T> data;
+      size_t size = 0;
+    };
+
+    std::vector<Slot> slots;
+    alignas(64) std::atomic<uint64_t> head = 0;
+    alignas(64) std::atomic<uint64_t> tail = 0;
+
+  public:
+    SPSCRing(size_t nSlots, size_t slotCapacity) : slots(nSlots) {
+      for(auto &s : slots) s.data.resize(slotCapacity);
+    }
+
+    SPSCRing(const SPSCRing &) = delete;
+    SPSCRing &operator=(const SPSCRing &) = delete;
+
+    size_t slotCapacity() const { return slots[0].data.size(); }
+
+    /** Returns the bytes held by the buffers */
+    size_t getMemoryUsage() const {
+      size_t n = 0;
+      for(auto &s : slots) n += s.data.capacity() * sizeof(T);
+      return n;
+    }
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+    bool full() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == slots.size(); }
+
+    /** Returns the buffer to fill next, or nullptr if all slots are full */
+    T *acquireWrite() {
+      const uint64_t t = tail.load(std::memory_order_relaxed);
+      if (t - head.load(std::memory_order_acquire) == slots.size()) return nullptr;
+      return slots[t % slots.size()].data.data();
+    }
+
+    /** Publishes the buffer returned by acquireWrite() holding size elements */
+    void releaseWrite(size_t size) {
+      const uint64_t t = tail.load(std::memory_order_relaxed);
+      slots[t % slots.size()].size = size;
+      tail.store(t + 1, std::memory_order_release);
+      tail.notify_one();
+    }
+
+    /** Returns the oldest published buffer, or nullptr if there is none */
+    const T *acquireRead(size_t &size) { return peekRead(0, size); }
+
+    /**
+     * Returns the i-th oldest published buffer without taking it, or
+     * nullptr if fewer buffers are published
+     */
+    const T *peekRead(size_t i, size_t &size) {
+      const uint64_t h = head.load(std::memory_order_relaxed);
+      if (tail.load(std::memory_order_acquire) - h <= i) {
+	size = 0;
+	return nullptr;
+      }
+      size = slots[(h + i) % slots.size()].size;
+      return slots[(h + i) % slots.size()].data.data();
+    }
+
+    /** Hands the buffer returned by acquireRead() back to the producer */
+    void releaseRead() {
+      head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      head.notify_one();
+    }
+
+    /** Blocks until acquireWrite() would succeed */
+    void waitWrite() {
+      const uint64_t t = tail.load(std::memory_order_relaxed);
+      for(;;) {
+	const uint64_t h = head.load(std::memory_order_acquire);
+	if (t - h != slots.size()) return;
+	head.wait(h, std::memory_order_acquire);
+      }
+    }
+
+    /** Blocks until acquireRead() would succeed */
+    void waitRead() {
+      const uint64_t h = head.load(std::memory_order_relaxed);
+      for(;;) {
+	const uint64_t t = tail.load(std::memory_order_acquire);
+	if (t != h) return;
+	tail.wait(t, std::memory_order_acquire);
+      }
+    }
+  };
+}
+#endif // #ifndef SPSCRING_HPP
@@ -10,6 +10,7 @@
 #include "DFTFilter.hpp"
 #include "PartDFTFilter.hpp"
 #include "PartDFTFilterMT.hpp"
+#include "PipelineStage.hpp"
 #include "Minrceps.hpp"
 #include "ObjectCache.hpp"
 
@@ -28,6 +29,8 @@ namespace shibatch {
       return x;
     }
 
+    static int64_t lcm(int64_t x, int64_t y) { return x / gcd(x, y) * y; }
+
     class Oversample : public ssrc::StageOutlet<REAL> {
       std::shared_ptr<ssrc::StageOutlet<REAL>> inlet;
       const int64_t sfs, dfs, m;
@@ -37,10 +40,12 @@ namespace shibatch {
       std::vector<REAL> buf;
       bool endReached = false;
     public:
-      Oversample(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, int64_t sfs_, int64_t dfs_) : inlet(in_), sfs(sfs_), dfs(dfs_), m(dfs_ / sfs_), buf(N) {}
+      Oversample(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, int64_t sfs_, int64_t dfs_) : inlet(in_), sfs(sfs_), dfs(dfs_), m(dfs_ / sfs_) {}
 
       bool atEnd() { return endReached; }
 
+      size_t getMemoryUsage() { return buf.capacity() * sizeof(REAL); }
+
       size_t read(REAL *out, size_t nSamples) {
 	size_t ret = 0;
 
@@ -52,7 +57,11 @@ namespace shibatch {
 	}
 
 	while(nSamples > 0) {
-	  size_t nRead = inlet->read(buf.data(), std::min(size_t((nSamples + m - 1) / m), N));
+	  // The scratch buffer grows up to the largest block requested
+	  const size_t toBeRead = std::min(size_t((nSamples + m - 1) / m), N);
+	  if (buf.size() < toBeRead) buf.resize(toBeRead);
+
+	  size_t nRead = inlet->read(buf.data(), toBeRead);
 	  if (nRead == 0) { endReached = true; break; }
 
 	  for(size_t i=0;i < nRead-1;i++) {
@@ -91,15 +100,18 @@ namespace shibatch {
       std::vector<REAL> buf;
 
     public:
-      Undersample(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, int64_t sfs_, int64_t dfs_) : inlet(in_), sfs(sfs_), dfs(dfs_), m(sfs_ / dfs_), buf(N * m) {}
+      Undersample(std::shared_ptr<ssrc::StageOutlet<REAL>> in_, int64_t sfs_, int64_t dfs_) : inlet(in_), sfs(sfs_), dfs(dfs_), m(sfs_ / dfs_) {}
 
       bool atEnd() { return endReached; }
 
+      size_t getMemoryUsage() { return buf.capacity() * sizeof(REAL); }
+
       size_t read(REAL *out, size_t nSamples) {
 	REAL *origin = out;
 
 	while(nSamples > 0 && !endReached) {
 	  int64_t nRead = 0, toBeRead = std::min(N, nSamples) * m;
+	  if (buf.size() < (size_t)toBeRead) buf.resize(toBeRead);
 
 	  while(nRead < toBeRead) {
 	    size_t r = inlet->read(buf.data() + nRead, toBeRead - nRead);
@@ -129,6 +141,7 @@ namespace shibatch {
     double delay = 0;
 
     int64_t osm, fsos;
+    int64_t segInUnit = 1, segOutUnit = 1, segWarmUp = 0;
 
     std::shared_ptr<FastPP<REAL>> ppf;
     std::shared_ptr<DFTFilter<REAL>> dftf;
@@ -136,11 +149,13 @@ namespace shibatch {
     std::shared_ptr<PartDFTFilterMT<REAL>> pdftfmt;
     std::shared_ptr<Oversample> oversample;
     std::shared_ptr<Undersample> undersample;
+    std::shared_ptr<PipelineStage<REAL>> pipe;
 
   public:
     SSRCStage(std::shared_ptr<ssrc::StageOutlet<REAL>> inlet_, int64_t sfs_, int64_t dfs_,
 	      unsigned l2dftflen_ = 12, double aa_ = 96, double guard_ = 1, double gain_ = 1,
-	      bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true) :
+	      bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+	      std::shared_ptr<ssrc::Executor> executor_ = nullptr, unsigned pipelineDepth_ = 0) :
       inlet(inlet_), sfs(sfs_), dfs(dfs_), fslcm(sfs_ / gcd(sfs_, dfs_) * dfs_),
       lfs(std::min(sfs_, dfs_)), hfs(std::max(sfs_, dfs_)),
       dftflen(1LL << l2dftflen_), mindftflen(l2mindftflen_ == 0 ? 0 : (1LL << l2mindftflen_)),
@@ -227,28 +242,48 @@ namespace shibatch {
 
       if (dfs > sfs) {
 	ppf = std::make_shared<FastPP<REAL>>(inlet, sfs, fslcm, fsos, ppfv->data(), ppfv->size());
+	std::shared_ptr<ssrc::StageOutlet<REAL>> mid = ppf;
+	if (pipelineDepth_ != 0) mid = pipe = std::make_shared<PipelineStage<REAL>>(ppf, pipelineDepth_, executor_);
 	if (mindftflen == 0) {
-	  dftf = std::make_shared<DFTFilter<REAL>>(ppf, dftfv->data(), dftfv->size());
+	  dftf = std::make_shared<DFTFilter<REAL>>(mid, dftfv->data(), dftfv->size());
 	  undersample = std::make_shared<Undersample>(dftf, fsos, dfs);
 	} else if (!mt) {
-	  pdftf = std::make_shared<PartDFTFilter<REAL>>(ppf, dftfv->data(), dftfv->size(), mindftflen);
+	  pdftf = std::make_shared<PartDFTFilter<REAL>>(mid, dftfv->data(), dftfv->size(), mindftflen);
 	  undersample = std::make_shared<Undersample>(pdftf, fsos, dfs);
 	} else {
-	  pdftfmt = std::make_shared<PartDFTFilterMT<REAL>>(ppf, dftfv->data(), dftfv->size(), mindftflen);
+	  pdftfmt = std::make_shared<PartDFTFilterMT<REAL>>(mid, dftfv->data(), dftfv->size(), mindftflen, executor_);
 	  undersample = std::make_shared<Undersample>(pdftfmt, fsos, dfs);
 	}
       } else if (dfs < sfs) {
 	oversample = std::make_shared<Oversample>(inlet, sfs, fsos);
+	std::shared_ptr<ssrc::StageOutlet<REAL>> mid;
 	if (mindftflen == 0) {
-	  dftf = std::make_shared<DFTFilter<REAL>>(oversample, dftfv->data(), dftfv->size());
-	  ppf = std::make_shared<FastPP<REAL>>(dftf, fsos, fslcm, dfs, ppfv->data(), ppfv->size());
+	  mid = dftf = std::make_shared<DFTFilter<REAL>>(oversample, dftfv->data(), dftfv->size());
 	} else if (!mt) {
-	  pdftf = std::make_shared<PartDFTFilter<REAL>>(oversample, dftfv->data(), dftfv->size(), mindftflen);
-	  ppf = std::make_shared<FastPP<REAL>>(pdftf, fsos, fslcm, dfs, ppfv->data(), ppfv->size());
+	  mid = pdftf = std::make_shared<PartDFTFilter<REAL>>(oversample, dftfv->data(), dftfv->size(), mindftflen);
 	} else {
-	  pdftfmt = std::make_shared<PartDFTFilterMT<REAL>>(oversample, dftfv->data(), dftfv->size(), mindftflen);
-	  ppf = std::make_shared<FastPP<REAL>>(pdftfmt, fsos, fslcm, dfs, ppfv->data(), ppfv->size());
+	  mid = pdftfmt = std::make_shared<PartDFTFilterMT<REAL>>(oversample, dftfv->data(), dftfv->size(), mindftflen, executor_);
 	}
+	if (pipelineDepth_ != 0) mid = pipe = std::make_shared<PipelineStage<REAL>>(mid, pipelineDepth_, executor_);
+	ppf = std::make_shared<FastPP<REAL>>(mid, fsos, fslcm, dfs, ppfv->data(), ppfv->size());
+      }
+
+      if (dfs != sfs) {
+	// A conversion that starts at a multiple of segInUnit input samples produces
+	// exactly the same output as the whole conversion from segOutUnit times as
+	// many output samples on, once segWarmUp units of preceding input are fed and
+	// the corresponding output is discarded. The unit is the least common multiple
+	// of the block length of the DFT filter, the decimation ratio and the period
+	// of the polyphase filter, all measured at fsos.
+
+	const int64_t m = fsos / (dfs > sfs ? dfs : sfs);
+	const int64_t r = fsos / gcd(fsos, dfs > sfs ? sfs : dfs);
+	const int64_t q = lcm(lcm(dftflen, m), r);
+	const int64_t wq = mindftflen == 0 ? dftflen : dftflen * 2;
+
+	segInUnit = q / (fsos / gcd(fsos, sfs)) * (sfs / gcd(fsos, sfs));
+	segOutUnit = q / (fsos / gcd(fsos, dfs)) * (dfs / gcd(fsos, dfs));
+	segWarmUp = (wq + q - 1) / q;
       }
     }
 
@@ -275,6 +310,23 @@ namespace shibatch {
     }
 
     double getDelay() { return delay; }
+
+    /** Returns the bytes held by the buffers of the filters, excluding the shared coefficients */
+    size_t getMemoryUsage() {
+      size_t n = 0;
+      if (ppf) n += ppf->getMemoryUsage();
+      if (dftf) n += dftf->getMemoryUsage();
+      if (pdftf) n += pdftf->getMemoryUsage();
+      if (pdftfmt) n += pdftfmt->getMemoryUsage();
+      if (oversample) n += oversample->getMemoryUsage();
+      if (undersample) n += undersample->getMemoryUsage();
+      if (pipe) n += pipe->getMemoryUsage();
+      return n;
+    }
+
+    int64_t getSegmentInputUnit() { return segInUnit; }
+    int64_t getSegmentOutputUnit() { return segOutUnit; }
+    int64_t getSegmentWarmUp() { return segWarmUp; }
   };
 }
 #endif // #ifndef SRC_HPP
@@ -0,0 +1,287 @@
+#ifndef SEGMENTEDSRC_HPP
+#define SEGMENTEDSRC_HPP
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+
+#include "SRC.hpp"
+#include "BGExecutor.hpp"
+
+#include "shibatch/ssrc.hpp"
+
+template<typename REAL> class ssrc::SegmentedSSRC<REAL>::SegmentedSSRCImpl {
+public:
+  virtual ~SegmentedSSRCImpl() = default;
+};
+
+namespace shibatch {
+  /**
+   * Divides the source into time segments and converts them in
+   * parallel. Each segment is started a few alignment units early so
+   * that the filters are in the same state as in the serial
+   * conversion, and the output of this warm-up is discarded. The
+   * stitched output is bit-identical to that of SSRCStage.
+   *
+   * The output of a segment is kept until every channel has read it,
+   * so a segment is made no longer than about SEGMENTFRAMES output
+   * frames, and a long source is divided into more segments than are
+   * converted at a time. Up to nSegments_ segments are converted or
+   * waiting to be read at once.
+   */
+  template<typename REAL>
+  class SegmentedSSRCStage : public ssrc::SegmentedSSRC<REAL>::SegmentedSSRCImpl {
+    enum State { PENDING, RUNNING, DONE };
+
+    struct Segment {
+      uint64_t startFrame, nDiscard, nOut;
+      bool last;
+      State state = PENDING;
+      std::exception_ptr ex = nullptr;
+      std::vector<std::vector<REAL>> buf;
+      uint32_t nReleased = 0;
+    };
+
+    class SegmentOutlet : public ssrc::StageOutlet<REAL> {
+      SegmentedSSRCStage &stage;
+      const uint32_t ch;
+      size_t segIdx = 0, pos = 0;
+
+    public:
+      SegmentOutlet(SegmentedSSRCStage &stage_, uint32_t ch_) : stage(stage_), ch(ch_) {}
+      ~SegmentOutlet() {}
+
+      bool atEnd() { return segIdx >= stage.segments.size(); }
+
+      size_t read(REAL *out, size_t nSamples) {
+	size_t ret = 0;
+
+	while(nSamples > 0 && segIdx < stage.segments.size()) {
+	  const std::vector<REAL> &v = stage.acquire(segIdx, ch);
+
+	  const size_t n = std::min(nSamples, v.size() - pos);
+	  memcpy(out, v.data() + pos, n * sizeof(REAL));
+	  out += n;
+	  nSamples -= n;
+	  ret += n;
+	  pos += n;
+
+	  if (pos == v.size()) {
+	    stage.release(segIdx);
+	    segIdx++;
+	    pos = 0;
+	  }
+	}
+
+	return ret;
+      }
+    };
+
+    static const size_t N = 65536;
+
+    // The length of a segment is capped at about this many output
+    // frames, but not below 16 warm-ups so that these add little work
+    static const uint64_t SEGMENTFRAMES = 1 << 20;
+
+    const std::function<std::shared_ptr<ssrc::OutletProvider<REAL>>(uint64_t)> openAt;
+    const int64_t sfs, dfs;
+    const unsigned l2dftflen, l2mindftflen;
+    const double aa, guard, gain;
+    const bool minPhase;
+
+    ssrc::WavFormat format;
+    uint32_t nch;
+    double delay = 0;
+
+    std::vector<std::shared_ptr<Segment>> segments;
+    std::vector<std::shared_ptr<ssrc::StageOutlet<REAL>>> outlet;
+
+    std::mutex mtx;
+    std::condition_variable condVar;
+    BGExecutor executor;
+    size_t window = 0, nSubmitted = 0, nRetired = 0;
+    bool shuttingDown = false;
+
+    void convert(Segment &seg) {
+      std::shared_ptr<ssrc::OutletProvider<REAL>> in = openAt(seg.startFrame);
+
+      std::vector<std::shared_ptr<SSRCStage<REAL>>> ssrc(nch);
+      for(uint32_t c=0;c<nch;c++)
+	ssrc[c] = std::make_shared<SSRCStage<REAL>>(in->getOutlet(c), sfs, dfs, l2dftflen, aa, guard, gain,
+						    minPhase, l2mindftflen, false);
+
+      const uint64_t total = seg.last ? UINT64_MAX : seg.nDiscard + seg.nOut;
+      std::vector<uint64_t> nRead(nch);
+      std::vector<bool> endReached(nch);
+      std::vector<REAL> buf(N);
+
+      seg.buf.resize(nch);
+      if (!seg.last) for(uint32_t c=0;c<nch;c++) seg.buf[c].reserve(seg.nOut);
+
+      // Channels are read in turn so that the source does not have
+      // to queue up a whole segment for the channels read last.
+
+      for(bool progress = true;progress;) {
+	progress = false;
+	for(uint32_t c=0;c<nch;c++) {
+	  if (endReached[c] || nRead[c] >= total) continue;
+
+	  size_t z = ssrc[c]->read(buf.data(), std::min<uint64_t>(N, total - nRead[c]));
+	  if (z == 0) { endReached[c] = true; continue; }
+
+	  size_t skip = nRead[c] < seg.nDiscard ? std::min<uint64_t>(z, seg.nDiscard - nRead[c]) : 0;
+	  seg.buf[c].insert(seg.buf[c].end(), buf.begin() + skip, buf.begin() + z);
+	  nRead[c] += z;
+	  progress = true;
+	}
+      }
+    }
+
+    void run(size_t idx) {
+      std::shared_ptr<Segment> seg = segments[idx];
+
+      {
+	std::unique_lock lock(mtx);
+	if (shuttingDown || seg->state != PENDING) return;
+	seg->state = RUNNING;
+      }
+
+      try {
+	convert(*seg);
+      } catch(...) {
+	seg->ex = std::current_exception();
+      }
+
+      std::unique_lock lock(mtx);
+      seg->state = DONE;
+      condVar.notify_all();
+    }
+
+    void submit() {
+      while(nSubmitted < segments.size() && nSubmitted < nRetired + window) {
+	const size_t idx = nSubmitted++;
+	executor.push(Runnable::factory([this, idx](void *) { run(idx); }));
+      }
+    }
+
+    const std::vector<REAL> &acquire(size_t idx, uint32_t ch) {
+      std::shared_ptr<Segment> seg = segments[idx];
+
+      {
+	std::unique_lock lock(mtx);
+	if (seg->state != PENDING) {
+	  while(seg->state != DONE) condVar.wait(lock);
+	  if (seg->ex) std::rethrow_exception(seg->ex);
+	  return seg->buf[ch];
+	}
+      }
+
+      // Nobody has started this segment yet. Converting it here rather
+      // than waiting for a worker avoids a deadlock when the reader
+      // itself is running on the pool.
+
+      run(idx);
+
+      std::unique_lock lock(mtx);
+      while(seg->state != DONE) condVar.wait(lock);
+      if (seg->ex) std::rethrow_exception(seg->ex);
+      return seg->buf[ch];
+    }
+
+    void release(size_t idx) {
+      std::unique_lock lock(mtx);
+      std::shared_ptr<Segment> seg = segments[idx];
+      if (++seg->nReleased < nch) return;
+      std::vector<std::vector<REAL>>().swap(seg->buf);
+      nRetired++;
+      submit();
+    }
+
+  public:
+    SegmentedSSRCStage(std::function<std::shared_ptr<ssrc::OutletProvider<REAL>>(uint64_t)> openAt_, uint64_t nFrames_,
+		       int64_t sfs_, int64_t dfs_, unsigned nSegments_,
+		       unsigned l2dftflen_ = 12, double aa_ = 96, double guard_ = 1, double gain_ = 1,
+		       bool minPhase_ = false, unsigned l2mindftflen_ = 0, bool mt_ = true,
+		       std::shared_ptr<ssrc::Executor> executor_ = nullptr) :
+      openAt(openAt_), sfs(sfs_), dfs(dfs_), l2dftflen(l2dftflen_), l2mindftflen(l2mindftflen_),
+      aa(aa_), guard(guard_), gain(gain_), minPhase(minPhase_), executor(executor_) {
+
+      format = openAt(0)->getFormat();
+      nch = format.channels;
+      format.sampleRate = dfs;
+      format.avgBytesPerSec = dfs * format.blockAlign;
+
+      SSRCStage<REAL> probe(nullptr, sfs, dfs, l2dftflen, aa, guard, gain, minPhase, l2mindftflen, false);
+
+      delay = probe.getDelay();
+      const uint64_t inUnit = probe.getSegmentInputUnit(), outUnit = probe.getSegmentOutputUnit();
+      const uint64_t warmUp = probe.getSegmentWarmUp();
+
+      const uint64_t nUnits = std::max<uint64_t>((nFrames_ + inUnit - 1) / inUnit, 1);
+      const uint64_t maxUnits = std::max<uint64_t>((SEGMENTFRAMES + outUnit - 1) / outUnit, warmUp * 16);
+      const uint64_t nSegments = std::min<uint64_t>(std::max<uint64_t>(std::max(nSegments_, 1U), (nUnits + maxUnits - 1) / maxUnits),
+						    nUnits);
+
+      for(uint64_t i=0;i<nSegments;i++) {
+	const uint64_t u0 = i * nUnits / nSegments, u1 = (i + 1) * nUnits / nSegments;
+	const uint64_t w = std::min(u0, warmUp);
+
+	auto seg = std::make_shared<Segment>();
+	seg->startFrame = (u0 - w) * inUnit;
+	seg->nDiscard = w * outUnit;
+	seg->nOut = (u1 - u0) * outUnit;
+	seg->last = i == nSegments - 1;
+	segments.push_back(seg);
+      }
+
+      outlet.resize(nch);
+      for(uint32_t c=0;c<nch;c++) outlet[c] = std::make_shared<SegmentOutlet>(*this, c);
+
+      if (mt_) {
+	window = std::min<size_t>({ segments.size(), std::max(nSegments_, 1U), executor.getNThreads() });
+	std::unique_lock lock(mtx);
+	submit();
+      }
+    }
+
+    ~SegmentedSSRCStage() {
+      {
+	std::unique_lock lock(mtx);
+	shuttingDown = true;
+      }
+      while(executor.size() > 0) executor.pop();
+    }
+
+    std::shared_ptr<ssrc::StageOutlet<REAL>> getOutlet(uint32_t channel) {
+      if (channel >= outlet.size()) throw(std::runtime_error("SegmentedSSRCStage::getOutlet channel too large"));
+      return outlet[channel];
+    }
+
+    ssrc::WavFormat getFormat() { return format; }
+    double getDelay() { return delay; }
+
+    // Counts the converted segments that are not yet read out. The
+    // output of a running segment is counted as reserved, except that
+    // of the last one, which is not reserved.
+    size_t getMemoryUsage() {
+      std::unique_lock lock(mtx);
+      size_t n = 0;
+      for(auto &seg : segments) {
+	if (seg->state == DONE) {
+	  for(auto &b : seg->buf) n += b.capacity() * sizeof(REAL);
+	} else if (seg->state == RUNNING && !seg->last) {
+	  n += nch * seg->nOut * sizeof(REAL);
+	}
+      }
+      return n;
+    }
+    size_t getNSegments() { return segments.size(); }
+  };
+}
+#endif // #ifndef SEGMENTEDSRC_HPP
@@ -0,0 +1,10 @@
+#ifndef THREADPOLICY_HPP
+#define THREADPOLICY_HPP
+
+#include "shibatch/ssrc.hpp"
+
+namespace shibatch {
+  /** Applies the policy set by ssrc::setThreadPolicy() to the calling thread */
+  void applyThreadPolicy();
+}
+#endif // #ifndef THREADPOLICY_HPP
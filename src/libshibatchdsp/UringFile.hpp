@@ -0,0 +1,294 @@
+#ifndef URINGFILE_HPP
+#define URINGFILE_HPP
+
+#if defined(__linux__)
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "dr_wav.hpp"
+
+namespace shibatch {
+  /**
+   * An output file written with io_uring. The sequential writes are
+   * gathered into aligned buffers registered with the ring, and each
+   * full buffer is queued at once, so that several writes are in
+   * flight while the caller fills the next buffer. Optionally the file
+   * is opened with O_DIRECT, bypassing the page cache, and space is
+   * preallocated ahead of the writes.
+   *
+   * Once the writer seeks, as dr_wav does to fix up the header at the
+   * end, the queue is drained and the rest is written synchronously.
+   * Without io_uring in the kernel, the buffers are written with
+   * pwrite, which keeps the large aligned writes.
+   */
+  class UringFile {
+    static constexpr size_t ALIGN = 4096;
+    static constexpr uint64_t PREALLOC_STEP = 64 * 1024 * 1024;
+
+    struct Buffer {
+      uint8_t *ptr = nullptr;
+      uint64_t offset = 0;
+      size_t len = 0;
+      bool busy = false;
+    };
+
+    const size_t bufSize;
+    int fd = -1;
+    bool direct = false, prealloc = false, failed = false, sync = false;
+    uint64_t cursor = 0, fileSize = 0, allocated = 0;
+
+    std::vector<Buffer> buf;
+    unsigned cur = 0, nInFlight = 0;
+
+    int ringFd = -1;
+    bool fixed = false;
+    void *sqPtr = MAP_FAILED, *cqPtr = MAP_FAILED;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqMapSize = 0, cqMapSize = 0, sqesMapSize = 0;
+    unsigned *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    void setupRing(unsigned entries) {
+      io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      ringFd = (int)syscall(__NR_io_uring_setup, entries, &p);
+      if (ringFd < 0) return;
+
+      sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      if (p.features & IORING_FEAT_SINGLE_MMAP) sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+      sqesMapSize = p.sq_entries * sizeof(io_uring_sqe);
+
+      sqPtr = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+      cqPtr = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqPtr :
+	mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+      sqes = (io_uring_sqe *)mmap(nullptr, sqesMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+      if (sqPtr == MAP_FAILED || cqPtr == MAP_FAILED || sqes == MAP_FAILED) {
+	closeRing();
+	return;
+      }
+
+      sqTail  = (unsigned *)((uint8_t *)sqPtr + p.sq_off.tail);
+      sqMask  = (unsigned *)((uint8_t *)sqPtr + p.sq_off.ring_mask);
+      sqArray = (unsigned *)((uint8_t *)sqPtr + p.sq_off.array);
+      cqHead  = (unsigned *)((uint8_t *)cqPtr + p.cq_off.head);
+      cqTail  = (unsigned *)((uint8_t *)cqPtr + p.cq_off.tail);
+      cqMask  = (unsigned *)((uint8_t *)cqPtr + p.cq_off.ring_mask);
+      cqes    = (io_uring_cqe *)((uint8_t *)cqPtr + p.cq_off.cqes);
+
+      // Registering fails if the buffers exceed RLIMIT_MEMLOCK, in
+      // which case the plain write operation is used
+      std::vector<iovec> iov(buf.size());
+      for(size_t i=0;i<buf.size();i++) iov[i] = { buf[i].ptr, bufSize };
+      fixed = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov.data(), (unsigned)iov.size()) == 0;
+    }
+
+    void closeRing() {
+      if (sqes != MAP_FAILED) munmap(sqes, sqesMapSize);
+      if (cqPtr != MAP_FAILED && cqPtr != sqPtr) munmap(cqPtr, cqMapSize);
+      if (sqPtr != MAP_FAILED) munmap(sqPtr, sqMapSize);
+      sqPtr = cqPtr = MAP_FAILED;
+      sqes = (io_uring_sqe *)MAP_FAILED;
+      if (ringFd >= 0) close(ringFd);
+      ringFd = -1;
+    }
+
+    bool pwriteAll(const uint8_t *p, size_t len, uint64_t offset) {
+      while(len > 0) {
+	ssize_t z = pwrite(fd, p, len, offset);
+	if (z < 0 && errno == EINTR) continue;
+	if (z <= 0) return false;
+	p += z; len -= z; offset += z;
+      }
+      return true;
+    }
+
+    void complete(unsigned idx, int res) {
+      Buffer &b = buf[idx];
+      // A short write is finished synchronously
+      if (res < 0 || (size_t)res > b.len ||
+	  ((size_t)res < b.len && !pwriteAll(b.ptr + res, b.len - res, b.offset + res))) failed = true;
+      b.busy = false;
+      nInFlight--;
+    }
+
+    void reap(bool wait) {
+      for(;;) {
+	unsigned head = *cqHead;
+	const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	bool any = head != tail;
+	for(;head != tail;head++) {
+	  const io_uring_cqe &cqe = cqes[head & *cqMask];
+	  complete((unsigned)cqe.user_data, cqe.res);
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	if (any || !wait) return;
+	if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+	  failed = true;
+	  for(auto &b : buf) b.busy = false;
+	  nInFlight = 0;
+	  return;
+	}
+      }
+    }
+
+    void submit(unsigned idx) {
+      Buffer &b = buf[idx];
+
+      if (prealloc && b.offset + bufSize > allocated) {
+	if (fallocate(fd, 0, allocated, PREALLOC_STEP) == 0) allocated += PREALLOC_STEP; else prealloc = false;
+      }
+
+      if (ringFd < 0) {
+	if (!pwriteAll(b.ptr, b.len, b.offset)) failed = true;
+	return;
+      }
+
+      const unsigned tail = *sqTail, i = tail & *sqMask;
+      io_uring_sqe *sqe = &sqes[i];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)b.ptr;
+      sqe->len = (uint32_t)b.len;
+      sqe->off = b.offset;
+      sqe->buf_index = fixed ? (uint16_t)idx : 0;
+      sqe->user_data = idx;
+      sqArray[i] = i;
+      __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+      b.busy = true;
+      nInFlight++;
+
+      while(syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0) {
+	if (errno == EINTR) continue;
+	failed = true;
+	b.busy = false;
+	nInFlight--;
+	break;
+      }
+    }
+
+    void drain() {
+      while(nInFlight > 0) reap(true);
+    }
+
+    // Leaves the queued mode, writing what is buffered as it is
+    void toSync() {
+      if (sync) return;
+      drain();
+      if (direct) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      Buffer &b = buf[cur];
+      if (b.len > 0 && !pwriteAll(b.ptr, b.len, b.offset)) failed = true;
+      sync = true;
+    }
+
+  public:
+    UringFile(const std::string &filename, bool direct_, bool prealloc_, size_t bufSize_ = 1024 * 1024, unsigned depth = 4) :
+      bufSize((bufSize_ + ALIGN - 1) / ALIGN * ALIGN), prealloc(prealloc_), buf(depth) {
+      if (depth < 2) throw(std::runtime_error("UringFile::UringFile depth < 2"));
+
+      if (direct_) {
+	fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	direct = fd >= 0;
+      }
+      if (fd < 0) fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0) throw(std::runtime_error(("UringFile::UringFile Could not open " + filename + " for writing").c_str()));
+
+      for(auto &b : buf) {
+	b.ptr = (uint8_t *)std::aligned_alloc(ALIGN, bufSize);
+	if (!b.ptr) {
+	  for(auto &c : buf) free(c.ptr);
+	  close(fd);
+	  throw(std::runtime_error("UringFile::UringFile Could not allocate buffers"));
+	}
+      }
+
+      setupRing(depth);
+    }
+
+    ~UringFile() {
+      toSync();
+      if (ftruncate(fd, fileSize) != 0) failed = true;
+      close(fd);
+      closeRing();
+      for(auto &b : buf) free(b.ptr);
+    }
+
+    UringFile(const UringFile &) = delete;
+    UringFile &operator=(const UringFile &) = delete;
+
+    size_t getMemoryUsage() const { return bufSize * buf.size(); }
+
+    size_t write(const void *data, size_t n) {
+      const uint8_t *p = (const uint8_t *)data;
+
+      if (!sync && cursor != buf[cur].offset + buf[cur].len) toSync();
+
+      if (sync) {
+	if (!pwriteAll(p, n, cursor)) {
+	  failed = true;
+	  return 0;
+	}
+	cursor += n;
+	fileSize = std::max(fileSize, cursor);
+	return n;
+      }
+
+      for(size_t left = n;left > 0;) {
+	Buffer &b = buf[cur];
+	const size_t z = std::min(left, bufSize - b.len);
+	memcpy(b.ptr + b.len, p, z);
+	b.len += z; p += z; left -= z;
+
+	if (b.len == bufSize) {
+	  submit(cur);
+	  const uint64_t next = b.offset + bufSize;
+	  cur = (cur + 1) % buf.size();
+	  while(buf[cur].busy) reap(true);
+	  buf[cur].offset = next;
+	  buf[cur].len = 0;
+	} else if (nInFlight > 0) {
+	  reap(false);
+	}
+      }
+
+      cursor += n;
+      fileSize = std::max(fileSize, cursor);
+      return failed ? 0 : n;
+    }
+
+    bool seek(int64_t offset, int whence) {
+      const int64_t base = whence == SEEK_CUR ? (int64_t)cursor : whence == SEEK_END ? (int64_t)fileSize : 0;
+      if (base + offset < 0) return false;
+      cursor = base + offset;
+      return true;
+    }
+
+    static size_t onWrite(void *userData, const void *data, size_t n) {
+      return ((UringFile *)userData)->write(data, n);
+    }
+
+    static dr_wav::drwav_bool32 onSeek(void *userData, int offset, dr_wav::drwav_seek_origin origin) {
+      return ((UringFile *)userData)->seek(offset, origin == dr_wav::DRWAV_SEEK_CUR ? SEEK_CUR :
+					   origin == dr_wav::DRWAV_SEEK_END ? SEEK_END : SEEK_SET);
+    }
+  };
+}
+#endif // #if defined(__linux__)
+#endif // #ifndef URINGFILE_HPP
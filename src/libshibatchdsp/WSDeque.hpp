@@ -0,0 +1,99 @@
+#ifndef WSDEQUE_HPP
+#define WSDEQUE_HPP
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace shibatch {
+  /**
+   * Chase-Lev work-stealing deque (Le et al., PPoPP 2013).
+   * push() and take() may be called only by the owner thread, steal()
+   * by any thread. T must be a pointer type; nullptr means "no item".
+   */
+  template<typename T>
+  class WSDeque {
+    struct Array {
+      const int64_t size;
+      std::unique_ptr<std::atomic<T>[]> buf;
+
+      Array(int64_t size_) : size(size_), buf(new std::atomic<T>[size_]) {}
+
+      T get(int64_t i) { return buf[i & (size - 1)].load(std::memory_order_relaxed); }
+      void put(int64_t i, T x) { buf[i & (size - 1)].store(x, std::memory_order_relaxed); }
+    };
+
+    std::atomic<int64_t> top = 0, bottom = 0;
+    std::atomic<Array *> array;
+
+    // Arrays replaced by grow() may still be read by a thief, so they
+    // are kept until the deque is destroyed.
+    std::vector<std::unique_ptr<Array>> arrays;
+
+    Array *grow(Array *a, int64_t b, int64_t t) {
+      arrays.push_back(std::make_unique<Array>(a->size * 2));
+      Array *n = arrays.back().get();
+      for(int64_t i=t;i<b;i++) n->put(i, a->get(i));
+      array.store(n, std::memory_order_release);
+      return n;
+    }
+
+  public:
+    WSDeque(int64_t size = 256) {
+      arrays.push_back(std::make_unique<Array>(size));
+      array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    WSDeque(const WSDeque &) = delete;
+    WSDeque &operator=(const WSDeque &) = delete;
+
+    void push(T x) {
+      int64_t b = bottom.load(std::memory_order_relaxed);
+      int64_t t = top.load(std::memory_order_acquire);
+      Array *a = array.load(std::memory_order_relaxed);
+      if (b - t > a->size - 1) a = grow(a, b, t);
+      a->put(b, x);
+      bottom.store(b + 1, std::memory_order_release);
+    }
+
+    T take() {
+      int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+      Array *a = array.load(std::memory_order_relaxed);
+      bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t t = top.load(std::memory_order_relaxed);
+
+      if (t > b) {
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return nullptr;
+      }
+
+      T x = a->get(b);
+      if (t == b) {
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) x = nullptr;
+	bottom.store(b + 1, std::memory_order_relaxed);
+      }
+      return x;
+    }
+
+    T steal() {
+      int64_t t = top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = bottom.load(std::memory_order_acquire);
+
+      if (t >= b) return nullptr;
+
+      T x = array.load(std::memory_order_acquire)->get(t);
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+      return x;
+    }
+
+    bool empty() {
+      int64_t b = bottom.load(std::memory_order_relaxed);
+      int64_t t = top.load(std::memory_order_relaxed);
+      return t >= b;
+    }
+  };
+}
+#endif // #ifndef WSDEQUE_HPP
@@ -5,11 +5,16 @@
 #include <memory>
 #include <vector>
 #include <deque>
-#include <thread>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
 
 #include "shibatch/ssrc.hpp"
 #include "ArrayQueue.hpp"
+#include "SPSCRing.hpp"
+#include "BGExecutor.hpp"
+#include "MappedFile.hpp"
 #include "dr_wav.hpp"
 
 template<typename T> class ssrc::WavReader<T>::WavReaderImpl {
@@ -23,26 +28,38 @@ namespace shibatch {
     class WavOutlet : public ssrc::StageOutlet<T> {
       WavReaderStage &reader;
       const uint32_t ch;
+      // Frames copied here when the ring is handed back before this
+      // outlet has read them
       ArrayQueue<T> queue;
 
+      // The next frame to decode, from the mapped file or the ring
+      uint64_t pos = 0;
+
     public:
       WavOutlet(WavReaderStage &reader_, int ch_) : reader(reader_), ch(ch_) {}
       ~WavOutlet() {}
       bool atEnd() {
+	if (reader.map) return pos == reader.nFrames;
 	std::unique_lock lock(reader.mtx);
-	return queue.size() == 0 && reader.atEnd();
+	size_t z;
+	return queue.size() == 0 && reader.eof && !reader.locate(pos, z);
       }
 
       size_t read(T *ptr, size_t n) {
-	std::unique_lock lock(reader.mtx);
+	if (reader.map) {
+	  const size_t z = std::min<uint64_t>(n, reader.nFrames - pos);
+	  reader.decode(ptr, ch, pos, z);
+	  pos += z;
+	  return z;
+	}
 
-	size_t s = queue.size();
+	std::unique_lock lock(reader.mtx);
 
-	if (s < n) s += reader.refill(n - s);
+	size_t s = queue.read(ptr, n);
 
-	if (s > n) s = n;
+	if (s < n) s += reader.refill(ch, ptr + s, n - s);
 
-	return queue.read(ptr, s);
+	return s;
       }
 
       friend WavReaderStage;
@@ -54,79 +71,242 @@ namespace shibatch {
     dr_wav::WavFile wav;
     const bool mt;
     std::vector<std::shared_ptr<ssrc::StageOutlet<T>>> outlet;
-    std::vector<T> buf;
-    std::shared_ptr<std::thread> th;
-    BlockingArrayQueue<T> baq;
-
-    size_t refill(size_t n) {
-      buf.resize(std::max(n * getNChannels(), buf.size()));
-      size_t z;
-      if (!mt) {
-	z = wav.readPCM(buf.data(), n);
-      } else {
-	z = baq.read(buf.data(), n * getNChannels()) / getNChannels();
+    const dr_wav::PCMUnpacker &unpacker;
+    const size_t frameSize, sampleSize;
+
+    // The number of frames read at once. In MT mode the ring holds two
+    // chunks, which take readAheadBytes if it is given.
+    const size_t chunkFrames;
+
+    static size_t toChunkFrames(size_t readAheadBytes, size_t frameSize) {
+      return readAheadBytes == 0 ? N : std::max<size_t>(readAheadBytes / (2 * frameSize), 1);
+    }
+
+    // A local file in a plain little-endian format is mapped, and each
+    // outlet decodes its channel straight from the mapped data chunk
+    // into the caller's buffer, at its own position. Nothing is read
+    // ahead, queued or locked.
+    std::unique_ptr<MappedFile> map;
+    const uint8_t *data = nullptr;
+    uint64_t nFrames = 0;
+
+    static std::unique_ptr<MappedFile> tryMap(const std::string &filename, const dr_wav::WavFile &wav) {
+      const dr_wav::drwav w = wav.getWav();
+      if (!dr_wav::PCMUnpacker::isDecodable(w) || w.totalPCMFrameCount == 0) return nullptr;
+
+      try {
+	return std::make_unique<MappedFile>(filename);
+      } catch(std::exception &ex) {
+	return nullptr;
+      }
+    }
+
+    void setupMap() {
+      const dr_wav::drwav w = wav.getWav();
+
+      // A truncated file ends where the mapping does
+      const uint64_t avail = w.dataChunkDataPos < map->size() ? map->size() - w.dataChunkDataPos : 0;
+      data = map->data() + w.dataChunkDataPos;
+      nFrames = std::min<uint64_t>(w.totalPCMFrameCount, avail / frameSize);
+    }
+
+    void decode(T *out, uint32_t ch, uint64_t pos, size_t n) {
+      unpacker.unpack(out, data + pos * frameSize + ch * sampleSize, frameSize, n);
+    }
+
+    // The frames are read as given by wav.readFrames() into the ring,
+    // and each outlet decodes and deinterleaves its channel from there
+    // straight into the caller's buffer. A slot is handed back once
+    // every outlet has passed it. Only when an outlet runs ahead of a
+    // full ring are the frames of the oldest slot that the others have
+    // not read copied into their queues.
+    //
+    // In MT mode, the file is read ahead into the ring by jobs run on
+    // the executor. wavMtx serializes the accesses to wav, and thus the
+    // producer side of the ring, between those jobs and refill().
+    // Otherwise the ring has one slot, which refill() fills itself.
+    SPSCRing<uint8_t> ring;
+    uint64_t ringBase = 0; // The first frame in the oldest slot
+    std::shared_ptr<BGExecutor> executor;
+    std::mutex wavMtx;
+    std::atomic<bool> eof = false, closed = false, scheduled = false;
+
+    WavOutlet &getWavOutlet(unsigned c) { return *std::static_pointer_cast<WavOutlet>(outlet[c]); }
+
+    // Returns frame pos in the ring, and sets z to the number of frames
+    // from there to the end of its slot
+    const uint8_t *locate(uint64_t pos, size_t &z) {
+      uint64_t base = ringBase;
+      size_t size;
+      for(size_t i=0;const uint8_t *ptr = ring.peekRead(i, size);i++) {
+	const uint64_t nf = size / frameSize;
+	if (pos < base + nf) {
+	  z = base + nf - pos;
+	  return ptr + (pos - base) * frameSize;
+	}
+	base += nf;
       }
-      unsigned nc = getNChannels();
+      z = 0;
+      return nullptr;
+    }
+
+    // Hands back the oldest slot if every outlet has passed it or, if
+    // force is true, after copying the rest of it into the queues of
+    // the outlets that have not
+    bool releaseOldest(bool force) {
+      size_t size;
+      const uint8_t *ptr = ring.acquireRead(size);
+      if (!ptr) return false;
 
-      for(unsigned c=0;c<nc;c++) {
-	auto o = std::dynamic_pointer_cast<WavOutlet>(outlet[c]);
+      const uint64_t end = ringBase + size / frameSize;
+      for(unsigned c=0;c<outlet.size();c++) {
+	WavOutlet &o = getWavOutlet(c);
+	if (o.pos >= end) continue;
+	if (!force) return false;
 
-	std::vector<T> v(z);
-	for(size_t i=0;i<z;i++) v[i] = buf[i * nc + c];
-	o->queue.write(std::move(v));
+	std::vector<T> v(end - o.pos);
+	unpacker.unpack(v.data(), ptr + (o.pos - ringBase) * frameSize + c * sampleSize, frameSize, v.size());
+	o.queue.write(std::move(v));
+	o.pos = end;
       }
 
-      return z;
+      ring.releaseRead();
+      ringBase = end;
+      return true;
     }
 
-    void thEntry() {
+    size_t refill(uint32_t ch, T *dst, size_t n) {
+      WavOutlet &o = getWavOutlet(ch);
+
       for(;;) {
-	std::vector<T> buf(N * getNChannels());
-	size_t z = wav.readPCM(buf.data(), N);
-	if (z == 0) {
-	  baq.close();
-	  break;
+	// eof is read first, so that a chunk published before it is found
+	const bool e = eof;
+
+	size_t z;
+	const uint8_t *ptr = locate(o.pos, z);
+	if (ptr) {
+	  z = std::min(n, z);
+	  unpacker.unpack(dst, ptr + ch * sampleSize, frameSize, z);
+	  o.pos += z;
+	  while(releaseOldest(false)) ;
+	  schedule();
+	  return z;
 	}
-	buf.resize(z * getNChannels());
-	baq.write(std::move(buf));
+
+	if (e) return 0;
+
+	if (ring.full()) {
+	  releaseOldest(true);
+	  schedule();
+	  continue;
+	}
+
+	// Read the next chunk here rather than waiting for the job, which
+	// may not get a thread while the caller occupies one.
+	std::unique_lock lock(wavMtx);
+	if (!eof && !ring.full()) readChunk();
       }
     }
 
-  public:
-    WavReaderStage(const std::string &filename, bool mt_) : wav(filename.c_str()), mt(mt_), baq(N * wav.getNChannels()) {
-      outlet.resize(getNChannels());
-      for(unsigned ch=0;ch<getNChannels();ch++)
-	outlet[ch] = std::make_shared<WavOutlet>(*this, ch);
-      if (mt) th = std::make_shared<std::thread>(&WavReaderStage::thEntry, this);
+    void readChunk() {
+      uint8_t *ptr = ring.acquireWrite();
+      size_t z = wav.readFrames(ptr, chunkFrames);
+      if (z == 0) {
+	eof = true;
+	return;
+      }
+      ring.releaseWrite(z * frameSize);
+    }
+
+    void readAhead() {
+      for(;;) {
+	std::unique_lock lock(wavMtx);
+	if (eof || closed || ring.full()) break;
+	readChunk();
+      }
+      scheduled = false;
     }
 
-    WavReaderStage(bool mt_) : wav(), mt(mt_), baq(N * wav.getNChannels()) {
+    void schedule() {
+      if (!mt || eof || ring.full() || scheduled.exchange(true)) return;
+      while(executor->tryPop()) ;
+      executor->push(Runnable::factory([this](void *) { readAhead(); }));
+    }
+
+    void start(std::shared_ptr<ssrc::Executor> executor_) {
       outlet.resize(getNChannels());
       for(unsigned ch=0;ch<getNChannels();ch++)
 	outlet[ch] = std::make_shared<WavOutlet>(*this, ch);
-      if (mt) th = std::make_shared<std::thread>(&WavReaderStage::thEntry, this);
+      if (map) {
+	setupMap();
+	const uint64_t startPos = std::min<uint64_t>(wav.getPosition(), nFrames);
+	for(auto o : outlet) std::dynamic_pointer_cast<WavOutlet>(o)->pos = startPos;
+      } else if (mt) {
+	executor = std::make_shared<BGExecutor>(executor_);
+	schedule();
+      }
+    }
+
+  public:
+    WavReaderStage(const std::string &filename, bool mt_, uint64_t startFrame_ = 0,
+		   std::shared_ptr<ssrc::Executor> executor_ = nullptr, size_t readAheadBytes_ = 0) :
+      wav(filename.c_str()), mt(mt_), unpacker(wav.getUnpacker()), frameSize(wav.getFrameSize()),
+      sampleSize(unpacker.getSampleSize()), chunkFrames(toChunkFrames(readAheadBytes_, frameSize)),
+      map(tryMap(filename, wav)), ring(map ? 0 : mt_ ? 2 : 1, chunkFrames * frameSize) {
+      if (startFrame_ != 0 && !wav.seek(startFrame_))
+	throw(std::runtime_error(("WavReaderStage::WavReaderStage could not seek to frame " + std::to_string(startFrame_)).c_str()));
+      start(executor_);
+    }
+
+    // Reads headerless raw PCM from filename, or from STDIN if it is
+    // empty. A regular file is mapped like a WAV file.
+    WavReaderStage(const std::string &filename, const dr_wav::drwav_fmt &rawFmt, bool mt_,
+		   std::shared_ptr<ssrc::Executor> executor_ = nullptr, size_t readAheadBytes_ = 0) :
+      wav(rawFmt, filename), mt(mt_), unpacker(wav.getUnpacker()), frameSize(wav.getFrameSize()),
+      sampleSize(unpacker.getSampleSize()), chunkFrames(toChunkFrames(readAheadBytes_, frameSize)),
+      map(filename != "" ? tryMap(filename, wav) : nullptr), ring(map ? 0 : mt_ ? 2 : 1, chunkFrames * frameSize) {
+      start(executor_);
+    }
+
+    WavReaderStage(bool mt_, std::shared_ptr<ssrc::Executor> executor_ = nullptr, size_t readAheadBytes_ = 0) :
+      wav(), mt(mt_), unpacker(wav.getUnpacker()), frameSize(wav.getFrameSize()),
+      sampleSize(unpacker.getSampleSize()), chunkFrames(toChunkFrames(readAheadBytes_, frameSize)),
+      ring(mt_ ? 2 : 1, chunkFrames * frameSize) {
+      start(executor_);
     }
 
     dr_wav::drwav getWav() const { return wav.getWav(); }
     dr_wav::drwav_fmt getFmt() const { return wav.getFmt(); }
-    dr_wav::drwav_container getContainer() const { return wav.getContainer(); }
+    dr_wav::Container getContainer() const { return wav.getContainer(); }
     uint32_t getSampleRate() const { return wav.getSampleRate(); }
     uint16_t getNBitsPerSample() const { return wav.getNBitsPerSample(); }
     uint32_t getNChannels() const { return wav.getNChannels(); }
-    uint32_t getNFrames() { return wav.getNFrames(); }
+    uint64_t getNFrames() { return wav.getNFrames(); }
     bool isFloat() { return wav.isFloat(); }
 
     size_t getPosition() { return wav.getNFrames(); }
-    bool atEnd() { return wav.atEnd(); }
+    bool atEnd() {
+      for(auto o : outlet) if (!o->atEnd()) return false;
+      return true;
+    }
 
     std::shared_ptr<ssrc::StageOutlet<T>> getOutlet(uint32_t channel) {
       if (channel >= outlet.size()) throw(std::runtime_error("WavReaderStage::getOutlet channel too large"));
       return outlet[channel];
     }
 
+    // The mapped file is not counted, since its pages belong to the
+    // page cache
+    size_t getMemoryUsage() {
+      std::unique_lock lock(mtx);
+      size_t n = ring.getMemoryUsage();
+      for(auto o : outlet) n += std::dynamic_pointer_cast<WavOutlet>(o)->queue.getMemoryUsage();
+      return n;
+    }
+
     ~WavReaderStage() {
-      baq.close();
-      if (th) th->join();
+      closed = true;
+      if (executor) while(executor->size() > 0) executor->pop();
     }
   };
 }
@@ -5,11 +5,18 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <type_traits>
 
 #include "shibatch/ssrc.hpp"
 #include "dr_wav.hpp"
 #include "BGExecutor.hpp"
-#include "BlockingQueue.hpp"
+#include "SPSCRing.hpp"
+#include "ThreadPolicy.hpp"
+#include "UringFile.hpp"
+#include "Dither.hpp"
 
 template<typename T> class ssrc::WavWriter<T>::WavWriterImpl {
 public:
@@ -17,99 +24,301 @@ public:
 };
 
 namespace shibatch {
+  /**
+   * In MT mode, each channel is read ahead by a job that fills a ring
+   * of depth blocks and stays on the executor as long as there is room
+   * in the ring. The blocks are packed into the sample format of the
+   * file and interleaved in one pass into another ring of depth frames
+   * buffers, which is written out by a dedicated thread. All buffers
+   * are allocated up front and recycled.
+   *
+   * With ASYNC_IO on Linux, the file is written through a UringFile,
+   * which keeps several writes in flight.
+   *
+   * With dither, the blocks of all channels are dithered and packed
+   * together, a few thousand samples at a time. The scaled input and
+   * the noise are interleaved into small buffers, the channels are
+   * noise shaped side by side, and the quantized frames are packed
+   * straight into the frames buffer, so the intermediate values stay
+   * in cache.
+   */
   template<typename T>
   class WavWriterStage : public ssrc::WavWriter<T>::WavWriterImpl {
+    struct Channel {
+      SPSCRing<T> ring;
+      std::shared_ptr<Runnable> job;
+
+      // mtx serializes the producer side of the ring between the job
+      // and execute(), which reads the block itself if the ring is empty
+      std::mutex mtx;
+      std::atomic<bool> end = false, scheduled = false;
+
+      Channel(unsigned depth, size_t n) : ring(depth, n) {}
+    };
+
     const size_t N;
+#if defined(__linux__)
+    // Declared before wav, which fixes up the header through it when closed
+    std::unique_ptr<UringFile> file;
+#endif
     dr_wav::WavFile wav;
     const std::vector<std::shared_ptr<ssrc::StageOutlet<T>>> in;
     const bool mt;
     std::shared_ptr<BGExecutor> bgExecutor;
-    BlockingQueue<std::vector<T>> queue;
+    std::vector<std::unique_ptr<Channel>> channel;
+    std::unique_ptr<SPSCRing<uint8_t>> frames;
+    std::vector<T> zeros;
+    std::shared_ptr<ssrc::WriterDither> dither;
+    std::unique_ptr<NoiseShaper<int32_t, T>> shaper;
+    size_t ditherFrames = 0;
+    std::vector<double> x, rnd, rndbuf;
+    std::vector<int32_t> q;
+    std::vector<uint8_t> pbuf;
     std::shared_ptr<std::thread> th;
+    std::atomic<bool> closed = false;
+    bool endQueued = false;
 
     void thEntry() {
-      const unsigned nch = wav.getNChannels();
+      applyThreadPolicy();
 
       for(;;) {
-	auto v = queue.pop();
-	if (v.size() == 0) break;
-	wav.writePCM(v.data(), v.size() / nch);
+	frames->waitRead();
+	size_t size = 0;
+	const uint8_t *ptr = frames->acquireRead(size);
+	if (size == 0) break;
+	wav.writeRaw(ptr, size);
+	frames->releaseRead();
+      }
+    }
+
+    // The blocks of the channels are interleaved frame by frame, so a
+    // block is filled unless the channel ends. An outlet may return
+    // less than requested, e.g. at the end of a chunk of the source.
+    size_t readFully(unsigned c, T *ptr, size_t n) {
+      size_t z = 0;
+      while(z < n) {
+	size_t r = in[c]->read(ptr + z, n - z);
+	if (r == 0) break;
+	z += r;
+      }
+      return z;
+    }
+
+    void readBlock(unsigned c) {
+      Channel &ch = *channel[c];
+      T *ptr = ch.ring.acquireWrite();
+      size_t z = readFully(c, ptr, N);
+      if (z == 0) ch.end = true;
+      ch.ring.releaseWrite(z);
+    }
+
+    bool fillable(Channel &ch) { return !closed && !ch.end && !ch.ring.full(); }
+
+    void readAhead(unsigned c) {
+      Channel &ch = *channel[c];
+      // The lock is only tried, since the reader may hold it while
+      // waiting for jobs that cannot run while this job blocks a thread.
+      // The reader schedules the job again after reading the block.
+      bool busy = false;
+      do {
+	for(;;) {
+	  std::unique_lock lock(ch.mtx, std::try_to_lock);
+	  if (!lock.owns_lock()) { busy = true; break; }
+	  if (!fillable(ch)) break;
+	  readBlock(c);
+	}
+	ch.scheduled = false;
+      } while(!busy && fillable(ch) && !ch.scheduled.exchange(true));
+    }
+
+    void schedule(unsigned c) {
+      Channel &ch = *channel[c];
+      if (ch.end || ch.ring.full() || ch.scheduled.exchange(true)) return;
+      bgExecutor->push(ch.job);
+    }
+
+    size_t acquireBlock(unsigned c, const T *&ptr) {
+      Channel &ch = *channel[c];
+
+      // Read the block here rather than waiting for the job, which may
+      // not get a thread while the caller occupies one.
+      if (ch.ring.empty()) {
+	std::unique_lock lock(ch.mtx);
+	if (ch.ring.empty()) readBlock(c);
+      }
+
+      size_t z = 0;
+      ptr = ch.ring.acquireRead(z);
+      return z;
+    }
+
+    // Dithers and packs zmax interleaved frames to dst. Frames past the
+    // end of a channel are packed as zeros and take no noise, as when
+    // the outlets of DitherStage are written.
+    void packDithered(uint8_t *dst, const T *const *cptr, const size_t *clen, size_t zmax) {
+      const dr_wav::PCMPacker &packer = wav.getPacker();
+      const size_t nch = in.size(), ss = packer.getSampleSize();
+
+      for(size_t pos=0;pos<zmax;pos+=ditherFrames) {
+	const size_t m = std::min(ditherFrames, zmax - pos);
+
+	for(size_t c=0;c<nch;c++) {
+	  const size_t k = clen[c] > pos ? std::min(m, clen[c] - pos) : 0;
+	  const T *src = cptr[c] + pos;
+
+	  dither->rng[c]->fill(rndbuf.data(), k);
+	  for(size_t p=0;p<k;p++) {
+	    x[p * nch + c] = dither->gain * src[p] + dither->offset;
+	    rnd[p * nch + c] = rndbuf[p];
+	  }
+	  for(size_t p=k;p<m;p++) {
+	    x[p * nch + c] = dither->offset;
+	    rnd[p * nch + c] = 0;
+	  }
+	}
+
+	shaper->process(q.data(), x.data(), rnd.data(), m);
+
+	for(size_t c=0;c<nch;c++) {
+	  const size_t k = clen[c] > pos ? std::min(m, clen[c] - pos) : 0;
+	  for(size_t p=k;p<m;p++) q[p * nch + c] = 0;
+	}
+
+	packer.pack(dst + pos * ss * nch, ss, q.data(), m * nch);
       }
     }
 
   public:
     WavWriterStage(const std::string &filename, const dr_wav::drwav_fmt &fmt, const dr_wav::Container& container,
-	      const std::vector<std::shared_ptr<ssrc::StageOutlet<T>>> &in_, uint64_t nFrames = 0, size_t bufsize = 65536, bool mt_ = true) :
-      N(bufsize), wav(filename.c_str(), fmt, container, nFrames), in(in_), mt(mt_) {
+	      const std::vector<std::shared_ptr<ssrc::StageOutlet<T>>> &in_, uint64_t nFrames = 0, size_t bufsize = 65536, bool mt_ = true,
+	      std::shared_ptr<ssrc::Executor> executor_ = nullptr, unsigned depth = 3, unsigned ioFlags = 0,
+	      std::shared_ptr<ssrc::WriterDither> dither_ = nullptr) :
+      N(bufsize),
+#if defined(__linux__)
+      file((ioFlags & ssrc::WavWriter<T>::ASYNC_IO) && nFrames == 0 && filename != "" ?
+	   std::make_unique<UringFile>(filename, ioFlags & ssrc::WavWriter<T>::DIRECT_IO, ioFlags & ssrc::WavWriter<T>::PREALLOCATE) : nullptr),
+      wav(filename.c_str(), fmt, container, nFrames, file ? UringFile::onWrite : nullptr, file ? UringFile::onSeek : nullptr, file.get()),
+#else
+      wav(filename.c_str(), fmt, container, nFrames),
+#endif
+      in(in_), mt(mt_), dither(dither_) {
       if (fmt.channels != in.size()) throw(std::runtime_error("WavWriterStage::WavWriterStage fmt.channels != in.size()"));
-      if (mt) bgExecutor = std::make_shared<BGExecutor>();
+      if (depth < 1) throw(std::runtime_error("WavWriterStage::WavWriterStage depth < 1"));
+      wav.getPacker(); // Fails here on a format that cannot be written
+      if (dither) {
+	if (!std::is_floating_point_v<T>) throw(std::runtime_error("WavWriterStage::WavWriterStage dither needs float or double samples"));
+	if (dither->rng.size() != in.size()) throw(std::runtime_error("WavWriterStage::WavWriterStage dither->rng.size() != in.size()"));
+	if (!dither->coef) throw(std::runtime_error("WavWriterStage::WavWriterStage dither->coef == nullptr"));
+	shaper = std::make_unique<NoiseShaper<int32_t, T>>(in.size(), dither->clipMin, dither->clipMax, dither->coef);
+	ditherFrames = std::max<size_t>(1, 4096 / in.size());
+	x.resize(ditherFrames * in.size());
+	rnd.resize(ditherFrames * in.size());
+	rndbuf.resize(ditherFrames);
+	q.resize(ditherFrames * in.size());
+	if (!mt) pbuf.resize(N * wav.getWav().fmt.blockAlign);
+      }
+      if (mt) {
+	bgExecutor = std::make_shared<BGExecutor>(executor_);
+	for(unsigned c=0;c<in.size();c++) {
+	  channel.push_back(std::make_unique<Channel>(depth, N));
+	  channel[c]->job = Runnable::factory([this, c](void *) { readAhead(c); });
+	}
+	frames = std::make_unique<SPSCRing<uint8_t>>(depth, N * wav.getWav().fmt.blockAlign);
+	zeros.resize(N);
+      }
     }
 
     ~WavWriterStage() {
+      closed = true;
+      if (bgExecutor) while(bgExecutor->size() > 0) bgExecutor->pop();
+
       if (th) {
-	queue.push(std::vector<T>(0));
+	if (!endQueued) {
+	  frames->waitWrite();
+	  frames->acquireWrite();
+	  frames->releaseWrite(0);
+	}
 	th->join();
 	th = nullptr;
       }
     }
 
+    size_t getMemoryUsage() {
+      size_t n = zeros.capacity() * sizeof(T) + (x.capacity() + rnd.capacity() + rndbuf.capacity()) * sizeof(double) +
+	q.capacity() * sizeof(int32_t) + pbuf.capacity();
+      if (shaper) n += shaper->getMemoryUsage();
+      for(auto &ch : channel) n += ch->ring.getMemoryUsage();
+      if (frames) n += frames->getMemoryUsage();
+#if defined(__linux__)
+      if (file) n += file->getMemoryUsage();
+#endif
+      return n;
+    }
+
     void execute() {
       const unsigned nch = wav.getNChannels();
 
       if (!mt) {
-	std::vector<T> cbuf(N), fbuf(N * nch);
+	std::vector<std::vector<T>> cbuf(nch, std::vector<T>(N));
+	std::vector<const T *> cptr(nch);
+	std::vector<size_t> clen(nch);
 	for(;;) {
 	  size_t zmax = 0;
 	  for(unsigned c=0;c<nch;c++) {
-	    size_t z = in[c]->read(cbuf.data(), N);
+	    size_t z = readFully(c, cbuf[c].data(), N);
+	    clen[c] = z;
 	    zmax = std::max(z, zmax);
-	    for(size_t i=0;i<z;i++) fbuf[i * nch + c] = cbuf[i];
-	    for(size_t i=z;i<N;i++) fbuf[i * nch + c] = 0;
+	    std::fill(cbuf[c].begin() + z, cbuf[c].end(), 0);
+	    cptr[c] = cbuf[c].data();
 	  }
 	  if (zmax == 0) break;
-	  wav.writePCM(fbuf.data(), zmax);
+	  if (dither) {
+	    packDithered(pbuf.data(), cptr.data(), clen.data(), zmax);
+	    wav.writeRaw(pbuf.data(), zmax * wav.getPacker().getSampleSize() * nch);
+	  } else {
+	    wav.writePCM(cptr.data(), zmax);
+	  }
 	}
       } else {
+	const dr_wav::PCMPacker &packer = wav.getPacker();
+	const size_t ss = packer.getSampleSize(), fs = ss * nch;
+	std::vector<const T *> cptr(nch);
+	std::vector<size_t> clen(nch);
+
 	th = std::make_shared<std::thread>(&WavWriterStage::thEntry, this);
-	std::vector<T> fbuf(N * nch);
-	std::vector<std::vector<size_t>> vz(2);
-
-	std::vector<std::vector<std::vector<T>>> cbuf(2);
-	for(unsigned p=0;p<2;p++) {
-	  vz[p].resize(nch);
-	  cbuf[p].resize(nch);
-	  for(unsigned c=0;c<nch;c++) cbuf[p][c].resize(N);
-	}
 
-	for(unsigned c=0;c<nch;c++) {
-	  bgExecutor->push(Runnable::factory([&, c](void *ptr) {
-	    vz[0][c] = in[c]->read((T*)ptr, N);
-	  }, cbuf[0][c].data()));
-	}
+	for(;;) {
+	  for(unsigned c=0;c<nch;c++) schedule(c);
 
-	for(unsigned p=0;;p ^= 1) {
-	  for(unsigned c=0;c<nch;c++) bgExecutor->pop();
+	  frames->waitWrite();
+	  uint8_t *fbuf = frames->acquireWrite();
 
+	  size_t zmax = 0;
 	  for(unsigned c=0;c<nch;c++) {
-	    bgExecutor->push(Runnable::factory([&, p, c](void *ptr) {
-	      vz[p ^ 1][c] = in[c]->read((T*)ptr, N);
-	    }, cbuf[p ^ 1][c].data()));
+	    clen[c] = acquireBlock(c, cptr[c]);
+	    zmax = std::max(clen[c], zmax);
 	  }
 
-	  size_t zmax = 0;
+	  if (dither) packDithered(fbuf, cptr.data(), clen.data(), zmax);
+
 	  for(unsigned c=0;c<nch;c++) {
-	    size_t z = vz[p][c];
-	    zmax = std::max(z, zmax);
-	    for(size_t i=0;i<z;i++) fbuf[i * nch + c] = cbuf[p][c][i];
-	    for(size_t i=z;i<N;i++) fbuf[i * nch + c] = 0;
+	    if (!dither) {
+	      packer.pack(fbuf + c * ss, fs, cptr[c], clen[c]);
+	      packer.pack(fbuf + clen[c] * fs + c * ss, fs, zeros.data(), zmax - clen[c]);
+	    }
+
+	    // The empty block marking the end stays in the ring
+	    if (clen[c] != 0) channel[c]->ring.releaseRead();
+	    schedule(c);
 	  }
+
+	  frames->releaseWrite(zmax * fs);
 	  if (zmax == 0) break;
-	  std::vector<T> v(zmax * nch);
-	  memcpy(v.data(), fbuf.data(), zmax * nch * sizeof(T));
-	  queue.push(std::move(v));
+
+	  while(bgExecutor->tryPop()) ;
 	}
 
-	for(unsigned c=0;c<nch;c++) bgExecutor->pop();
+	endQueued = true;
       }
     }
   };
@@ -8,6 +8,18 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <bit>
+#include <climits>
+#include <filesystem>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -63,23 +75,30 @@ namespace dr_wav {
 
   //::std::ostream& operator<<(::std::ostream &os, const drwav_fmt &fmt) { return os << to_string(Format(fmt)); }
 
+  /**
+   * A container of dr_wav, or headerless raw PCM, which is 0x1005.
+   * Raw PCM is interleaved little-endian frames and nothing else.
+   */
   class Container {
     const drwav_container c;
+    const bool raw = false;
   public:
-    Container(const Container &c_) : c(c_.c) {}
-    Container(const drwav_container &c_) : c(c_) {}
+    Container(const Container &c_) : c(c_.c), raw(c_.raw) {}
+    Container(const drwav_container &c_, bool raw_ = false) : c(c_), raw(raw_) {}
     Container(const uint16_t &c_) : c(
        (c_ == 0x1001 ? drwav_container_rifx :
 	(c_ == 0x1002 ? drwav_container_w64 :
 	 (c_ == 0x1003 ? drwav_container_rf64 :
-	  (c_ == 0x1004 ? drwav_container_aiff : drwav_container_riff))))) {}
+	  (c_ == 0x1004 ? drwav_container_aiff : drwav_container_riff))))), raw(c_ == 0x1005) {}
     operator uint16_t() const {
+      if (raw) return 0x1005;
       return (c == drwav_container_rifx ? 0x1001 :
 	      (c == drwav_container_w64  ? 0x1002 :
 	       (c == drwav_container_rf64 ? 0x1003 :
 		(c == drwav_container_aiff ? 0x1004 : 0x1000))));
     }
     operator drwav_container() const { return c; }
+    bool isRaw() const { return raw; }
   };
 
   struct Sample24 {
@@ -137,6 +156,278 @@ namespace dr_wav {
     Sample8(double d) : Sample8((int16_t)rint(d * 0x7f + 0x80)) {}
   };
 
+  /**
+   * Packs samples into the little-endian sample formats of WAV files.
+   * A block of samples is first quantized and clipped with SSE2 or
+   * NEON where available, and then stored with a byte stride, so
+   * that a channel can be packed straight into its place in the
+   * interleaved frames. The values are the same as those given by the
+   * Sample structs and dr_wav, except that out-of-range samples are
+   * clipped instead of wrapping around.
+   */
+  class PCMPacker {
+  public:
+    enum Encoding { U8, S16, S24, S32, F32, F64 };
+
+  private:
+    static constexpr size_t B = 256;
+
+    Encoding encoding;
+    size_t sampleSize;
+
+    // Integer samples from Dither are already scaled, and are only
+    // clipped. Other samples are scaled, clipped, and then rounded to
+    // nearest even as rint() does, or truncated as dr_wav does.
+    template<bool ROUND, typename T>
+    static void quantize(int32_t *q, const T *s, size_t n, double scale, double offset, int32_t lo, int32_t hi) {
+      if constexpr (::std::is_integral_v<T>) {
+	for(size_t i=0;i<n;i++) q[i] = ::std::min(::std::max((int32_t)s[i], lo), hi);
+      } else {
+	const T tscale = (T)scale, toffset = (T)offset;
+	size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+	if constexpr (::std::is_same_v<T, float>) {
+	  const __m128 vs = _mm_set1_ps(tscale), vo = _mm_set1_ps(toffset);
+	  if constexpr (ROUND) {
+	    // The bounds are exact in float for up to 24 bits
+	    const __m128 vlo = _mm_set1_ps((float)lo), vhi = _mm_set1_ps((float)hi);
+	    for(;i+4<=n;i+=4) {
+	      __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s + i), vs), vo);
+	      x = _mm_min_ps(_mm_max_ps(x, vlo), vhi);
+	      _mm_storeu_si128((__m128i *)(q + i), _mm_cvtps_epi32(x));
+	    }
+	  } else {
+	    // Only for 32 bits. An overflow gives INT32_MIN, which the
+	    // mask turns into INT32_MAX for the positive side.
+	    const __m128 vmax = _mm_set1_ps(2147483648.0f);
+	    for(;i+4<=n;i+=4) {
+	      __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s + i), vs), vo);
+	      __m128i v = _mm_xor_si128(_mm_cvttps_epi32(x), _mm_castps_si128(_mm_cmpge_ps(x, vmax)));
+	      _mm_storeu_si128((__m128i *)(q + i), v);
+	    }
+	  }
+	} else if constexpr (ROUND) {
+	  const __m128d vs = _mm_set1_pd(tscale), vo = _mm_set1_pd(toffset);
+	  const __m128d vlo = _mm_set1_pd(lo), vhi = _mm_set1_pd(hi);
+	  for(;i+4<=n;i+=4) {
+	    __m128d x0 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(s + i + 0), vs), vo);
+	    __m128d x1 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(s + i + 2), vs), vo);
+	    x0 = _mm_min_pd(_mm_max_pd(x0, vlo), vhi);
+	    x1 = _mm_min_pd(_mm_max_pd(x1, vlo), vhi);
+	    _mm_storeu_si128((__m128i *)(q + i), _mm_unpacklo_epi64(_mm_cvtpd_epi32(x0), _mm_cvtpd_epi32(x1)));
+	  }
+	}
+#elif defined(__aarch64__)
+	if constexpr (::std::is_same_v<T, float> && ROUND) {
+	  const float32x4_t vs = vdupq_n_f32(tscale), vo = vdupq_n_f32(toffset);
+	  const float32x4_t vlo = vdupq_n_f32((float)lo), vhi = vdupq_n_f32((float)hi);
+	  for(;i+4<=n;i+=4) {
+	    float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(s + i), vs), vo);
+	    x = vminq_f32(vmaxq_f32(x, vlo), vhi);
+	    vst1q_s32(q + i, vcvtnq_s32_f32(x));
+	  }
+	}
+#endif
+
+	for(;i<n;i++) {
+	  double x = (T)(s[i] * tscale + toffset);
+	  x = ::std::min(::std::max(x, (double)lo), (double)hi);
+	  if constexpr (ROUND) x = ::std::rint(x);
+	  q[i] = (int32_t)x;
+	}
+      }
+    }
+
+    template<typename D, typename T> static D toFloat(T s) {
+      if constexpr (::std::is_integral_v<T>) return (D)(s / 2147483648.0); else return (D)s;
+    }
+
+    template<size_t S, typename U>
+    static void store(uint8_t *dst, size_t dstride, const U *v, size_t n) {
+      auto put = [](uint8_t *d, U x) {
+	uint64_t u;
+	if constexpr (::std::is_same_v<U, float>) u = ::std::bit_cast<uint32_t>(x);
+	else if constexpr (::std::is_same_v<U, double>) u = ::std::bit_cast<uint64_t>(x);
+	else u = (uint32_t)x;
+	for(size_t b=0;b<S;b++) d[b] = (uint8_t)(u >> (8 * b));
+      };
+
+      // A constant stride lets the compiler merge the byte stores
+      if (dstride == S) {
+	for(size_t i=0;i<n;i++) put(dst + i * S, v[i]);
+      } else {
+	for(size_t i=0;i<n;i++) put(dst + i * dstride, v[i]);
+      }
+    }
+
+  public:
+    PCMPacker(const drwav_fmt &fmt) {
+      const uint16_t tag = fmt.formatTag == Format::EXTENSIBLE ? fmt.subFormat[0] : fmt.formatTag;
+      sampleSize = fmt.bitsPerSample / 8;
+
+      if (tag == Format::PCM && fmt.bitsPerSample == 8) encoding = U8;
+      else if (tag == Format::PCM && fmt.bitsPerSample == 16) encoding = S16;
+      else if (tag == Format::PCM && fmt.bitsPerSample == 24) encoding = S24;
+      else if (tag == Format::PCM && fmt.bitsPerSample == 32) encoding = S32;
+      else if (tag == Format::IEEE_FLOAT && fmt.bitsPerSample == 32) encoding = F32;
+      else if (tag == Format::IEEE_FLOAT && fmt.bitsPerSample == 64) encoding = F64;
+      else {
+	::std::string s = "PCMPacker::PCMPacker Unsupported format, formatTag = ";
+	s += ::std::to_string(fmt.formatTag) + ", bitsPerSample = " + ::std::to_string(fmt.bitsPerSample);
+	throw(::std::runtime_error(s.c_str()));
+      }
+    }
+
+    Encoding getEncoding() const { return encoding; }
+    size_t getSampleSize() const { return sampleSize; }
+
+    /** True if the samples of type T are stored as they are in memory */
+    template<typename T> bool isVerbatim() const {
+      if constexpr (::std::endian::native != ::std::endian::little) return false;
+      return (::std::is_same_v<T, float> && encoding == F32) || (::std::is_same_v<T, double> && encoding == F64) ||
+	(::std::is_same_v<T, int32_t> && encoding == S32);
+    }
+
+    /** Packs n samples from src to dst, dstride bytes apart */
+    template<typename T>
+    void pack(uint8_t *dst, size_t dstride, const T *src, size_t n) const {
+      for(size_t pos=0;pos<n;pos+=B) {
+	const size_t m = ::std::min(B, n - pos);
+	const T *s = src + pos;
+	uint8_t *d = dst + pos * dstride;
+	int32_t q[B];
+
+	switch(encoding) {
+	case U8:
+	  quantize<true>(q, s, m, 0x7f, 0x80, 0x00, 0xff);
+	  store<1>(d, dstride, q, m);
+	  break;
+	case S16:
+	  quantize<true>(q, s, m, 0x7fff, 0, -0x8000, +0x7fff);
+	  store<2>(d, dstride, q, m);
+	  break;
+	case S24:
+	  quantize<true>(q, s, m, 0x7fffff, 0, -0x800000, +0x7fffff);
+	  store<3>(d, dstride, q, m);
+	  break;
+	case S32:
+	  // Truncated as dr_wav does
+	  quantize<false>(q, s, m, 2147483648.0, 0, INT32_MIN, INT32_MAX);
+	  store<4>(d, dstride, q, m);
+	  break;
+	case F32: {
+	  float f[B];
+	  for(size_t i=0;i<m;i++) f[i] = toFloat<float>(s[i]);
+	  store<4>(d, dstride, f, m);
+	} break;
+	case F64: {
+	  double f[B];
+	  for(size_t i=0;i<m;i++) f[i] = toFloat<double>(s[i]);
+	  store<8>(d, dstride, f, m);
+	} break;
+	}
+      }
+    }
+  };
+
+  /**
+   * Decodes the samples of one channel of a PCM or IEEE float data
+   * chunk into float or double in one pass. n samples are read from
+   * src, sstride bytes apart, so that a channel can be taken straight
+   * out of the interleaved frames. The data is in the byte order of
+   * the host.
+   *
+   * Decoding to float gives the same values as dr_wav. Decoding to
+   * double does not go through float, and keeps the precision of
+   * 24-bit and 32-bit samples.
+   */
+  class PCMUnpacker {
+    PCMPacker::Encoding encoding;
+    size_t sampleSize;
+
+  public:
+    PCMUnpacker(PCMPacker::Encoding encoding_) : encoding(encoding_) {
+      const size_t size[] = { 1, 2, 3, 4, 4, 8 };
+      sampleSize = size[encoding];
+    }
+
+    /** True if the raw frames of w can be decoded */
+    static bool isDecodable(const drwav &w) {
+      if constexpr (::std::endian::native != ::std::endian::little) return false;
+
+      if (w.container != drwav_container_riff && w.container != drwav_container_rf64 &&
+	  w.container != drwav_container_w64) return false;
+      if (w.bitsPerSample % 8 != 0 || w.bitsPerSample == 0) return false;
+      return (w.translatedFormatTag == DR_WAVE_FORMAT_PCM && w.bitsPerSample <= 32) ||
+	(w.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT && (w.bitsPerSample == 32 || w.bitsPerSample == 64));
+    }
+
+    /** The encoding of the raw frames of w, which must be decodable */
+    static PCMPacker::Encoding encodingOf(const drwav &w) {
+      if (w.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) return w.bitsPerSample == 32 ? PCMPacker::F32 : PCMPacker::F64;
+      const PCMPacker::Encoding e[] = { PCMPacker::U8, PCMPacker::S16, PCMPacker::S24, PCMPacker::S32 };
+      return e[w.bitsPerSample / 8 - 1];
+    }
+
+    PCMPacker::Encoding getEncoding() const { return encoding; }
+    size_t getSampleSize() const { return sampleSize; }
+
+    template<typename T>
+    void unpack(T *dst, const uint8_t *src, size_t sstride, size_t n) const {
+      constexpr bool F = ::std::is_same_v<T, float>;
+      const uint8_t *p = src;
+
+      switch(encoding) {
+      case PCMPacker::U8:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  if constexpr (F) {
+	    float x = *p;
+	    x = x * 0.00784313725490196078f;
+	    dst[i] = x - 1;
+	  } else {
+	    dst[i] = *p * (2.0 / 255) - 1;
+	  }
+	}
+	break;
+      case PCMPacker::S16:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  int16_t s;
+	  memcpy(&s, p, sizeof(s));
+	  if constexpr (F) dst[i] = (float)(s * 0.000030517578125f); else dst[i] = s * (1.0 / 32768);
+	}
+	break;
+      case PCMPacker::S24:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  const int32_t s = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8;
+	  if constexpr (F) dst[i] = (float)(s * 0.00000011920928955078125); else dst[i] = s * (1.0 / 8388608);
+	}
+	break;
+      case PCMPacker::S32:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  int32_t s;
+	  memcpy(&s, p, sizeof(s));
+	  dst[i] = (T)(s / 2147483648.0);
+	}
+	break;
+      case PCMPacker::F32:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  float f;
+	  memcpy(&f, p, sizeof(f));
+	  dst[i] = f;
+	}
+	break;
+      case PCMPacker::F64:
+	for(size_t i=0;i<n;i++, p += sstride) {
+	  double d;
+	  memcpy(&d, p, sizeof(d));
+	  dst[i] = (T)d;
+	}
+	break;
+      }
+    }
+  };
+
   class DataFormat {
     drwav_data_format format;
   public:
@@ -217,6 +508,95 @@ namespace dr_wav {
       return fwrite(pData, 1, bytesToWrite, (FILE *)pUserData);
     }
 
+    // Writes to STDOUT without knowing the length in advance. The header
+    // is held back until drwav has written it, and its sizes are then
+    // set to the largest values, which readers take as running up to
+    // the end of the stream. If STDOUT is a file, drwav fixes them up
+    // when closing.
+    class StdoutStream {
+      ::std::vector<uint8_t> header;
+      bool holding = true;
+      const long base;
+
+    public:
+      StdoutStream() : base(ftell(stdout)) {}
+
+      static size_t onWrite(void* pUserData, const void* pData, size_t bytesToWrite) {
+	StdoutStream &s = *(StdoutStream *)pUserData;
+	if (!s.holding) return fwrite(pData, 1, bytesToWrite, stdout);
+	s.header.insert(s.header.end(), (const uint8_t *)pData, (const uint8_t *)pData + bytesToWrite);
+	return bytesToWrite;
+      }
+
+      static drwav_bool32 onSeek(void* pUserData, int offset, drwav_seek_origin origin) {
+	StdoutStream &s = *(StdoutStream *)pUserData;
+	if (s.base < 0 || origin != DRWAV_SEEK_SET) return DRWAV_FALSE;
+	return fseek(stdout, s.base + offset, SEEK_SET) == 0;
+      }
+
+      void release(const drwav &w) {
+	auto unknown = [&](size_t pos, size_t n) {
+	  if (pos + n <= header.size()) memset(header.data() + pos, 0xff, n);
+	};
+
+	// The 64-bit sizes are set to the largest signed value rather
+	// than all ones, so that a reader adding the data position to
+	// it does not wrap around before clamping it to the file size
+	auto unknown64 = [&](size_t pos) {
+	  if (pos + 8 > header.size()) return;
+	  memset(header.data() + pos, 0xff, 7);
+	  header[pos + 7] = 0x7f;
+	};
+
+	switch(w.container) {
+	case drwav_container_riff:
+	  unknown(4, 4);
+	  unknown(w.dataChunkDataPos - 4, 4);
+	  break;
+	case drwav_container_rf64:
+	  // The RIFF and data sizes in ds64. The sample count is left 0 so
+	  // that readers take the length from the data size.
+	  unknown64(20);
+	  unknown64(28);
+	  break;
+	case drwav_container_w64:
+	  unknown64(16);
+	  unknown64(w.dataChunkDataPos - 8);
+	  break;
+	default:
+	  break;
+	}
+
+	holding = false;
+	if (fwrite(header.data(), 1, header.size(), stdout) != header.size())
+	  throw(::std::runtime_error("WavFile::StdoutStream::release Could not write to STDOUT"));
+      }
+    };
+
+    ::std::unique_ptr<StdoutStream> stream;
+
+    // Headerless raw PCM is read from rawIn and written through
+    // rawWrite as it is, without a header and without seeking. wav
+    // only describes the format.
+    bool raw = false, rawEof = false;
+    FILE *rawIn = nullptr;
+    drwav_write_proc rawWrite = nullptr;
+    void *rawUserData = nullptr;
+    uint64_t rawPos = 0;
+
+    void setRawFormat(const drwav_fmt &fmt) {
+      if (fmt.channels == 0 || fmt.bitsPerSample % 8 != 0)
+	throw(::std::runtime_error("WavFile::setRawFormat Unsupported raw format"));
+      raw = true;
+      wav.container = drwav_container_riff;
+      wav.fmt = fmt;
+      wav.fmt.blockAlign = fmt.channels * (fmt.bitsPerSample / 8);
+      wav.channels = fmt.channels;
+      wav.sampleRate = fmt.sampleRate;
+      wav.bitsPerSample = fmt.bitsPerSample;
+      wav.translatedFormatTag = fmt.formatTag == Format::EXTENSIBLE ? fmt.subFormat[0] : fmt.formatTag;
+    }
+
   public:
     WavFile(const ::std::string &filename) {
       memset(&wav, 0, sizeof(wav));
@@ -230,14 +610,55 @@ namespace dr_wav {
 	throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for writing").c_str()));
     }
 
-    WavFile(const ::std::string &filename, const drwav_fmt &fmt, const Container& container, uint64_t totalPCMFrameCount = 0) {
+    WavFile(const ::std::string &filename, const drwav_fmt &fmt, const Container& container, uint64_t totalPCMFrameCount = 0) :
+      WavFile(filename, fmt, container, totalPCMFrameCount, nullptr, nullptr, nullptr) {}
+
+    /**
+     * If onWrite_ is given, the file is written through onWrite_ and
+     * onSeek_ instead of filename. If filename is empty, the file is
+     * written to STDOUT, with a header of totalPCMFrameCount frames, or
+     * of an unknown length if totalPCMFrameCount is 0.
+     */
+    WavFile(const ::std::string &filename, const drwav_fmt &fmt, const Container& container, uint64_t totalPCMFrameCount,
+	    drwav_write_proc onWrite_, drwav_seek_proc onSeek_, void *userData_) {
       memset(&wav, 0, sizeof(wav));
+      if (container.isRaw()) {
+	setRawFormat(fmt);
+	if (onWrite_) {
+	  rawWrite = onWrite_;
+	  rawUserData = userData_;
+	} else if (filename == "") {
+#ifdef _WIN32
+	  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+	  rawWrite = on_write;
+	  rawUserData = stdout;
+	} else {
+	  fp = fopen(filename.c_str(), "wb");
+	  if (!fp) throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for writing").c_str()));
+	  rawWrite = on_write;
+	  rawUserData = fp;
+	}
+	return;
+      }
+      if (!onWrite_ && filename == "" && totalPCMFrameCount == 0) {
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	stream = ::std::make_unique<StdoutStream>();
+	onWrite_ = StdoutStream::onWrite;
+	onSeek_ = StdoutStream::onSeek;
+	userData_ = stream.get();
+      }
       switch(fmt.formatTag) {
       case Format::PCM:
       case Format::IEEE_FLOAT:
 	{
 	  drwav_data_format df = DataFormat(fmt, container).getContent();
-	  if (totalPCMFrameCount == 0) {
+	  if (onWrite_) {
+	    if (!drwav_init_write(&wav, &df, onWrite_, onSeek_, userData_, NULL))
+	      throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for writing").c_str()));
+	  } else if (totalPCMFrameCount == 0) {
 	    if (!drwav_init_file_write(&wav, filename.c_str(), &df, NULL))
 	      throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for writing").c_str()));
 	  } else {
@@ -248,7 +669,9 @@ namespace dr_wav {
 	break;
       case Format::EXTENSIBLE:
 	{
-	  if (totalPCMFrameCount == 0) {
+	  if (onWrite_) {
+	    fp = nullptr;
+	  } else if (totalPCMFrameCount == 0) {
 	    fp = fopen(filename.c_str(), "wb");
 	    if (!fp) throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for writing").c_str()));
 	  } else {
@@ -262,7 +685,10 @@ namespace dr_wav {
 	  memcpy(&extraData[2], &fmt.channelMask, sizeof(uint32_t));
 	  memcpy(&extraData[6], fmt.subFormat, 16);
 
-	  if (totalPCMFrameCount == 0) {
+	  if (onWrite_) {
+	    if (!drwav_init_write_with_extraData(&wav, &df, onWrite_, onSeek_, userData_, nullptr, (const void *)&extraData))
+	      throw(::std::runtime_error("WavFile::WavFile Could not init drwav for writing"));
+	  } else if (totalPCMFrameCount == 0) {
 	    if (!drwav_init_write_with_extraData(&wav, &df, on_write, on_seek, fp, nullptr, (const void *)&extraData))
 	      throw(::std::runtime_error("WavFile::WavFile Could not init drwav for writing"));
 	  } else {
@@ -274,6 +700,8 @@ namespace dr_wav {
       default:
 	throw(::std::runtime_error("WavFile::WavFile Unsupported format tag"));
       }
+
+      if (stream) stream->release(wav);
     }
 
     WavFile() {
@@ -285,6 +713,39 @@ namespace dr_wav {
 	throw(::std::runtime_error("WavFile::WavFile Could not open STDIN for reading"));
     }
 
+    /**
+     * Reads headerless raw PCM of format fmt from filename, or from
+     * STDIN if filename is empty. The number of frames is known only
+     * if filename is a regular file, and is 0 otherwise.
+     */
+    WavFile(const drwav_fmt &fmt, const ::std::string &filename) {
+      memset(&wav, 0, sizeof(wav));
+      if constexpr (::std::endian::native != ::std::endian::little)
+	throw(::std::runtime_error("WavFile::WavFile Raw PCM is supported only on little-endian hosts"));
+
+      setRawFormat(fmt);
+      unpacker = ::std::make_unique<PCMUnpacker>(PCMPacker(wav.fmt).getEncoding());
+      decodable = true;
+
+      if (filename == "") {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	rawIn = stdin;
+	return;
+      }
+
+      fp = fopen(filename.c_str(), "rb");
+      if (!fp) throw(::std::runtime_error(("WavFile::WavFile Could not open " + filename + " for reading").c_str()));
+      rawIn = fp;
+
+      ::std::error_code ec;
+      if (::std::filesystem::is_regular_file(filename, ec)) {
+	const uintmax_t size = ::std::filesystem::file_size(filename, ec);
+	if (!ec) wav.totalPCMFrameCount = size / wav.fmt.blockAlign;
+      }
+    }
+
     WavFile(const DataFormat &format, uint64_t totalPCMFrameCount) {
 #ifdef _WIN32
       _setmode(_fileno(stdout), _O_BINARY);
@@ -303,6 +764,7 @@ namespace dr_wav {
 
     ~WavFile() {
       drwav_uninit(&wav);
+      if (rawUserData == stdout) fflush(stdout);
       if (fp) {
 	fclose(fp);
 	fp = nullptr;
@@ -320,7 +782,7 @@ namespace dr_wav {
     drwav getWav() const { return wav; }
 
     drwav_fmt getFmt() const { return wav.fmt; }
-    drwav_container getContainer() const { return wav.container; }
+    Container getContainer() const { return Container(wav.container, raw); }
 
     uint32_t getSampleRate() const { return wav.fmt.sampleRate; }
     uint16_t getNBitsPerSample() const { return wav.fmt.bitsPerSample; }
@@ -328,178 +790,117 @@ namespace dr_wav {
     bool isFloat() const { return wav.fmt.formatTag == Format::IEEE_FLOAT; }
 
     uint64_t getNFrames() {
+      if (raw) return wav.totalPCMFrameCount;
       drwav_uint64 c = 0;
       checkResult(drwav_get_length_in_pcm_frames(&wav, &c), "WavFile::getNFrames");
       return c;
     }
 
     size_t getPosition() {
+      if (raw) return rawPos;
       drwav_uint64 c = 0;
       checkResult(drwav_get_cursor_in_pcm_frames(&wav, &c), "WavFile::getPosition");
       return c;
     }
 
-    bool atEnd() { return getNFrames() == getPosition(); }
+    bool atEnd() {
+      if (raw) return rawEof || (wav.totalPCMFrameCount != 0 && rawPos >= wav.totalPCMFrameCount);
+      return getNFrames() == getPosition();
+    }
 
     bool seek(size_t position) {
+      if (raw) return position == rawPos;
       return  drwav_seek_to_pcm_frame(&wav, position);
     }
 
     size_t readPCM(float *ptr, size_t nFrame) {
+      if (raw) return readUnpacked(ptr, nFrame);
       return drwav_read_pcm_frames_f32(&wav, nFrame, ptr);
     }
 
-    ::std::vector<float> buff32;
-    ::std::vector<double> buff64;
-    ::std::vector<int32_t> bufi32;
-    ::std::vector<Sample24> bufi24;
-    ::std::vector<Sample16> bufi16;
-    ::std::vector<Sample8> bufi8;
-
-    size_t readPCM(double *ptr, size_t nFrame) {
-      if (wav.fmt.formatTag == Format::IEEE_FLOAT && wav.fmt.bitsPerSample == 64)
-	return drwav_read_pcm_frames(&wav, nFrame, ptr);
-
-      buff32.resize(::std::max(buff32.size(), nFrame * getNChannels()));
-      size_t ret = drwav_read_pcm_frames_f32(&wav, nFrame, buff32.data());
-      for(size_t i=0;i<nFrame * getNChannels();i++) ptr[i] = buff32[i];
-      return ret;
-    }
-
-    size_t writePCM(float *ptr, size_t nFrame) {
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 32)
-	return drwav_write_pcm_frames(&wav, nFrame, ptr);
-
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 64) {
-	buff64.resize(::std::max(buff64.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) buff64[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * sizeof(double), buff64.data());
-      }
-
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 32) {
-	bufi32.resize(::std::max(bufi32.size(), nFrame * getNChannels()));
-	drwav_f32_to_s32(bufi32.data(), ptr, nFrame * getNChannels());
-	return drwav_write_pcm_frames(&wav, nFrame, bufi32.data());
-      }
-
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 24) {
-	bufi24.resize(::std::max(bufi24.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi24[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 3, bufi24.data());
-      }
-      
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 16) {
-	bufi16.resize(::std::max(bufi16.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi16[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 2, bufi16.data());
+    ::std::unique_ptr<PCMUnpacker> unpacker;
+    bool decodable = false;
+    ::std::vector<uint8_t> rbuf;
+
+    /**
+     * The decoder of the frames given by readFrames(). Those are the
+     * raw frames if PCMUnpacker can decode them, and otherwise the
+     * frames converted to float by dr_wav.
+     */
+    const PCMUnpacker &getUnpacker() {
+      if (!unpacker) {
+	decodable = PCMUnpacker::isDecodable(wav);
+	unpacker = ::std::make_unique<PCMUnpacker>(decodable ? PCMUnpacker::encodingOf(wav) : PCMPacker::F32);
       }
+      return *unpacker;
+    }
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 8) {
-	bufi8.resize(::std::max(bufi8.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi8[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 1, bufi8.data());
+    size_t getFrameSize() { return getUnpacker().getSampleSize() * getNChannels(); }
+
+    /** Reads up to nFrame frames of getFrameSize() bytes each */
+    size_t readFrames(void *ptr, size_t nFrame) {
+      getUnpacker();
+      if (raw) {
+	// A partial frame at the end is dropped
+	const size_t fs = getFrameSize(), z = rawEof ? 0 : fread(ptr, 1, nFrame * fs, rawIn);
+	if (z < nFrame * fs) rawEof = true;
+	rawPos += z / fs;
+	return z / fs;
       }
-
-      ::std::string s = "WavFile::writePCM(f32) Unsupported format, formatTag = ";
-      s += ::std::to_string(wav.fmt.formatTag) + ", bitsPerSample = " + ::std::to_string(wav.fmt.bitsPerSample);
-      throw(::std::runtime_error(s.c_str()));
+      return decodable ? drwav_read_pcm_frames(&wav, nFrame, ptr) : drwav_read_pcm_frames_f32(&wav, nFrame, (float *)ptr);
     }
 
-    size_t writePCM(double *ptr, size_t nFrame) {
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 64)
-	return drwav_write_raw(&wav, nFrame * getNChannels() * sizeof(double), ptr);
-      
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 32) {
-	buff32.resize(::std::max(buff32.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) buff32[i] = ptr[i];
-	return drwav_write_pcm_frames(&wav, nFrame, buff32.data());
-      }
+    template<typename T>
+    size_t readUnpacked(T *ptr, size_t nFrame) {
+      const PCMUnpacker &u = getUnpacker();
+      rbuf.resize(::std::max(rbuf.size(), nFrame * getFrameSize()));
+      size_t ret = readFrames(rbuf.data(), nFrame);
+      u.unpack(ptr, rbuf.data(), u.getSampleSize(), ret * getNChannels());
+      return ret;
+    }
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 32) {
-	bufi32.resize(::std::max(bufi32.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi32[i] = ptr[i] * (1LL << 31);
-	return drwav_write_pcm_frames(&wav, nFrame, bufi32.data());
-      }
+    size_t readPCM(double *ptr, size_t nFrame) {
+      if (!raw && wav.fmt.formatTag == Format::IEEE_FLOAT && wav.fmt.bitsPerSample == 64)
+	return drwav_read_pcm_frames(&wav, nFrame, ptr);
+      return readUnpacked(ptr, nFrame);
+    }
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 24) {
-	bufi24.resize(::std::max(bufi24.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi24[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 3, bufi24.data());
-      }
-      
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 16) {
-	bufi16.resize(::std::max(bufi16.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi16[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 2, bufi16.data());
-      }
+    ::std::unique_ptr<PCMPacker> packer;
+    ::std::vector<uint8_t> pbuf;
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 8) {
-	bufi8.resize(::std::max(bufi8.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi8[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 1, bufi8.data());
-      }
+    const PCMPacker &getPacker() {
+      if (!packer) packer = ::std::make_unique<PCMPacker>(wav.fmt);
+      return *packer;
+    }
 
-      ::std::string s = "WavFile::writePCM(f32) Unsupported format, formatTag = ";
-      s += ::std::to_string(wav.fmt.formatTag) + ", bitsPerSample = " + ::std::to_string(wav.fmt.bitsPerSample);
-      throw(::std::runtime_error(s.c_str()));
+    /** Writes the bytes of whole frames as they are */
+    size_t writeRaw(const void *ptr, size_t nBytes) {
+      if (raw) return rawWrite(rawUserData, ptr, nBytes) / wav.fmt.blockAlign;
+      return drwav_write_raw(&wav, nBytes, ptr) / wav.fmt.blockAlign;
     }
 
-    size_t writePCM(int32_t *ptr, size_t nFrame) {
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 32) {
-	return drwav_write_pcm_frames(&wav, nFrame, ptr);
-      }
-      
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 32) {
-	buff32.resize(::std::max(buff32.size(), nFrame * getNChannels()));
-	drwav_s32_to_f32(buff32.data(), ptr, nFrame * getNChannels());
-	return drwav_write_pcm_frames(&wav, nFrame, buff32.data());
-      }
+    /** Writes nFrame interleaved frames */
+    template<typename T>
+    size_t writePCM(const T *ptr, size_t nFrame) {
+      const PCMPacker &p = getPacker();
+      const size_t n = nFrame * getNChannels(), ss = p.getSampleSize();
 
-      if ((wav.fmt.formatTag == Format::IEEE_FLOAT || wav.fmt.subFormat[0] == 0x03) &&
-	  wav.fmt.bitsPerSample == 64) {
-	buff64.resize(::std::max(buff64.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) buff64[i] = ptr[i] * (1.0 / (1 << 31));
-	return drwav_write_raw(&wav, nFrame * getNChannels() * sizeof(double), buff64.data());
-      }
-      
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 24) {
-	bufi24.resize(::std::max(bufi24.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi24[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 3, bufi24.data());
-      }
+      if (p.isVerbatim<T>()) return writeRaw(ptr, n * ss);
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 16) {
-	bufi16.resize(::std::max(bufi16.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi16[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 2, bufi16.data());
-      }
+      pbuf.resize(::std::max(pbuf.size(), n * ss));
+      p.pack(pbuf.data(), ss, ptr, n);
+      return writeRaw(pbuf.data(), n * ss);
+    }
 
-      if ((wav.fmt.formatTag == Format::PCM || wav.fmt.subFormat[0] == 0x01) &&
-	  wav.fmt.bitsPerSample == 8) {
-	bufi8.resize(::std::max(bufi8.size(), nFrame * getNChannels()));
-	for(size_t i=0;i<nFrame * getNChannels();i++) bufi8[i] = ptr[i];
-	return drwav_write_raw(&wav, nFrame * getNChannels() * 1, bufi8.data());
-      }
+    /** Writes nFrame frames, interleaving them from a buffer per channel */
+    template<typename T>
+    size_t writePCM(const T *const *channels, size_t nFrame) {
+      const PCMPacker &p = getPacker();
+      const size_t nch = getNChannels(), ss = p.getSampleSize();
 
-      ::std::string s = "WavFile::writePCM(s32) Unsupported format, formatTag = ";
-      s += ::std::to_string(wav.fmt.formatTag) + ", bitsPerSample = " + ::std::to_string(wav.fmt.bitsPerSample);
-      throw(::std::runtime_error(s.c_str()));
+      pbuf.resize(::std::max(pbuf.size(), nFrame * nch * ss));
+      for(size_t c=0;c<nch;c++) p.pack(pbuf.data() + c * ss, nch * ss, channels[c], nFrame);
+      return writeRaw(pbuf.data(), nFrame * nch * ss);
     }
   };
 }
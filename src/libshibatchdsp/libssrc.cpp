@@ -1,14 +1,37 @@
 #include <vector>
 #include <cstring>
-#include <unordered_set>
+#include <algorithm>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
 #include "SRC.hpp"
+#include "SegmentedSRC.hpp"
+#include "RangeSRC.hpp"
+#include "PushSRC.hpp"
 #include "WavReader.hpp"
 #include "WavWriter.hpp"
 #include "Dither.hpp"
 #include "ChannelMixer.hpp"
+#include "AsyncOutlet.hpp"
 #include "BGExecutor.hpp"
+#include "WSDeque.hpp"
 #include "ObjectCache.hpp"
+#include "ThreadPolicy.hpp"
 
 #ifndef SSRC_VERSION
 #error SSRC_VERSION not defined
@@ -27,6 +50,120 @@ using namespace shibatch;
 namespace ssrc {
   string versionString() { return SSRC_VERSION; }
   string buildInfo() { return BUILDINFO; }
+
+  bool ThreadPolicy::apply(unsigned index) const {
+    bool ok = true;
+
+#if defined(__linux__)
+    vector<unsigned> v;
+    if (!cpus.empty()) {
+      v.push_back(cpus[index % cpus.size()]);
+    } else if (numaNode >= 0) {
+      v = getNumaNodeCPUs(numaNode);
+      if (v.empty()) ok = false;
+    }
+
+    if (!v.empty()) {
+      cpu_set_t cs;
+      CPU_ZERO(&cs);
+      for(unsigned c : v) if (c < CPU_SETSIZE) CPU_SET(c, &cs);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs) != 0) ok = false;
+    }
+#else
+    if (!cpus.empty() || numaNode >= 0) ok = false;
+#endif
+
+    if (rtPriority != 0) {
+#if !defined(_WIN32)
+      sched_param sp;
+      sp.sched_priority = rtPriority;
+      if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0) ok = false;
+#else
+      ok = false;
+#endif
+    }
+
+    if (flushDenormals) {
+#if defined(__SSE__) || defined(_M_X64)
+      _mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+#elif defined(__aarch64__)
+      uint64_t fpcr;
+      __asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+      __asm__ __volatile__("msr fpcr, %0" : : "r" (fpcr | (1ULL << 24))); // FZ
+#else
+      ok = false;
+#endif
+    }
+
+    return ok;
+  }
+
+  vector<unsigned> ThreadPolicy::parseCPUList(const string &list) {
+    vector<unsigned> ret;
+    stringstream ss(list);
+    string item;
+
+    while(getline(ss, item, ',')) {
+      item.erase(0, item.find_first_not_of(" \t\n"));
+      item.erase(item.find_last_not_of(" \t\n") + 1);
+      if (item.empty()) continue;
+
+      unsigned first, last;
+      char c;
+      if (sscanf(item.c_str(), "%u-%u%c", &first, &last, &c) == 2 && first <= last) {
+	for(unsigned i=first;i<=last;i++) ret.push_back(i);
+      } else if (sscanf(item.c_str(), "%u%c", &first, &c) == 1) {
+	ret.push_back(first);
+      } else {
+	throw(runtime_error(("ThreadPolicy::parseCPUList invalid item \"" + item + "\"").c_str()));
+      }
+    }
+
+    return ret;
+  }
+
+  vector<unsigned> ThreadPolicy::getNumaNodeCPUs(unsigned node) {
+    ifstream f("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    string line;
+    if (!f || !getline(f, line)) return vector<unsigned>();
+    return parseCPUList(line);
+  }
+
+  namespace {
+    struct ThreadPolicyHolder {
+      mutex mtx;
+      ThreadPolicy policy;
+      atomic<unsigned> nThreads = 0;
+    };
+
+    ThreadPolicyHolder &threadPolicyHolder() {
+      static ThreadPolicyHolder holder;
+      return holder;
+    }
+  }
+
+  void setThreadPolicy(const ThreadPolicy &policy) {
+    ThreadPolicyHolder &h = threadPolicyHolder();
+    unique_lock lock(h.mtx);
+    h.policy = policy;
+    h.nThreads = 0;
+  }
+
+  ThreadPolicy getThreadPolicy() {
+    ThreadPolicyHolder &h = threadPolicyHolder();
+    unique_lock lock(h.mtx);
+    return h.policy;
+  }
+
+  bool applyThreadPolicy() {
+    ThreadPolicyHolder &h = threadPolicyHolder();
+    ThreadPolicy p = getThreadPolicy();
+    return p.apply(h.nThreads++);
+  }
+}
+
+namespace shibatch {
+  void applyThreadPolicy() { ssrc::applyThreadPolicy(); }
 }
 
 namespace shibatch {
@@ -42,129 +179,353 @@ namespace shibatch {
     void postProcess(void *p) { g(ptrg, p); }
   };
 
-  class BGExecutorStatic {
-    int nIdleWorkers = 0;
-    vector<shared_ptr<thread>> vth;
-    unordered_set<thread::id> thIds;
-    queue<shared_ptr<Runnable>> que;
-    mutex mtx;
-    condition_variable condVar;
-
-    shared_ptr<Runnable> pop() {
-      auto ret = std::move(que.front());
-      que.pop();
-      return ret;
+  class WorkStealingPool : public Executor::ExecutorImpl {
+    static const unsigned NPRIORITIES = 3;
+
+    struct Worker {
+      WorkStealingPool *pool;
+      WSDeque<shared_ptr<Runnable> *> deque[NPRIORITIES];
+      condition_variable condVar;
+      bool idle = false, woken = false;
+      shared_ptr<thread> th;
+
+      Worker(WorkStealingPool *pool_) : pool(pool_) {}
+    };
+
+    static thread_local Worker *currentWorker;
+
+    const unsigned maxWorkers;
+    unique_ptr<unique_ptr<Worker>[]> workers;
+    atomic<unsigned> nWorkers = 0;
+    mutex spawnMtx;
+
+    // Jobs pushed from threads outside the pool
+    deque<shared_ptr<Runnable>> injected[NPRIORITIES];
+    atomic<size_t> nInjected = 0;
+    mutex injectMtx;
+
+    // Idle workers are woken one at a time rather than all at once
+    vector<Worker *> idle;
+    atomic<unsigned> nIdle = 0;
+    mutex sleepMtx;
+    bool shuttingDown = false;
+
+    /** Returns the worker of this pool running on the calling thread, if any */
+    Worker *self() { return currentWorker && currentWorker->pool == this ? currentWorker : nullptr; }
+
+    shared_ptr<Runnable> findWork(Worker *self) {
+      static thread_local unsigned seed = 0;
+      const unsigned n = nWorkers.load(memory_order_acquire);
+      const unsigned start = n == 0 ? 0 : (seed++ % n);
+
+      for(unsigned p=0;p<NPRIORITIES;p++) {
+	shared_ptr<Runnable> *box = nullptr;
+
+	if (self) box = self->deque[p].take();
+
+	if (!box && nInjected.load(memory_order_relaxed) != 0) {
+	  unique_lock lock(injectMtx);
+	  if (!injected[p].empty()) {
+	    auto r = std::move(injected[p].front());
+	    injected[p].pop_front();
+	    nInjected--;
+	    return r;
+	  }
+	}
+
+	for(unsigned i=0;i<n && !box;i++) {
+	  Worker *victim = workers[(start + i) % n].get();
+	  if (victim != self) box = victim->deque[p].steal();
+	}
+
+	if (box) {
+	  shared_ptr<Runnable> r = std::move(*box);
+	  delete box;
+	  return r;
+	}
+      }
+
+      return nullptr;
     }
 
-    void thEntry() {
+    bool hasWork() {
+      if (nInjected.load(memory_order_relaxed) != 0) return true;
+      const unsigned n = nWorkers.load(memory_order_acquire);
+      for(unsigned i=0;i<n;i++)
+	for(unsigned p=0;p<NPRIORITIES;p++)
+	  if (!workers[i]->deque[p].empty()) return true;
+      return false;
+    }
+
+    void execute(shared_ptr<Runnable> r) {
+      r->run();
+      if (r->belongsTo) r->belongsTo->complete(r);
+    }
+
+    void unregisterIdle(Worker *w) {
+      if (!w->idle) return;
+      idle.erase(find(idle.begin(), idle.end(), w));
+      w->idle = false;
+      nIdle--;
+    }
+
+    /** Sleeps until a job is pushed or, if e is given, a job of e finishes */
+    bool park(Worker *self, BGExecutor *e) {
       {
-	unique_lock lock(mtx);
-	thIds.insert(this_thread::get_id());
+	unique_lock lock(sleepMtx);
+	if (shuttingDown) return false;
+	idle.push_back(self);
+	self->idle = true;
+	self->woken = false;
+	nIdle++;
       }
 
-      shared_ptr<Runnable> r = nullptr;
+      if (e) e->waiter.store(self);
+      atomic_thread_fence(memory_order_seq_cst);
 
-      for(;;) {
-	if (r) r->run();
+      bool ready = hasWork() || (e && e->completed.load() != nullptr);
 
-	unique_lock lock(mtx);
+      unique_lock lock(sleepMtx);
+      if (!ready) while(!self->woken && !shuttingDown) self->condVar.wait(lock);
+      unregisterIdle(self);
+      if (e) e->waiter.store(nullptr);
 
-	if (r) {
-	  r->belongsTo->que.push(r);
-	  condVar.notify_all();
-	}
+      return !shuttingDown;
+    }
 
-	nIdleWorkers++;
-	while(que.empty()) condVar.wait(lock);
-	nIdleWorkers--;
-	r = pop();
-	if (!r) break;
-      }
+    void wake(Worker *w) {
+      unique_lock lock(sleepMtx);
+      unregisterIdle(w);
+      w->woken = true;
+      w->condVar.notify_one();
+    }
+
+    void wakeOne() {
+      unique_lock lock(sleepMtx);
+      if (idle.empty()) return;
+      Worker *w = idle.back();
+      unregisterIdle(w);
+      w->woken = true;
+      w->condVar.notify_one();
     }
 
     void addWorkerIfNecessary() {
-      if (nIdleWorkers == 0 && vth.size() < thread::hardware_concurrency())
-	vth.push_back(make_shared<thread>(&BGExecutorStatic::thEntry, this));
+      if (nWorkers.load(memory_order_acquire) >= maxWorkers) return;
+      unique_lock lock(spawnMtx);
+      const unsigned n = nWorkers.load(memory_order_relaxed);
+      if (n >= maxWorkers) return;
+      workers[n] = make_unique<Worker>(this);
+      Worker *w = workers[n].get();
+      nWorkers.store(n + 1, memory_order_release);
+      w->th = make_shared<thread>(&WorkStealingPool::thEntry, this, w);
+    }
+
+    void thEntry(Worker *self) {
+      currentWorker = self;
+      applyThreadPolicy();
+
+      for(;;) {
+	bool ran = false;
+	{
+	  shared_ptr<Runnable> r = findWork(self);
+	  if (r) {
+	    execute(std::move(r));
+	    ran = true;
+	  }
+	}
+
+	// The job dropped the last reference to the pool, which is gone
+	if (currentWorker != self) return;
+
+	if (!ran && !park(self, nullptr)) break;
+      }
     }
 
   public:
-    ~BGExecutorStatic() {
+    WorkStealingPool(unsigned nThreads) : maxWorkers(nThreads != 0 ? nThreads : max(thread::hardware_concurrency(), 1U)),
+					  workers(new unique_ptr<Worker>[maxWorkers]) {}
+
+    ~WorkStealingPool() {
       {
-	unique_lock lock(mtx);
-	for(unsigned i=0;i < vth.size();i++) que.push(nullptr);
-	condVar.notify_all();
+	unique_lock lock(sleepMtx);
+	shuttingDown = true;
+	const unsigned n = nWorkers.load();
+	for(unsigned i=0;i<n;i++) workers[i]->condVar.notify_one();
       }
-      for(auto t : vth) t->join();
+      // A job run by a worker of this pool may drop the last reference
+      // to it. That worker cannot join itself, so it is detached, and
+      // returns from thEntry() without touching the pool.
+      Worker *w = self();
+      if (w) currentWorker = nullptr;
+
+      const unsigned n = nWorkers.load();
+      for(unsigned i=0;i<n;i++) {
+	if (workers[i].get() == w) workers[i]->th->detach(); else workers[i]->th->join();
+      }
+
+      // Jobs that were never run are dropped
+      for(unsigned i=0;i<n;i++)
+	for(unsigned p=0;p<NPRIORITIES;p++)
+	  while(shared_ptr<Runnable> *box = workers[i]->deque[p].take()) delete box;
     }
 
-    friend class shibatch::BGExecutor;
+    unsigned getNThreads() const { return maxWorkers; }
+
+    void submit(shared_ptr<Runnable> job, unsigned priority) {
+      if (Worker *w = self()) {
+	w->deque[priority].push(new shared_ptr<Runnable>(std::move(job)));
+      } else {
+	unique_lock lock(injectMtx);
+	injected[priority].push_back(std::move(job));
+	nInjected++;
+      }
+
+      atomic_thread_fence(memory_order_seq_cst);
+
+      if (nIdle.load() == 0) {
+	addWorkerIfNecessary();
+      } else {
+	wakeOne();
+      }
+    }
+
+    void notifyCompletion(BGExecutor *e) {
+      atomic_thread_fence(memory_order_seq_cst);
+      Worker *w = (Worker *)e->waiter.load();
+      if (w) wake(w);
+    }
+
+    void wait(BGExecutor *e) {
+      Worker *w = self();
+
+      if (!w) {
+	for(;;) {
+	  uint32_t s = e->nCompleted.load(memory_order_acquire);
+	  if (e->drain()) return;
+	  e->nCompleted.wait(s, memory_order_acquire);
+	}
+      }
+
+      // A worker waiting for its own jobs runs other jobs in the meantime
+      for(;;) {
+	if (e->drain()) return;
+	shared_ptr<Runnable> r = findWork(w);
+	if (r) {
+	  execute(r);
+	  continue;
+	}
+	park(w, e);
+      }
+    }
   };
 
-  BGExecutorStatic bgExecutorStatic;
+  thread_local WorkStealingPool::Worker *WorkStealingPool::currentWorker = nullptr;
 
   shared_ptr<Runnable> Runnable::factory(function<void(void *)> f, void *p,
 					 function<void(void *, void *)> g, void *q) {
     return make_shared<LambdaRunner>(f, p, g, q);
   }
 
+  BGExecutor::BGExecutor(shared_ptr<Executor> executor_) :
+    executor(executor_ ? executor_ : Executor::getDefault()),
+    pool(dynamic_cast<WorkStealingPool *>(executor->impl.get())) {}
+
+  BGExecutor::~BGExecutor() {
+    // A worker may still be returning from complete()
+    while(nCompleting.load(memory_order_acquire) != 0) this_thread::yield();
+
+    for(Completion *c = completed.exchange(nullptr);c;) {
+      Completion *next = c->next;
+      delete c;
+      c = next;
+    }
+  }
+
+  void BGExecutor::complete(shared_ptr<Runnable> job) {
+    nCompleting.fetch_add(1, memory_order_relaxed);
+    Completion *c = new Completion { std::move(job), completed.load(memory_order_relaxed) };
+    while(!completed.compare_exchange_weak(c->next, c, memory_order_release, memory_order_relaxed)) ;
+    nCompleted.fetch_add(1, memory_order_release);
+    nCompleted.notify_one();
+    pool->notifyCompletion(this);
+    nCompleting.fetch_sub(1, memory_order_release);
+  }
+
+  bool BGExecutor::drain() {
+    if (!que.empty()) return true;
+
+    Completion *c = completed.exchange(nullptr, memory_order_acquire);
+    if (!c) return false;
+
+    // The list is in reverse order of completion
+    vector<Completion *> v;
+    for(;c;c = c->next) v.push_back(c);
+    for(auto it = v.rbegin();it != v.rend();++it) {
+      que.push(std::move((*it)->job));
+      delete *it;
+    }
+
+    return true;
+  }
+
   void BGExecutor::push(shared_ptr<Runnable> job) {
     job->belongsTo = this;
-    unique_lock lock(bgExecutorStatic.mtx);
-    bgExecutorStatic.addWorkerIfNecessary();
-    bgExecutorStatic.que.push(job);
-    bgExecutorStatic.condVar.notify_all();
     size_++;
+    pool->submit(std::move(job), executor->priority);
   }
 
   shared_ptr<Runnable> BGExecutor::pop() {
-    if (bgExecutorStatic.thIds.count(this_thread::get_id()) == 0) {
-      unique_lock lock(bgExecutorStatic.mtx);
+    pool->wait(this);
+    auto r = std::move(que.front());
+    que.pop();
+    size_--;
+    return r;
+  }
 
-      while(que.empty()) bgExecutorStatic.condVar.wait(lock);
+  shared_ptr<Runnable> BGExecutor::tryPop() {
+    if (!drain()) return nullptr;
+    auto r = std::move(que.front());
+    que.pop();
+    size_--;
+    return r;
+  }
 
-      auto r = std::move(que.front());
-      que.pop();
-      size_--;
+  void BGExecutor::post(shared_ptr<Executor> executor, shared_ptr<Runnable> job) {
+    job->belongsTo = nullptr;
+    dynamic_cast<WorkStealingPool *>(executor->impl.get())->submit(std::move(job), executor->priority);
+  }
 
-      return r;
-    }
+  size_t BGExecutor::size() { return size_.load(); }
 
-    for(;;) {
-      shared_ptr<Runnable> r = nullptr;
+  unsigned BGExecutor::getNThreads() { return pool->getNThreads(); }
+}
 
-      {
-	unique_lock lock(bgExecutorStatic.mtx);
+//
 
-	bgExecutorStatic.nIdleWorkers++;
-	while(que.empty() && bgExecutorStatic.que.empty()) bgExecutorStatic.condVar.wait(lock);
-	bgExecutorStatic.nIdleWorkers--;
+Executor::Executor(unsigned nThreads_, Priority priority_) :
+  impl(make_shared<WorkStealingPool>(nThreads_)), priority(priority_) {}
 
-	if (!que.empty()) {
-	  auto ret = std::move(que.front());
-	  que.pop();
-	  size_--;
-	  return ret;
-	}
+Executor::Executor(const Executor &pool_, Priority priority_) : impl(pool_.impl), priority(priority_) {}
 
-	r = bgExecutorStatic.pop();
-      }
+Executor::~Executor() {}
 
-      r->run();
-    }
-  }
+unsigned Executor::getNThreads() { return dynamic_pointer_cast<WorkStealingPool>(impl)->getNThreads(); }
 
-  size_t BGExecutor::size() {
-    unique_lock lock(bgExecutorStatic.mtx);
-    return size_;
-  }
+Executor::Priority Executor::getPriority() { return priority; }
+
+shared_ptr<Executor> Executor::getDefault() {
+  static shared_ptr<Executor> defaultExecutor = make_shared<Executor>();
+  return defaultExecutor;
 }
 
 //
 
 template<typename REAL> SSRC<REAL>::SSRC(shared_ptr<StageOutlet<REAL>> inlet_, int64_t sfs_, int64_t dfs_,
 					 unsigned l2dftflen_, double aa_, double guard_, double gain_,
-					 bool minPhase_, unsigned l2mindftflen_, bool mt_) :
-  impl(make_shared<SSRCStage<REAL>>(inlet_, sfs_, dfs_, l2dftflen_, aa_, guard_, gain_, minPhase_, l2mindftflen_, mt_)) {}
+					 bool minPhase_, unsigned l2mindftflen_, bool mt_, shared_ptr<Executor> executor_,
+					 unsigned pipelineDepth_) :
+  impl(make_shared<SSRCStage<REAL>>(inlet_, sfs_, dfs_, l2dftflen_, aa_, guard_, gain_, minPhase_, l2mindftflen_, mt_, executor_,
+				    pipelineDepth_)) {}
 
 template<typename REAL> SSRC<REAL>::~SSRC() {}
 
@@ -180,27 +541,178 @@ template<typename REAL> double SSRC<REAL>::getDelay() {
   return dynamic_pointer_cast<SSRCStage<REAL>>(impl)->getDelay();
 }
 
+template<typename REAL> size_t SSRC<REAL>::getMemoryUsage() {
+  return dynamic_pointer_cast<SSRCStage<REAL>>(impl)->getMemoryUsage();
+}
+
 //
 
-template SSRC<float>::SSRC(shared_ptr<StageOutlet<float>>, int64_t, int64_t, unsigned, double, double, double, bool, unsigned, bool);
+template SSRC<float>::SSRC(shared_ptr<StageOutlet<float>>, int64_t, int64_t, unsigned, double, double, double, bool, unsigned, bool,
+			   shared_ptr<Executor>, unsigned);
 template SSRC<float>::~SSRC();
 template size_t SSRC<float>::read(float *ptr, size_t n);
 template bool SSRC<float>::atEnd();
 template double SSRC<float>::getDelay();
+template size_t SSRC<float>::getMemoryUsage();
 
-template SSRC<double>::SSRC(shared_ptr<StageOutlet<double>>, int64_t, int64_t, unsigned, double, double, double, bool, unsigned, bool);
+template SSRC<double>::SSRC(shared_ptr<StageOutlet<double>>, int64_t, int64_t, unsigned, double, double, double, bool, unsigned, bool,
+			   shared_ptr<Executor>, unsigned);
 template SSRC<double>::~SSRC();
 template size_t SSRC<double>::read(double *ptr, size_t n);
 template bool SSRC<double>::atEnd();
 template double SSRC<double>::getDelay();
+template size_t SSRC<double>::getMemoryUsage();
+
+//
+
+template<typename REAL> PushSSRC<REAL>::PushSSRC(int64_t sfs_, int64_t dfs_, unsigned l2dftflen_, double aa_, double guard_, double gain_,
+						 bool minPhase_, unsigned l2mindftflen_) :
+  impl(make_shared<PushSSRCStage<REAL>>(sfs_, dfs_, l2dftflen_, aa_, guard_, gain_, minPhase_, l2mindftflen_)) {}
+
+template<typename REAL> PushSSRC<REAL>::~PushSSRC() {}
+
+template<typename REAL> size_t PushSSRC<REAL>::process(const REAL *in, size_t nIn, REAL *out, size_t outCap) {
+  return dynamic_pointer_cast<PushSSRCStage<REAL>>(impl)->process(in, nIn, out, outCap);
+}
+
+template<typename REAL> size_t PushSSRC<REAL>::flush(REAL *out, size_t outCap) {
+  return dynamic_pointer_cast<PushSSRCStage<REAL>>(impl)->flush(out, outCap);
+}
+
+template<typename REAL> bool PushSSRC<REAL>::atEnd() {
+  return dynamic_pointer_cast<PushSSRCStage<REAL>>(impl)->atEnd();
+}
+
+template<typename REAL> double PushSSRC<REAL>::getDelay() {
+  return dynamic_pointer_cast<PushSSRCStage<REAL>>(impl)->getDelay();
+}
+
+//
+
+template PushSSRC<float>::PushSSRC(int64_t, int64_t, unsigned, double, double, double, bool, unsigned);
+template PushSSRC<float>::~PushSSRC();
+template size_t PushSSRC<float>::process(const float *in, size_t nIn, float *out, size_t outCap);
+template size_t PushSSRC<float>::flush(float *out, size_t outCap);
+template bool PushSSRC<float>::atEnd();
+template double PushSSRC<float>::getDelay();
+
+template PushSSRC<double>::PushSSRC(int64_t, int64_t, unsigned, double, double, double, bool, unsigned);
+template PushSSRC<double>::~PushSSRC();
+template size_t PushSSRC<double>::process(const double *in, size_t nIn, double *out, size_t outCap);
+template size_t PushSSRC<double>::flush(double *out, size_t outCap);
+template bool PushSSRC<double>::atEnd();
+template double PushSSRC<double>::getDelay();
+
+//
+
+template<typename REAL> SegmentedSSRC<REAL>::SegmentedSSRC(function<shared_ptr<OutletProvider<REAL>>(uint64_t)> openAt_,
+							   uint64_t nFrames_, int64_t sfs_, int64_t dfs_, unsigned nSegments_,
+							   unsigned l2dftflen_, double aa_, double guard_, double gain_,
+							   bool minPhase_, unsigned l2mindftflen_, bool mt_,
+							   shared_ptr<Executor> executor_) :
+  impl(make_shared<SegmentedSSRCStage<REAL>>(openAt_, nFrames_, sfs_, dfs_, nSegments_, l2dftflen_, aa_, guard_, gain_,
+					     minPhase_, l2mindftflen_, mt_, executor_)) {}
+
+template<typename REAL> SegmentedSSRC<REAL>::~SegmentedSSRC() {}
+
+template<typename REAL> shared_ptr<StageOutlet<REAL>> SegmentedSSRC<REAL>::getOutlet(uint32_t channel) {
+  return dynamic_pointer_cast<SegmentedSSRCStage<REAL>>(impl)->getOutlet(channel);
+}
+
+template<typename REAL> WavFormat SegmentedSSRC<REAL>::getFormat() {
+  return dynamic_pointer_cast<SegmentedSSRCStage<REAL>>(impl)->getFormat();
+}
+
+template<typename REAL> double SegmentedSSRC<REAL>::getDelay() {
+  return dynamic_pointer_cast<SegmentedSSRCStage<REAL>>(impl)->getDelay();
+}
+
+template<typename REAL> size_t SegmentedSSRC<REAL>::getMemoryUsage() {
+  return dynamic_pointer_cast<SegmentedSSRCStage<REAL>>(impl)->getMemoryUsage();
+}
+
+//
+
+template SegmentedSSRC<float>::SegmentedSSRC(function<shared_ptr<OutletProvider<float>>(uint64_t)>, uint64_t, int64_t, int64_t,
+					     unsigned, unsigned, double, double, double, bool, unsigned, bool, shared_ptr<Executor>);
+template SegmentedSSRC<float>::~SegmentedSSRC();
+template shared_ptr<StageOutlet<float>> SegmentedSSRC<float>::getOutlet(uint32_t);
+template WavFormat SegmentedSSRC<float>::getFormat();
+template double SegmentedSSRC<float>::getDelay();
+template size_t SegmentedSSRC<float>::getMemoryUsage();
+
+template SegmentedSSRC<double>::SegmentedSSRC(function<shared_ptr<OutletProvider<double>>(uint64_t)>, uint64_t, int64_t, int64_t,
+					      unsigned, unsigned, double, double, double, bool, unsigned, bool, shared_ptr<Executor>);
+template SegmentedSSRC<double>::~SegmentedSSRC();
+template shared_ptr<StageOutlet<double>> SegmentedSSRC<double>::getOutlet(uint32_t);
+template WavFormat SegmentedSSRC<double>::getFormat();
+template double SegmentedSSRC<double>::getDelay();
+template size_t SegmentedSSRC<double>::getMemoryUsage();
+
+//
+
+template<typename REAL> RangeSSRC<REAL>::RangeSSRC(function<shared_ptr<OutletProvider<REAL>>(uint64_t)> openAt_,
+						   int64_t sfs_, int64_t dfs_, uint64_t outStart_, uint64_t outLength_,
+						   unsigned l2dftflen_, double aa_, double guard_, double gain_,
+						   bool minPhase_, unsigned l2mindftflen_, bool mt_,
+						   shared_ptr<Executor> executor_, unsigned pipelineDepth_) :
+  impl(make_shared<RangeSSRCStage<REAL>>(openAt_, sfs_, dfs_, outStart_, outLength_, l2dftflen_, aa_, guard_, gain_,
+					 minPhase_, l2mindftflen_, mt_, executor_, pipelineDepth_)) {}
+
+template<typename REAL> RangeSSRC<REAL>::~RangeSSRC() {}
+
+template<typename REAL> shared_ptr<StageOutlet<REAL>> RangeSSRC<REAL>::getOutlet(uint32_t channel) {
+  return dynamic_pointer_cast<RangeSSRCStage<REAL>>(impl)->getOutlet(channel);
+}
+
+template<typename REAL> WavFormat RangeSSRC<REAL>::getFormat() {
+  return dynamic_pointer_cast<RangeSSRCStage<REAL>>(impl)->getFormat();
+}
+
+template<typename REAL> double RangeSSRC<REAL>::getDelay() {
+  return dynamic_pointer_cast<RangeSSRCStage<REAL>>(impl)->getDelay();
+}
+
+template<typename REAL> size_t RangeSSRC<REAL>::getMemoryUsage() {
+  return dynamic_pointer_cast<RangeSSRCStage<REAL>>(impl)->getMemoryUsage();
+}
+
+//
+
+template RangeSSRC<float>::RangeSSRC(function<shared_ptr<OutletProvider<float>>(uint64_t)>, int64_t, int64_t, uint64_t, uint64_t,
+				    unsigned, double, double, double, bool, unsigned, bool, shared_ptr<Executor>, unsigned);
+template RangeSSRC<float>::~RangeSSRC();
+template shared_ptr<StageOutlet<float>> RangeSSRC<float>::getOutlet(uint32_t);
+template WavFormat RangeSSRC<float>::getFormat();
+template double RangeSSRC<float>::getDelay();
+template size_t RangeSSRC<float>::getMemoryUsage();
+
+template RangeSSRC<double>::RangeSSRC(function<shared_ptr<OutletProvider<double>>(uint64_t)>, int64_t, int64_t, uint64_t, uint64_t,
+				    unsigned, double, double, double, bool, unsigned, bool, shared_ptr<Executor>, unsigned);
+template RangeSSRC<double>::~RangeSSRC();
+template shared_ptr<StageOutlet<double>> RangeSSRC<double>::getOutlet(uint32_t);
+template WavFormat RangeSSRC<double>::getFormat();
+template double RangeSSRC<double>::getDelay();
+template size_t RangeSSRC<double>::getMemoryUsage();
 
 //
 
 template<typename T> WavReader<T>::WavReader(const string &filename, bool mt_) :
   impl(make_shared<WavReaderStage<T>>(filename, mt_)) {}
 
-template<typename T> WavReader<T>::WavReader(bool mt_) :
-  impl(make_shared<WavReaderStage<T>>(mt_)) {}
+template<typename T> WavReader<T>::WavReader(const string &filename, bool mt_, uint64_t startFrame_, shared_ptr<Executor> executor_,
+					     size_t readAheadBytes_) :
+  impl(make_shared<WavReaderStage<T>>(filename, mt_, startFrame_, executor_, readAheadBytes_)) {}
+
+template<typename T> WavReader<T>::WavReader(bool mt_, shared_ptr<Executor> executor_, size_t readAheadBytes_) :
+  impl(make_shared<WavReaderStage<T>>(mt_, executor_, readAheadBytes_)) {}
+
+template<typename T> WavReader<T>::WavReader(const string &filename, const WavFormat &rawFormat_, bool mt_,
+					     shared_ptr<Executor> executor_, size_t readAheadBytes_) {
+  dr_wav::drwav_fmt fmt;
+  memcpy(&fmt, &rawFormat_, sizeof(fmt));
+  impl = make_shared<WavReaderStage<T>>(filename, fmt, mt_, executor_, readAheadBytes_);
+}
 
 template<typename T> WavReader<T>::~WavReader() {}
 
@@ -230,31 +742,53 @@ template<typename T> ContainerFormat WavReader<T>::getContainer() {
   return ContainerFormat((uint16_t)dr_wav::Container(dynamic_pointer_cast<WavReaderStage<T>>(impl)->getContainer()));
 }
 
+template<typename T> uint64_t WavReader<T>::getNFrames() {
+  return dynamic_pointer_cast<WavReaderStage<T>>(impl)->getNFrames();
+}
+
+template<typename T> size_t WavReader<T>::getMemoryUsage() {
+  return dynamic_pointer_cast<WavReaderStage<T>>(impl)->getMemoryUsage();
+}
+
 //
 
 template WavReader<float>::WavReader(const string &filename, bool mt_);
-template WavReader<float>::WavReader(bool mt_);
+template WavReader<float>::WavReader(const string &filename, bool mt_, uint64_t startFrame_, shared_ptr<Executor> executor_,
+				    size_t readAheadBytes_);
+template WavReader<float>::WavReader(bool mt_, shared_ptr<Executor> executor_, size_t readAheadBytes_);
+template WavReader<float>::WavReader(const string &filename, const WavFormat &rawFormat_, bool mt_, shared_ptr<Executor> executor_,
+				    size_t readAheadBytes_);
 template WavReader<float>::~WavReader();
 template shared_ptr<StageOutlet<float>> WavReader<float>::getOutlet(uint32_t);
 template WavFormat WavReader<float>::getFormat();
 template ContainerFormat WavReader<float>::getContainer();
+template uint64_t WavReader<float>::getNFrames();
+template size_t WavReader<float>::getMemoryUsage();
 
 template WavReader<double>::WavReader(const string &filename, bool mt_);
-template WavReader<double>::WavReader(bool mt_);
+template WavReader<double>::WavReader(const string &filename, bool mt_, uint64_t startFrame_, shared_ptr<Executor> executor_,
+				    size_t readAheadBytes_);
+template WavReader<double>::WavReader(bool mt_, shared_ptr<Executor> executor_, size_t readAheadBytes_);
+template WavReader<double>::WavReader(const string &filename, const WavFormat &rawFormat_, bool mt_, shared_ptr<Executor> executor_,
+				    size_t readAheadBytes_);
 template WavReader<double>::~WavReader();
 template shared_ptr<StageOutlet<double>> WavReader<double>::getOutlet(uint32_t);
 template WavFormat WavReader<double>::getFormat();
 template ContainerFormat WavReader<double>::getContainer();
+template uint64_t WavReader<double>::getNFrames();
+template size_t WavReader<double>::getMemoryUsage();
 
 //
 
 template<typename T> WavWriter<T>::WavWriter(const string &filename,
 					     const ssrc::WavFormat& fmt_, const ssrc::ContainerFormat& cont_,
 					     const vector<shared_ptr<StageOutlet<T>>> &in_,
-					     uint64_t nFrames, size_t bufsize_, bool mt_) {
+					     uint64_t nFrames, size_t bufsize_, bool mt_, shared_ptr<Executor> executor_,
+					     unsigned depth_, unsigned ioFlags_, shared_ptr<WriterDither> dither_) {
   dr_wav::drwav_fmt fmt;
   memcpy(&fmt, &fmt_, sizeof(fmt));
-  impl = make_shared<WavWriterStage<T>>(filename, fmt, dr_wav::Container(cont_.c), in_, nFrames, bufsize_, mt_);
+  impl = make_shared<WavWriterStage<T>>(filename, fmt, dr_wav::Container(cont_.c), in_, nFrames, bufsize_, mt_, executor_, depth_, ioFlags_,
+					dither_);
 }
 
 template<typename T> WavWriter<T>::~WavWriter() {}
@@ -263,22 +797,92 @@ template<typename T> void WavWriter<T>::execute() {
   dynamic_pointer_cast<WavWriterStage<T>>(impl)->execute();
 }
 
+template<typename T> size_t WavWriter<T>::getMemoryUsage() {
+  return dynamic_pointer_cast<WavWriterStage<T>>(impl)->getMemoryUsage();
+}
+
 //
 
 template WavWriter<int32_t>::WavWriter(const string &, const ssrc::WavFormat&, const ssrc::ContainerFormat&,
-				       const vector<shared_ptr<StageOutlet<int32_t>>> &, uint64_t, size_t, bool);
+				       const vector<shared_ptr<StageOutlet<int32_t>>> &, uint64_t, size_t, bool, shared_ptr<Executor>,
+				       unsigned, unsigned, shared_ptr<WriterDither>);
 template WavWriter<int32_t>::~WavWriter();
 template void WavWriter<int32_t>::execute();
+template size_t WavWriter<int32_t>::getMemoryUsage();
 
 template WavWriter<float>::WavWriter(const string &, const ssrc::WavFormat&, const ssrc::ContainerFormat&,
-				     const vector<shared_ptr<StageOutlet<float>>> &, uint64_t, size_t, bool);
+				     const vector<shared_ptr<StageOutlet<float>>> &, uint64_t, size_t, bool, shared_ptr<Executor>,
+				       unsigned, unsigned, shared_ptr<WriterDither>);
 template WavWriter<float>::~WavWriter();
 template void WavWriter<float>::execute();
+template size_t WavWriter<float>::getMemoryUsage();
 
 template WavWriter<double>::WavWriter(const string &, const ssrc::WavFormat&, const ssrc::ContainerFormat&,
-				      const vector<shared_ptr<StageOutlet<double>>> &, uint64_t, size_t, bool);
+				      const vector<shared_ptr<StageOutlet<double>>> &, uint64_t, size_t, bool, shared_ptr<Executor>,
+				       unsigned, unsigned, shared_ptr<WriterDither>);
 template WavWriter<double>::~WavWriter();
 template void WavWriter<double>::execute();
+template size_t WavWriter<double>::getMemoryUsage();
+
+//
+
+template<typename T> AsyncOutletAdapter<T>::AsyncOutletAdapter(shared_ptr<StageOutlet<T>> in_, shared_ptr<Executor> executor_) :
+  impl(make_shared<AsyncOutletAdapterStage<T>>(in_, executor_)) {}
+
+template<typename T> AsyncOutletAdapter<T>::~AsyncOutletAdapter() {}
+
+template<typename T> bool AsyncOutletAdapter<T>::atEnd() {
+  return dynamic_pointer_cast<AsyncOutletAdapterStage<T>>(impl)->atEnd();
+}
+
+template<typename T> void AsyncOutletAdapter<T>::readAsync(T *ptr, size_t n, function<void(size_t, exception_ptr)> done) {
+  dynamic_pointer_cast<AsyncOutletAdapterStage<T>>(impl)->readAsync(ptr, n, done);
+}
+
+template<typename T> BlockingOutletAdapter<T>::BlockingOutletAdapter(shared_ptr<AsyncStageOutlet<T>> in_) :
+  impl(make_shared<BlockingOutletAdapterStage<T>>(in_)) {}
+
+template<typename T> BlockingOutletAdapter<T>::~BlockingOutletAdapter() {}
+
+template<typename T> bool BlockingOutletAdapter<T>::atEnd() {
+  return dynamic_pointer_cast<BlockingOutletAdapterStage<T>>(impl)->atEnd();
+}
+
+template<typename T> size_t BlockingOutletAdapter<T>::read(T *ptr, size_t n) {
+  return dynamic_pointer_cast<BlockingOutletAdapterStage<T>>(impl)->read(ptr, n);
+}
+
+//
+
+template AsyncOutletAdapter<int32_t>::AsyncOutletAdapter(shared_ptr<StageOutlet<int32_t>>, shared_ptr<Executor>);
+template AsyncOutletAdapter<int32_t>::~AsyncOutletAdapter();
+template bool AsyncOutletAdapter<int32_t>::atEnd();
+template void AsyncOutletAdapter<int32_t>::readAsync(int32_t *, size_t, function<void(size_t, exception_ptr)>);
+
+template BlockingOutletAdapter<int32_t>::BlockingOutletAdapter(shared_ptr<AsyncStageOutlet<int32_t>>);
+template BlockingOutletAdapter<int32_t>::~BlockingOutletAdapter();
+template bool BlockingOutletAdapter<int32_t>::atEnd();
+template size_t BlockingOutletAdapter<int32_t>::read(int32_t *, size_t);
+
+template AsyncOutletAdapter<float>::AsyncOutletAdapter(shared_ptr<StageOutlet<float>>, shared_ptr<Executor>);
+template AsyncOutletAdapter<float>::~AsyncOutletAdapter();
+template bool AsyncOutletAdapter<float>::atEnd();
+template void AsyncOutletAdapter<float>::readAsync(float *, size_t, function<void(size_t, exception_ptr)>);
+
+template BlockingOutletAdapter<float>::BlockingOutletAdapter(shared_ptr<AsyncStageOutlet<float>>);
+template BlockingOutletAdapter<float>::~BlockingOutletAdapter();
+template bool BlockingOutletAdapter<float>::atEnd();
+template size_t BlockingOutletAdapter<float>::read(float *, size_t);
+
+template AsyncOutletAdapter<double>::AsyncOutletAdapter(shared_ptr<StageOutlet<double>>, shared_ptr<Executor>);
+template AsyncOutletAdapter<double>::~AsyncOutletAdapter();
+template bool AsyncOutletAdapter<double>::atEnd();
+template void AsyncOutletAdapter<double>::readAsync(double *, size_t, function<void(size_t, exception_ptr)>);
+
+template BlockingOutletAdapter<double>::BlockingOutletAdapter(shared_ptr<AsyncStageOutlet<double>>);
+template BlockingOutletAdapter<double>::~BlockingOutletAdapter();
+template bool BlockingOutletAdapter<double>::atEnd();
+template size_t BlockingOutletAdapter<double>::read(double *, size_t);
 
 //
 
@@ -298,6 +902,10 @@ template<typename OUTTYPE, typename INTYPE> size_t Dither<OUTTYPE, INTYPE>::read
   return dynamic_pointer_cast<DitherStage<OUTTYPE, INTYPE>>(impl)->read(ptr, n);
 }
 
+template<typename OUTTYPE, typename INTYPE> size_t Dither<OUTTYPE, INTYPE>::getMemoryUsage() {
+  return dynamic_pointer_cast<DitherStage<OUTTYPE, INTYPE>>(impl)->getMemoryUsage();
+}
+
 //
 
 template Dither<int32_t, float>::Dither(shared_ptr<StageOutlet<float>> in_, double gain_, int32_t offset_,
@@ -306,6 +914,7 @@ template Dither<int32_t, float>::Dither(shared_ptr<StageOutlet<float>> in_, doub
 template Dither<int32_t, float>::~Dither();
 template size_t Dither<int32_t, float>::read(int32_t *ptr, size_t n);
 template bool Dither<int32_t, float>::atEnd();
+template size_t Dither<int32_t, float>::getMemoryUsage();
 
 template Dither<int32_t, double>::Dither(shared_ptr<StageOutlet<double>> in_, double gain_, int32_t offset_,
 					 int32_t clipMin_, int32_t clipMax_,
@@ -313,11 +922,53 @@ template Dither<int32_t, double>::Dither(shared_ptr<StageOutlet<double>> in_, do
 template Dither<int32_t, double>::~Dither();
 template size_t Dither<int32_t, double>::read(int32_t *ptr, size_t n);
 template bool Dither<int32_t, double>::atEnd();
+template size_t Dither<int32_t, double>::getMemoryUsage();
+
+//
+
+template<typename OUTTYPE, typename INTYPE>
+MultiChannelDither<OUTTYPE, INTYPE>::MultiChannelDither(const vector<shared_ptr<StageOutlet<INTYPE>>> &in_, double gain_,
+							int32_t offset_, int32_t clipMin_, int32_t clipMax_,
+							const ssrc::NoiseShaperCoef *coef_, const vector<shared_ptr<DoubleRNG>> &rng_) :
+  impl(make_shared<MultiChannelDitherStage<OUTTYPE, INTYPE>>(in_, gain_, offset_, clipMin_, clipMax_, coef_, rng_)) {}
+
+template<typename OUTTYPE, typename INTYPE> MultiChannelDither<OUTTYPE, INTYPE>::~MultiChannelDither() {}
+
+template<typename OUTTYPE, typename INTYPE>
+shared_ptr<StageOutlet<OUTTYPE>> MultiChannelDither<OUTTYPE, INTYPE>::getOutlet(uint32_t c) {
+  return dynamic_pointer_cast<MultiChannelDitherStage<OUTTYPE, INTYPE>>(impl)->getOutlet(c);
+}
+
+template<typename OUTTYPE, typename INTYPE> size_t MultiChannelDither<OUTTYPE, INTYPE>::getMemoryUsage() {
+  return dynamic_pointer_cast<MultiChannelDitherStage<OUTTYPE, INTYPE>>(impl)->getMemoryUsage();
+}
 
 //
 
+template MultiChannelDither<int32_t, float>::MultiChannelDither(const vector<shared_ptr<StageOutlet<float>>> &in_, double gain_,
+								int32_t offset_, int32_t clipMin_, int32_t clipMax_,
+								const ssrc::NoiseShaperCoef *coef_,
+								const vector<shared_ptr<DoubleRNG>> &rng_);
+template MultiChannelDither<int32_t, float>::~MultiChannelDither();
+template shared_ptr<StageOutlet<int32_t>> MultiChannelDither<int32_t, float>::getOutlet(uint32_t c);
+template size_t MultiChannelDither<int32_t, float>::getMemoryUsage();
+
+template MultiChannelDither<int32_t, double>::MultiChannelDither(const vector<shared_ptr<StageOutlet<double>>> &in_, double gain_,
+								 int32_t offset_, int32_t clipMin_, int32_t clipMax_,
+								 const ssrc::NoiseShaperCoef *coef_,
+								 const vector<shared_ptr<DoubleRNG>> &rng_);
+template MultiChannelDither<int32_t, double>::~MultiChannelDither();
+template shared_ptr<StageOutlet<int32_t>> MultiChannelDither<int32_t, double>::getOutlet(uint32_t c);
+template size_t MultiChannelDither<int32_t, double>::getMemoryUsage();
+
+//
+
+shared_ptr<DoubleRNG> ssrc::createDitherRNG(DitherPDF pdf, double peak, uint64_t seed, uint64_t stream) {
+  return make_shared<CounterDoubleRNG>(pdf, peak, seed, stream);
+}
+
 shared_ptr<DoubleRNG> ssrc::createTriangularRNG(double peak, uint64_t seed) {
-  return make_shared<TriangularDoubleRNG>(peak, make_shared<LCG64>(seed));
+  return make_shared<CounterDoubleRNG>(DitherPDF::TRIANGULAR, peak, seed, 0);
 }
 
 //
@@ -336,6 +987,10 @@ template<typename REAL> WavFormat ChannelMixer<REAL>::getFormat() {
   return dynamic_pointer_cast<ChannelMixerStage<REAL>>(impl)->getFormat();
 }
 
+template<typename REAL> size_t ChannelMixer<REAL>::getMemoryUsage() {
+  return dynamic_pointer_cast<ChannelMixerStage<REAL>>(impl)->getMemoryUsage();
+}
+
 //
 
 template ChannelMixer<float>::ChannelMixer(shared_ptr<ssrc::OutletProvider<float>> in_,
@@ -343,12 +998,14 @@ template ChannelMixer<float>::ChannelMixer(shared_ptr<ssrc::OutletProvider<float
 template ChannelMixer<float>::~ChannelMixer();
 template shared_ptr<ssrc::StageOutlet<float>> ChannelMixer<float>::getOutlet(uint32_t c);
 template WavFormat ChannelMixer<float>::getFormat();
+template size_t ChannelMixer<float>::getMemoryUsage();
 
 template ChannelMixer<double>::ChannelMixer(shared_ptr<ssrc::OutletProvider<double>> in_,
 					   const vector<vector<double>>& matrix_);
 template ChannelMixer<double>::~ChannelMixer();
 template shared_ptr<ssrc::StageOutlet<double>> ChannelMixer<double>::getOutlet(uint32_t c);
 template WavFormat ChannelMixer<double>::getFormat();
+template size_t ChannelMixer<double>::getMemoryUsage();
 
 //
 
@@ -1,220 +1,222 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <exception>
 #include <unordered_map>
+#include <limits>
+#include <algorithm>
 #include <cstdlib>
 #include <cmath>
 
 #include "shibatch/ssrc.hpp"
 #include "shibatch/ssrcsoxr.h"
-#include "ArrayQueue.hpp"
+#include "BGExecutor.hpp"
+#include "Fiber.hpp"
 
 using namespace std;
 using namespace ssrc;
 
 namespace shibatch {
-  template<typename OUTTYPE, typename INTYPE>
-  class Soxifier : OutletProvider<INTYPE> {
-    class Outlet : public StageOutlet<INTYPE> {
-      Soxifier &parent;
-      mutex mtx;
-      condition_variable condVar;
-      const uint32_t ch;
-      shared_ptr<thread> th;
-      ArrayQueue<INTYPE> inQueue;
-      ArrayQueue<OUTTYPE> outQueue;
-      bool finished = false;
-
-      void thEntry() {
-	vector<OUTTYPE> buf(parent.N);
-
-	while(!parent.shuttingDown) {
-	  size_t z = parent.tail[ch]->read(buf.data(), parent.N);
-	  if (z == 0) break;
-
-	  unique_lock lock(mtx);
-	  outQueue.write(buf.data(), z);
-	}
-
-	while(parent.tail[ch]->read(buf.data(), parent.N)) ;
-
-	unique_lock lock(mtx);
-	finished = true;
-	condVar.notify_all();
-      }
-
-    public:
-      Outlet(Soxifier& parent_, int ch_) : parent(parent_), ch(ch_) {}
-
-      bool atEnd() {
-	unique_lock lock(mtx);
-	return inQueue.size() == 0 && parent.isDraining();
-      }
-
-      size_t read(INTYPE *ptr, size_t n) {
-	unique_lock lock(mtx);
-
-	while(!(inQueue.size() != 0 || parent.isDraining())) condVar.wait(lock);
-
-	size_t z = inQueue.read(ptr, min(n, inQueue.size()));
-
-	if (inQueue.size() == 0) condVar.notify_all();
-
-	return z;
-      }
-
-      friend Soxifier;
+  /**
+   * Runs a PushSSRC for each channel. With a null executor the
+   * channels are converted one after another on the calling thread;
+   * otherwise all but one of them are converted by jobs on the
+   * executor while the calling thread converts the last. The scratch
+   * buffers grow to the largest block seen and are reused afterwards.
+   *
+   * The samples are converted between the I/O type and REAL as they
+   * are deinterleaved by the jobs and interleaved after them, or
+   * copied from and to the channel buffers of the split types. The
+   * dither noise of INT16 output is made by the jobs, each channel
+   * taking its own stream of the RNG.
+   *
+   * The channels converted on the calling thread run with the
+   * denormal mode of the thread policy, as the workers of the pool do,
+   * and the mode of the caller is restored afterwards.
+   */
+  template<typename REAL>
+  class Soxifier {
+    struct Channel {
+      shared_ptr<PushSSRC<REAL>> ssrc;
+      shared_ptr<DoubleRNG> rng;
+      vector<REAL> in, out;
+      vector<double> rnd;
+      size_t nOut = 0;
+      exception_ptr ex = nullptr;
+      shared_ptr<Runnable> job;
     };
 
-    //
-
-    enum { INIT, CLAMPED, STARTED, DRAINING, STOPPED } state = INIT;
-
     const unsigned nch;
-    const size_t N;
-    bool shuttingDown = false;
-
-    WavFormat format;
-    vector<shared_ptr<Outlet>> outlet;
-    vector<shared_ptr<StageOutlet<OUTTYPE>>> tail;
-
-    size_t collectOutput(OUTTYPE *obuf, size_t z) {
-      for(unsigned ch=0;ch<nch;ch++) {
-	unique_lock lock(outlet[ch]->mtx);
-	z = min(z, outlet[ch]->outQueue.size());
+    const ssrc_soxr_datatype_t itype, otype; // Without SSRC_SOXR_SPLIT
+    const bool isplit, osplit;
+    vector<Channel> channel;
+    shared_ptr<BGExecutor> executor;
+    const bool flushDenormals;
+    double delay = 0;
+
+    // Arguments of the current call, read by the jobs
+    const void *ibuf = nullptr;
+    size_t ilen = 0, olen = 0;
+    bool draining = false;
+
+    template<typename T>
+    void deinterleave(REAL *dst, const void *src, unsigned c, REAL scale) {
+      if (isplit) {
+	const T *s = ((const T * const *)src)[c];
+	for(size_t i=0;i<ilen;i++) dst[i] = s[i] * scale;
+      } else {
+	const T *s = (const T *)src + c;
+	for(size_t i=0;i<ilen;i++) dst[i] = s[i * nch] * scale;
       }
+    }
 
-      vector<OUTTYPE> buf(z);
-
-      for(unsigned ch=0;ch<nch;ch++) {
-	{
-	  unique_lock lock(outlet[ch]->mtx);
-	  outlet[ch]->outQueue.read(buf.data(), z);
-	}
-	for(size_t i=0;i<z;i++)
-	  obuf[i * nch + ch] = buf[i];
+    template<typename T>
+    void interleave(void *dst, const REAL *src, unsigned c, size_t n) {
+      if (osplit) {
+	T *d = ((T * const *)dst)[c];
+	for(size_t i=0;i<n;i++) d[i] = src[i];
+      } else {
+	T *d = (T *)dst + c;
+	for(size_t i=0;i<n;i++) d[i * nch] = src[i];
       }
-
-      return z;
     }
 
-    bool isDraining() const { return state == DRAINING || state == STOPPED || shuttingDown; }
-
-  public:
-    Soxifier(unsigned nch_, size_t N_ = 65536) : nch(nch_), N(N_) {
-      for(unsigned ch=0;ch<nch;ch++)
-	outlet.push_back(make_shared<Outlet>(*this, ch));
+    // Rounds to the nearest, adding the dither if rnd is not null
+    template<typename T>
+    void quantize(void *dst, const REAL *src, const double *rnd, unsigned c, size_t n, double scale) {
+      const double lo = numeric_limits<T>::min(), hi = numeric_limits<T>::max();
+      T *d = osplit ? ((T * const *)dst)[c] : (T *)dst + c;
+      const size_t step = osplit ? 1 : nch;
+      for(size_t i=0;i<n;i++) {
+	double x = src[i] * scale;
+	if (rnd) x += rnd[i];
+	d[i * step] = (T)min(max(rint(x), lo), hi);
+      }
     }
 
-    ~Soxifier() {
-      {
-	shuttingDown = true;
-
-	for(unsigned c=0;c<nch;c++) {
-	  unique_lock lock(outlet[c]->mtx);
-	  outlet[c]->condVar.notify_all();
+    void run(unsigned c) {
+      Channel &ch = channel[c];
+      try {
+	if (ch.out.size() < olen) ch.out.resize(olen);
+	if (draining) {
+	  ch.nOut = ch.ssrc->flush(ch.out.data(), olen);
+	} else {
+	  if (ch.in.size() < ilen) ch.in.resize(ilen);
+	  switch(itype) {
+	  case SSRC_SOXR_FLOAT32: deinterleave<float>  (ch.in.data(), ibuf, c, 1); break;
+	  case SSRC_SOXR_FLOAT64: deinterleave<double> (ch.in.data(), ibuf, c, 1); break;
+	  case SSRC_SOXR_INT32:   deinterleave<int32_t>(ch.in.data(), ibuf, c, 1.0 / 2147483648.0); break;
+	  case SSRC_SOXR_INT16:   deinterleave<int16_t>(ch.in.data(), ibuf, c, 1.0 / 32768.0); break;
+	  default: break;
+	  }
+	  ch.nOut = ch.ssrc->process(ch.in.data(), ilen, ch.out.data(), olen);
 	}
+	if (ch.rng) {
+	  if (ch.rnd.size() < ch.nOut) ch.rnd.resize(ch.nOut);
+	  ch.rng->fill(ch.rnd.data(), ch.nOut);
+	}
+      } catch(...) {
+	ch.ex = current_exception();
       }
-
-      for(unsigned ch=0;ch<nch;ch++) {
-	if (outlet[ch]->th) outlet[ch]->th->join();
-      }
-    }
-
-    shared_ptr<StageOutlet<INTYPE>> getOutlet(uint32_t channel) {
-      if (channel >= outlet.size()) throw(runtime_error("Soxifier::getOutlet channel too large"));
-      return outlet[channel];
-    }
-
-    void clamp(const vector<shared_ptr<StageOutlet<OUTTYPE>>> &in_) {
-      if (state != INIT) throw(runtime_error("Soxifier::clamp state != INIT"));
-      tail = in_;
-      state = CLAMPED;
-    }
-
-    WavFormat getFormat() { return format; }
-
-    uint32_t getNChannels() const { return format.channels; }
-
-    //
-
-    void start(const WavFormat &format_) {
-      if (state != CLAMPED) throw(runtime_error("Soxifier::start state != CLAMPED"));
-      if (format_.channels != nch) throw(runtime_error("Soxifier::start format.channels != nch"));
-
-      format = format_;
-
-      for(unsigned ch=0;ch<nch;ch++)
-	outlet[ch]->th = make_shared<thread>(&shibatch::Soxifier<float, float>::Outlet::thEntry, outlet[ch]);
-
-      state = STARTED;
     }
 
-    void flow(const INTYPE *ibuf, OUTTYPE *obuf, size_t *inframe, size_t *onframe) {
-      if (state != STARTED && state != DRAINING) throw(runtime_error("Soxifier::flow state != STARTED"));
-
-      size_t ilen = *inframe, olen = *onframe;
+    size_t runAll(void *obuf) {
+      const uint64_t fpMode = getFPMode();
+      if (flushDenormals) {
+	ThreadPolicy policy;
+	policy.flushDenormals = true;
+	policy.apply();
+      }
 
-      {
-	size_t z = collectOutput(obuf, olen);
-	olen -= z;
-	obuf += z * nch;
+      if (executor) {
+	for(unsigned c=0;c<nch-1;c++) executor->push(channel[c].job);
+	run(nch-1);
+	while(executor->size() > 0) executor->pop();
+      } else {
+	for(unsigned c=0;c<nch;c++) run(c);
       }
 
-      for(unsigned c=0;c<nch;c++) {
-	vector<INTYPE> v(ilen);
-	for(size_t i=0;i<ilen;i++) v[i] = ibuf[i * nch + c];
+      setFPMode(fpMode);
 
-	unique_lock lock(outlet[c]->mtx);
-	outlet[c]->inQueue.write(std::move(v));
-	outlet[c]->condVar.notify_all();
+      for(unsigned c=0;c<nch;c++) {
+	if (channel[c].ex) {
+	  exception_ptr ex = channel[c].ex;
+	  channel[c].ex = nullptr;
+	  rethrow_exception(ex);
+	}
+	if (channel[c].nOut != channel[0].nOut) throw(runtime_error("Soxifier::runAll channels out of step"));
       }
 
+      const size_t z = channel[0].nOut;
       for(unsigned c=0;c<nch;c++) {
-	unique_lock lock(outlet[c]->mtx);
-	while(outlet[c]->inQueue.size() != 0) outlet[c]->condVar.wait(lock);
+	const REAL *p = channel[c].out.data();
+	switch(otype) {
+	case SSRC_SOXR_FLOAT32: interleave<float> (obuf, p, c, z); break;
+	case SSRC_SOXR_FLOAT64: interleave<double>(obuf, p, c, z); break;
+	case SSRC_SOXR_INT32: quantize<int32_t>(obuf, p, nullptr, c, z, 2147483648.0); break;
+	case SSRC_SOXR_INT16:
+	  quantize<int16_t>(obuf, p, channel[c].rng ? channel[c].rnd.data() : nullptr, c, z, 32768.0);
+	  break;
+	default: break;
+	}
       }
 
-      {
-	size_t z = collectOutput(obuf, olen);
-	olen -= z;
-	obuf += z * nch;
-      }
+      return z;
+    }
 
-      *onframe = *onframe - olen;
+  public:
+    Soxifier(unsigned nch_, ssrc_soxr_datatype_t itype_, ssrc_soxr_datatype_t otype_, bool dither,
+	     int64_t sfs, int64_t dfs, unsigned l2dftflen, double aa, double guard, bool minPhase,
+	     shared_ptr<Executor> executor_) :
+      nch(nch_), itype((ssrc_soxr_datatype_t)(itype_ & ~SSRC_SOXR_SPLIT)), otype((ssrc_soxr_datatype_t)(otype_ & ~SSRC_SOXR_SPLIT)),
+      isplit(itype_ & SSRC_SOXR_SPLIT), osplit(otype_ & SSRC_SOXR_SPLIT), channel(nch_),
+      flushDenormals(getThreadPolicy().flushDenormals) {
+      for(unsigned c=0;c<nch;c++) {
+	channel[c].ssrc = make_shared<PushSSRC<REAL>>(sfs, dfs, l2dftflen, aa, guard, 1.0, minPhase);
+	if (dither && otype == SSRC_SOXR_INT16) channel[c].rng = createDitherRNG(DitherPDF::TRIANGULAR, 1.0, 0, c);
+	channel[c].job = Runnable::factory([this, c](void *) { run(c); });
+      }
+      delay = channel[0].ssrc->getDelay();
+      if (executor_ && nch > 1) executor = make_shared<BGExecutor>(executor_);
     }
 
-    void drain(OUTTYPE *obuf, size_t *onframe) {
-      if (state != STARTED && state != DRAINING) throw(runtime_error("Soxifier::drain state != STARTED && state != DRAINING"));
+    double getDelay() const { return delay; }
 
-      if (state != DRAINING) {
-	state = DRAINING;
+    void flow(const void *ibuf_, void *obuf, size_t *inframe, size_t *onframe) {
+      if (draining) throw(runtime_error("Soxifier::flow called after drain"));
 
-	for(unsigned c=0;c<nch;c++) {
-	  unique_lock lock(outlet[c]->mtx);
-	  outlet[c]->condVar.notify_all();
-	  while(!outlet[c]->finished) outlet[c]->condVar.wait(lock);
-	}
-      }
+      ibuf = ibuf_;
+      ilen = *inframe;
+      olen = *onframe;
 
-      size_t z = 0;
-      flow(nullptr, obuf, &z, onframe);
+      *onframe = runAll(obuf);
     }
 
-    void stop() {
-      if (state != STARTED && state != DRAINING) throw(runtime_error("Soxifier::stop state != STARTED && state != DRAINING"));
-
-      state = STOPPED;
+    void drain(void *obuf, size_t *onframe) {
+      draining = true;
+      ilen = 0;
+      olen = *onframe;
 
-      for(unsigned c=0;c<nch;c++) {
-	unique_lock lock(outlet[c]->mtx);
-	outlet[c]->condVar.notify_all();
-      }
+      *onframe = runAll(obuf);
     }
   };
 
+  // Resamplers asking for the same number of threads share a pool
+  static shared_ptr<Executor> sharedExecutor(unsigned nThreads) {
+    static mutex mtx;
+    static unordered_map<unsigned, shared_ptr<Executor>> pools;
+
+    if (nThreads == 1) return nullptr;
+    if (nThreads == 0) return Executor::getDefault();
+
+    unique_lock lock(mtx);
+    auto &e = pools[nThreads];
+    if (!e) e = make_shared<Executor>(nThreads);
+    return e;
+  }
+
   static const uint64_t MAGIC = 0x8046b5efb58216fcULL;
 
   mutex mtxErrorString;
@@ -238,10 +240,49 @@ struct ssrc_soxr {
 
   //
 
-  shared_ptr<Soxifier<float, float>> f32f32;
-  shared_ptr<Soxifier<double, double>> f64f64;
+  // The engine runs in double precision if qspec.dataType is FLOAT64
+  shared_ptr<Soxifier<float>> f32;
+  shared_ptr<Soxifier<double>> f64;
+
+  void reset() {
+    const bool dither = iospec.ditherType != SSRC_SOXR_NO_DITHER && !(iospec.flags & SSRC_SOXR_NO_DITHER);
+    const bool minPhase = (qspec.flags & SSRC_SOXR_MINIMUM_PHASE) == SSRC_SOXR_MINIMUM_PHASE;
+
+    f32 = nullptr;
+    f64 = nullptr;
+
+    if (qspec.dataType == SSRC_SOXR_FLOAT64) {
+      f64 = make_shared<Soxifier<double>>(num_channels, itype, otype, dither, (int64_t)input_rate, (int64_t)output_rate,
+					  qspec.log2dftfilterlen, qspec.aa, qspec.guard, minPhase,
+					  sharedExecutor(rtspec.num_threads));
+      delay = f64->getDelay();
+    } else {
+      f32 = make_shared<Soxifier<float>>(num_channels, itype, otype, dither, (int64_t)input_rate, (int64_t)output_rate,
+					 qspec.log2dftfilterlen, qspec.aa, qspec.guard, minPhase,
+					 sharedExecutor(rtspec.num_threads));
+      delay = f32->getDelay();
+    }
+  }
+
+  void flow(const void *in, void *out, size_t *isamp, size_t *osamp) {
+    if (f64) f64->flow(in, out, isamp, osamp); else f32->flow(in, out, isamp, osamp);
+  }
+
+  void drain(void *out, size_t *osamp) {
+    if (f64) f64->drain(out, osamp); else f32->drain(out, osamp);
+  }
 };
 
+static size_t sampleSize(ssrc_soxr_datatype_t t) {
+  switch(t) {
+  case SSRC_SOXR_FLOAT32: case SSRC_SOXR_FLOAT32_S: return sizeof(float);
+  case SSRC_SOXR_FLOAT64: case SSRC_SOXR_FLOAT64_S: return sizeof(double);
+  case SSRC_SOXR_INT32:   case SSRC_SOXR_INT32_S:   return sizeof(int32_t);
+  case SSRC_SOXR_INT16:   case SSRC_SOXR_INT16_S:   return sizeof(int16_t);
+  default: return 0;
+  }
+}
+
 ssrc_soxr_io_spec_t ssrc_soxr_io_spec(ssrc_soxr_datatype_t itype, ssrc_soxr_datatype_t otype) {
   ssrc_soxr_io_spec_t ret;
   ret.itype = itype;
@@ -280,7 +321,8 @@ struct ssrc_soxr *ssrc_soxr_create(double input_rate, double output_rate, unsign
     *eptr = "ssrc_soxr_create : Unsupported num_channels";
     return nullptr;
   }
-  if (!iospec || iospec->itype != SSRC_SOXR_FLOAT32 || iospec->otype != SSRC_SOXR_FLOAT32 || iospec->ditherType != 0) {
+  if (!iospec || sampleSize(iospec->itype) == 0 || sampleSize(iospec->otype) == 0 ||
+      (iospec->ditherType != SSRC_SOXR_TPDF && iospec->ditherType != SSRC_SOXR_NO_DITHER)) {
     *eptr = "ssrc_soxr_create : Unsupported iospec";
     return nullptr;
   }
@@ -310,22 +352,7 @@ struct ssrc_soxr *ssrc_soxr_create(double input_rate, double output_rate, unsign
 
     //
 
-    auto xifier = make_shared<Soxifier<float, float>>(num_channels);
-
-    thiz->f32f32 = xifier;
-
-    vector<shared_ptr<StageOutlet<float>>> out(num_channels);
-
-    for(unsigned i=0;i<num_channels;i++) {
-      auto ssrc = make_shared<SSRC<float>>(xifier->getOutlet(i), (int64_t)input_rate, (int64_t)output_rate, q.log2dftfilterlen, q.aa, q.guard, 1.0,
-					   (q.flags & SSRC_SOXR_MINIMUM_PHASE) == SSRC_SOXR_MINIMUM_PHASE, 0, rt.num_threads == 0);
-      thiz->delay = ssrc->getDelay();
-      out[i] = ssrc;
-    }
-
-    xifier->clamp(out);
-
-    xifier->start(WavFormat(WavFormat::IEEE_FLOAT, num_channels, output_rate, 32));
+    thiz->reset();
 
     return thiz;
   } catch(exception &ex) {
@@ -348,19 +375,17 @@ ssrc_soxr_error_t ssrc_soxr_process(struct ssrc_soxr *thiz,
   }
 
   try {
-    auto xifier = thiz->f32f32;
-
     if (in) {
       size_t isamp = ilen, osamp = olen;
 
-      xifier->flow((const float *)in, (float *)out, &isamp, &osamp);
+      thiz->flow(in, out, &isamp, &osamp);
 
       if (idone) *idone = isamp;
       if (odone) *odone = osamp;
     } else {
       size_t osamp = olen;
 
-      xifier->drain((float *)out, &osamp);
+      thiz->drain(out, &osamp);
 
       if (odone) *odone = osamp;
     }
@@ -381,23 +406,7 @@ ssrc_soxr_error_t ssrc_soxr_clear(struct ssrc_soxr *thiz) {
   }
 
   try {
-    auto xifier = make_shared<Soxifier<float, float>>(thiz->num_channels);
-
-    thiz->f32f32 = xifier;
-
-    vector<shared_ptr<StageOutlet<float>>> out(thiz->num_channels);
-
-    for(unsigned i=0;i<thiz->num_channels;i++) {
-      auto ssrc = make_shared<SSRC<float>>(xifier->getOutlet(i), (int64_t)thiz->input_rate, (int64_t)thiz->output_rate,
-					   thiz->qspec.log2dftfilterlen, thiz->qspec.aa, thiz->qspec.guard, 1.0,
-					   false, 0, thiz->rtspec.num_threads == 0);
-      thiz->delay = ssrc->getDelay();
-      out[i] = ssrc;
-    }
-
-    xifier->clamp(out);
-
-    xifier->start(WavFormat(WavFormat::IEEE_FLOAT, thiz->num_channels, thiz->output_rate, 32));
+    thiz->reset();
   } catch(exception &ex) {
   }
 
@@ -430,32 +439,35 @@ ssrc_soxr_error_t ssrc_soxr_oneshot(double in_rate, double out_rate, unsigned nu
   size_t total_frames_read = 0;
   size_t total_frames_written = 0;
 
-  char * current_out_ptr = (char *)out;
+  // The output pointers, one for each channel if the type is split
+  const bool osplit = io_spec->otype & SSRC_SOXR_SPLIT;
+  vector<char *> current_out_ptr(osplit ? num_channels : 1);
+  for(size_t c=0;c<current_out_ptr.size();c++) current_out_ptr[c] = osplit ? ((char * const *)out)[c] : (char *)out;
   size_t remaining_out_capacity_frames = out_len;
     
-  unsigned bytes_per_frame = 0;
-  switch(io_spec->otype) {
-  case SSRC_SOXR_FLOAT32_I: bytes_per_frame = sizeof(float) * num_channels; break;
-  case SSRC_SOXR_FLOAT64_I: bytes_per_frame = sizeof(double) * num_channels; break;
-  default: return "Unsupported otype";
-  }
+  const size_t bytes_per_frame = sampleSize(io_spec->otype) * (osplit ? 1 : num_channels);
+
+  auto out_arg = [&]() -> void * { return osplit ? (void *)current_out_ptr.data() : (void *)current_out_ptr[0]; };
+
+  auto advance = [&](size_t frames_produced) {
+    for(auto &p : current_out_ptr) p += frames_produced * bytes_per_frame;
+    if (remaining_out_capacity_frames >= frames_produced) {
+      remaining_out_capacity_frames -= frames_produced;
+    } else {
+      remaining_out_capacity_frames = 0;
+    }
+  };
 
   size_t frames_consumed = 0;
   size_t frames_produced = 0;
     
   if (in && in_len > 0) {
     error = ssrc_soxr_process(soxr, in, in_len, &frames_consumed,
-			      current_out_ptr, remaining_out_capacity_frames, &frames_produced);
+			      out_arg(), remaining_out_capacity_frames, &frames_produced);
 
     total_frames_read += frames_consumed;
     total_frames_written += frames_produced;
-
-    current_out_ptr += frames_produced * bytes_per_frame;
-    if (remaining_out_capacity_frames >= frames_produced) {
-      remaining_out_capacity_frames -= frames_produced;
-    } else {
-      remaining_out_capacity_frames = 0;
-    }
+    advance(frames_produced);
   }
 
   if (!error) {
@@ -463,15 +475,10 @@ ssrc_soxr_error_t ssrc_soxr_oneshot(double in_rate, double out_rate, unsigned nu
       if (remaining_out_capacity_frames == 0) break;
 
       error = ssrc_soxr_process(soxr, NULL, 0, NULL,
-				current_out_ptr, remaining_out_capacity_frames, &frames_produced);
+				out_arg(), remaining_out_capacity_frames, &frames_produced);
 
       total_frames_written += frames_produced;
-      current_out_ptr += frames_produced * bytes_per_frame;
-      if (remaining_out_capacity_frames >= frames_produced) {
-	remaining_out_capacity_frames -= frames_produced;
-      } else {
-	remaining_out_capacity_frames = 0;
-      }
+      advance(frames_produced);
     } while (!error && frames_produced > 0);
   }
     
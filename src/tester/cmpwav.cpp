@@ -16,16 +16,20 @@ string container_to_string(drwav_container container) {
     return "unknown";
 }
 
-double compare(const string& file0, const string& file1) {
+// With an offset, file1 is compared with as many frames of file0 from the offset on
+double compare(const string& file0, const string& file1, int64_t offset = -1) {
   static const size_t N = 4096;
 
   WavFile wav0(file0), wav1(file1);
 
   if (wav0.getNChannels() != wav1.getNChannels()) throw(runtime_error("Number of channels does not match"));
   if (wav0.getSampleRate() != wav1.getSampleRate()) throw(runtime_error("Sample rates do not match"));
-  if (wav0.getNFrames() != wav1.getNFrames())
+  if (offset < 0 && wav0.getNFrames() != wav1.getNFrames())
     throw(runtime_error(("Number of frames does not match : " + file0 + ":" + to_string(wav0.getNFrames()) +
 			 " vs. " + file1 + ":" + to_string(wav1.getNFrames())).c_str()));
+  if (offset >= 0 && (wav0.getNFrames() < offset + wav1.getNFrames() || !wav0.seek(offset)))
+    throw(runtime_error(("Range out of file : " + file0 + ":" + to_string(wav0.getNFrames()) +
+			 " vs. " + file1 + ":" + to_string(offset) + "+" + to_string(wav1.getNFrames())).c_str()));
 
   const unsigned nch = wav0.getNChannels();
 
@@ -34,7 +38,7 @@ double compare(const string& file0, const string& file1) {
   double maxDif = 0;
 
   for(;;) {
-    size_t nr0 = wav0.readPCM(buf0.data(), N), nr1 = wav1.readPCM(buf1.data(), N);
+    size_t nr1 = wav1.readPCM(buf1.data(), N), nr0 = wav0.readPCM(buf0.data(), offset < 0 ? N : nr1);
     if (nr0 != nr1) throw(runtime_error("File lengths do not match"));
 
     for(size_t i=0;i<nr0 * nch;i++) maxDif = max(maxDif, abs(buf0[i] - buf1[i]));
@@ -52,6 +56,14 @@ int main(int argc, char **argv) {
   } else if (argc == 4 && string(argv[1]) == "--check-container") {
     WavFile wav(argv[2]);
     return container_to_string(wav.getContainer()) == argv[3] ? 0 : 1;
+  } else if (argc == 6 && string(argv[1]) == "--offset") {
+    try {
+      double maxDif = compare(argv[3], argv[4], stoll(argv[2]));
+      cerr << "Max difference : " << maxDif << endl;
+      return maxDif <= atof(argv[5]) ? 0 : 1;
+    } catch (const ::std::exception& e) {
+      cerr << "Error: " << e.what() << endl;
+    }
   } else if (argc == 4) {
     try {
       double maxDif = compare(argv[1], argv[2]);
@@ -62,6 +74,7 @@ int main(int argc, char **argv) {
     }
   } else {
     cerr << "Usage : " << argv[0] << " <file0.wav> <file1.wav> <threshold>" << endl;
+    cerr << " or " << argv[0] << " --offset <frames> <file0.wav> <file1.wav> <threshold>" << endl;
     cerr << " or " << argv[0] << " --check-channels <file.wav> <# of channels>" << endl;
     cerr << " or " << argv[0] << " --check-container <file.wav> <container>" << endl;
   }
@@ -30,6 +30,76 @@ if (NOT WIN32)
     COMMAND_ERROR_IS_FATAL ANY
     COMMAND_ECHO STDOUT
   )
+  # Through stdio and mapped, 32-bit input is decoded to double without loss
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --rate 48000 --bits 32 "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --bits -64 --stdin --stdout
+    INPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.wav"
+    OUTPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.stdin.f64.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --bits -64 "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.mapped.f64.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  # The same samples as headerless PCM, written and read through pipes, and read from a file
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --rate 48000 --rawOut s32 --stdout "${TMP_DIR_PATH}/noise.44100.wav"
+    COMMAND cat
+    OUTPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.raw"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  execute_process(
+    COMMAND cat "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.raw"
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --rawIn s32,2,48000 --bits -64 --stdin --stdout
+    COMMAND cat
+    OUTPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.rawpipe.f64.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --rawIn s32,2,48000 --bits -64 "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.raw" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.rawfile.f64.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  # The read-ahead of STDIN and the writer blocks sized to fit in 2 MiB,
+  # so that the blocks do not line up with the chunks read
+  execute_process(
+    COMMAND "${TARGET_FILE_ssrc}" --profile long --memLimit 2 --bits -64 --stdin --stdout
+    INPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.wav"
+    OUTPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.memLimit.f64.wav"
+    COMMAND_ERROR_IS_FATAL ANY
+    COMMAND_ECHO STDOUT
+  )
+  foreach(F64 stdin mapped rawpipe rawfile memLimit)
+    execute_process(
+      COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.32.${F64}.f64.wav" 0
+      COMMAND_ERROR_IS_FATAL ANY
+      COMMAND_ECHO STDOUT
+    )
+  endforeach()
+  # Through a pipe, the header keeps the sizes that mark an unknown length
+  foreach(CONTAINER riff rf64 w64)
+    execute_process(
+      COMMAND "${TARGET_FILE_ssrc}" --rate 48000 --bits -32 --dstContainer ${CONTAINER} --stdout "${TMP_DIR_PATH}/noise.44100.wav"
+      COMMAND cat
+      OUTPUT_FILE "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.pipe.${CONTAINER}.wav"
+      COMMAND_ERROR_IS_FATAL ANY
+      COMMAND_ECHO STDOUT
+    )
+    execute_process(
+      COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.pipe.${CONTAINER}.wav" 0
+      COMMAND_ERROR_IS_FATAL ANY
+      COMMAND_ECHO STDOUT
+    )
+  endforeach()
 else()
   execute_process(
     COMMAND "${TARGET_FILE_ssrc}" --rate 48000 --bits 24 "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.24.wav"
@@ -68,11 +138,41 @@ execute_process(
   COMMAND_ERROR_IS_FATAL ANY
   COMMAND_ECHO STDOUT
 )
+execute_process(
+  COMMAND "${TARGET_FILE_test_asyncapi}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_asyncapi.44100.48000.-32.wav" 48000
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_pushapi}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_pushapi.44100.48000.-32.wav" 48000
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_pushapi}" "${TMP_DIR_PATH}/noise.48000.wav" "${TMP_DIR_PATH}/noise.test_pushapi.48000.44100.-32.wav" 44100
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_pushapi}" --fpMode
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_pushapi}" --soxrFPMode
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
 execute_process(
   COMMAND "${TARGET_FILE_test_soxrapi}" 48000 "${TMP_DIR_PATH}/noise.test_soxrapi.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.44100.wav"
   COMMAND_ERROR_IS_FATAL ANY
   COMMAND_ECHO STDOUT
 )
+execute_process(
+  COMMAND "${TARGET_FILE_test_soxrapi}" --threads 0 48000 "${TMP_DIR_PATH}/noise.test_soxrapi.44100.48000.-32.threads.wav" "${TMP_DIR_PATH}/noise.44100.wav"
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
 execute_process(
   COMMAND "${TARGET_FILE_test_soxrapi}" -44100 "${TMP_DIR_PATH}/noise.test_soxrapi.48000.44100.-32.minPhase.wav" "${TMP_DIR_PATH}/noise.48000.wav"
   COMMAND_ERROR_IS_FATAL ANY
@@ -88,6 +188,37 @@ execute_process(
   COMMAND_ERROR_IS_FATAL ANY
   COMMAND_ECHO STDOUT
 )
+# FLOAT64 I/O is tested with the HQ recipe, which is the long profile
+execute_process(
+  COMMAND "${TARGET_FILE_ssrc}" --profile long --rate 48000 --bits -32 "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.long.wav"
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_oneshot}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.f64.wav" 48000 f64
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_oneshot}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s32.wav" 48000 s32
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_oneshot}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s16.wav" 48000 s16
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_oneshot}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.f32.split.wav" 48000 f32 split
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
+execute_process(
+  COMMAND "${TARGET_FILE_test_oneshot}" "${TMP_DIR_PATH}/noise.44100.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s16.split.wav" 48000 s16 split
+  COMMAND_ERROR_IS_FATAL ANY
+  COMMAND_ECHO STDOUT
+)
 execute_process(
   COMMAND "${TARGET_FILE_test_soxrapi}" 48000 "${TMP_DIR_PATH}/sin10k12k.test_soxrapi.44100.48000.-32.wav" "${TMP_DIR_PATH}/sin10k.44100.wav" "${TMP_DIR_PATH}/sin12k.44100.wav"
   COMMAND_ERROR_IS_FATAL ANY
@@ -97,9 +228,18 @@ execute_process(
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.24.wav" "${TMP_DIR_PATH}/noise.test_cppapi.44100.48000.24.wav" 0.0001
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.48000.44100.24.wav" "${TMP_DIR_PATH}/noise.test_cppapi.48000.44100.24.wav" 0.0001
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_soxrapi.44100.48000.-32.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.test_soxrapi.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_soxrapi.44100.48000.-32.threads.wav" 0
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_asyncapi.44100.48000.-32.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_pushapi.44100.48000.-32.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.48000.44100.-32.wav" "${TMP_DIR_PATH}/noise.test_pushapi.48000.44100.-32.wav" 0.0001
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.48000.44100.-32.minPhase.wav" "${TMP_DIR_PATH}/noise.test_soxrapi.48000.44100.-32.minPhase.wav" 0.0001
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.-32.wav" 0.0001
   COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.48000.44100.-32.wav" "${TMP_DIR_PATH}/noise.test_oneshot.48000.44100.-32.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.long.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.f64.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s32.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.ssrc.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s16.wav" 0.0001
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.-32.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.f32.split.wav" 0
+  COMMAND "${TARGET_FILE_cmpwav}" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s16.wav" "${TMP_DIR_PATH}/noise.test_oneshot.44100.48000.s16.split.wav" 0
   COMMAND "${TARGET_FILE_scsa}" "--check" "${CMAKE_CURRENT_LIST_DIR}/10kHz-100dB.scsa" "${TMP_DIR_PATH}/sin10k12k.test_soxrapi.44100.48000.-32.wav" 100000 300000 10000
   COMMAND "${TARGET_FILE_scsa}" "--check" "${CMAKE_CURRENT_LIST_DIR}/12kHz-100dB.scsa" "${TMP_DIR_PATH}/sin10k12k.test_soxrapi.44100.48000.-32.wav" 500000 800000 10000
   COMMAND_ERROR_IS_FATAL ANY
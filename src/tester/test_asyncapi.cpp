@@ -0,0 +1,139 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <coroutine>
+#include <cstdlib>
+#include <algorithm>
+#include "shibatch/ssrc.hpp"
+
+// A coroutine that starts at once and is not awaited by anybody
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Reads everything from an asynchronous outlet into a vector
+Detached drain(std::shared_ptr<ssrc::AsyncStageOutlet<float>> in, std::vector<float> &out,
+               std::shared_ptr<std::atomic<int>> nRunning) {
+    std::vector<float> buf(4096);
+    for(;;) {
+        size_t z = co_await in->read(buf.data(), buf.size());
+        if (z == 0) break;
+        out.insert(out.end(), buf.begin(), buf.begin() + z);
+    }
+    (*nRunning)--;
+    nRunning->notify_all();
+}
+
+// An asynchronous outlet over a vector, whose reads finish immediately
+class VectorOutlet : public ssrc::AsyncStageOutlet<float> {
+    const std::vector<float> &v;
+    size_t pos = 0;
+public:
+    VectorOutlet(const std::vector<float> &v_) : v(v_) {}
+    bool atEnd() { return pos == v.size(); }
+    void readAsync(float *ptr, size_t n, std::function<void(size_t, std::exception_ptr)> done) {
+        size_t z = std::min(n, v.size() - pos);
+        std::copy(v.begin() + pos, v.begin() + pos + z, ptr);
+        pos += z;
+        done(z, nullptr);
+    }
+};
+
+// An outlet of silence that ends after n samples
+class SilenceOutlet : public ssrc::StageOutlet<float> {
+    size_t left;
+public:
+    SilenceOutlet(size_t n) : left(n) {}
+    bool atEnd() { return left == 0; }
+    size_t read(float *ptr, size_t n) {
+        size_t z = std::min(n, left);
+        std::fill(ptr, ptr + z, 0.0f);
+        left -= z;
+        return z;
+    }
+};
+
+// The completion of a read drops the last reference to the adapter,
+// which holds the last reference to its executor. The pool is then
+// destroyed on one of its own workers.
+void release_from_completion() {
+    for(int i=0;i<100;i++) {
+        auto adapter = std::make_shared<std::shared_ptr<ssrc::AsyncOutletAdapter<float>>>(
+            std::make_shared<ssrc::AsyncOutletAdapter<float>>(std::make_shared<SilenceOutlet>(1024), std::make_shared<ssrc::Executor>(2)));
+
+        std::vector<float> buf(1024);
+        auto state = std::make_shared<std::atomic<int>>(0);
+
+        (*adapter)->readAsync(buf.data(), buf.size(), [adapter, state](size_t, std::exception_ptr) {
+            // Wait until readAsync() has returned and let go of the executor
+            while(state->load() != 1) state->wait(0);
+            adapter->reset();
+            *state = 2;
+            state->notify_all();
+        });
+
+        *state = 1;
+        state->notify_all();
+        while(state->load() != 2) state->wait(1);
+    }
+
+    std::cout << "Releasing from a completion OK" << std::endl;
+}
+
+void convert_file(const std::string& in_path, const std::string& out_path, int dstRate) {
+    try {
+        auto reader = std::make_shared<ssrc::WavReader<float>>(in_path);
+        ssrc::WavFormat srcFormat = reader->getFormat();
+
+        ssrc::WavFormat dstFormat(ssrc::WavFormat::IEEE_FLOAT, srcFormat.channels, dstRate, 32);
+        ssrc::ContainerFormat dstContainer(ssrc::ContainerFormat::RIFF);
+
+        // 1. Make the resamplers awaitable, sharing two threads among the channels
+        auto executor = std::make_shared<ssrc::Executor>(2);
+
+        std::vector<std::vector<float>> data(srcFormat.channels);
+        auto nRunning = std::make_shared<std::atomic<int>>(srcFormat.channels);
+
+        // 2. Drain every channel with a coroutine
+        for (int i = 0; i < srcFormat.channels; ++i) {
+            auto resampler = std::make_shared<ssrc::SSRC<float>>(reader->getOutlet(i), srcFormat.sampleRate, dstRate, 14, 145, 2.0);
+            drain(std::make_shared<ssrc::AsyncOutletAdapter<float>>(resampler, executor), data[i], nRunning);
+        }
+
+        for(int n;(n = nRunning->load()) != 0;) nRunning->wait(n);
+
+        // 3. Write the results, reading them back through blocking outlets
+        std::vector<std::shared_ptr<ssrc::StageOutlet<float>>> outlets;
+        for (int i = 0; i < srcFormat.channels; ++i)
+            outlets.push_back(std::make_shared<ssrc::BlockingOutletAdapter<float>>(std::make_shared<VectorOutlet>(data[i])));
+
+        auto writer = std::make_shared<ssrc::WavWriter<float>>(out_path, dstFormat, dstContainer, outlets);
+
+        std::cout << "Converting " << in_path << " to " << out_path << "..." << std::endl;
+        writer->execute();
+        std::cout << "Conversion complete." << std::endl;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4) {
+    release_from_completion();
+    convert_file(argv[1], argv[2], atoi(argv[3]));
+    return 0;
+  }
+
+  std::cerr << "Usage : " << argv[0] << " <input.wav> <output.wav> <new_rate>" << std::endl;
+
+  return -1;
+}
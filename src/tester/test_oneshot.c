@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #define DR_WAV_IMPLEMENTATION
 
@@ -14,7 +15,7 @@
 #endif
 
 void print_usage(char *argv0) {
-  fprintf(stderr, "Usage: %s <input.wav> <output.wav> <new_sample_rate>\n", argv0);
+  fprintf(stderr, "Usage: %s <input.wav> <output.wav> <new_sample_rate> [f32|f64|s32|s16 [split]]\n", argv0);
 }
 
 int main(int argc, char *argv[]) {
@@ -26,6 +27,20 @@ int main(int argc, char *argv[]) {
   const char* in_filename = argv[1];
   const char* out_filename = argv[2];
   unsigned int out_rate = atoi(argv[3]);
+  const char* type = argc >= 5 ? argv[4] : "f32";
+  const int split = argc >= 6 && strcmp(argv[5], "split") == 0;
+
+  // The interleaved samples are passed to soxr_oneshot in this type
+  soxr_datatype_t dtype;
+  size_t ssize;
+  if (strcmp(type, "f32") == 0) { dtype = SOXR_FLOAT32_I; ssize = sizeof(float); }
+  else if (strcmp(type, "f64") == 0) { dtype = SOXR_FLOAT64_I; ssize = sizeof(double); }
+  else if (strcmp(type, "s32") == 0) { dtype = SOXR_INT32_I; ssize = sizeof(int32_t); }
+  else if (strcmp(type, "s16") == 0) { dtype = SOXR_INT16_I; ssize = sizeof(int16_t); }
+  else {
+    print_usage(argv[0]);
+    return 1;
+  }
 
   if (out_rate == 0) {
     fprintf(stderr, "Error: Invalid output sample rate.\n");
@@ -35,7 +50,14 @@ int main(int argc, char *argv[]) {
   unsigned int channels;
   unsigned int in_rate;
   drwav_uint64 total_frame_count;
-  float* p_input_samples = drwav_open_file_and_read_pcm_frames_f32(in_filename, &channels, &in_rate, &total_frame_count, NULL);
+  void* p_input_samples;
+  if (dtype == SOXR_INT32_I) {
+    p_input_samples = drwav_open_file_and_read_pcm_frames_s32(in_filename, &channels, &in_rate, &total_frame_count, NULL);
+  } else if (dtype == SOXR_INT16_I) {
+    p_input_samples = drwav_open_file_and_read_pcm_frames_s16(in_filename, &channels, &in_rate, &total_frame_count, NULL);
+  } else {
+    p_input_samples = drwav_open_file_and_read_pcm_frames_f32(in_filename, &channels, &in_rate, &total_frame_count, NULL);
+  }
 
   if (p_input_samples == NULL) {
     fprintf(stderr, "Error: Failed to open and read WAV file: %s\n", in_filename);
@@ -51,30 +73,91 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Input and output sample rates are the same. No conversion needed.\n");
   }
 
+  if (dtype == SOXR_FLOAT64_I) {
+    double* d = (double*)malloc(sizeof(double) * total_frame_count * channels);
+    if (d == NULL) {
+      fprintf(stderr, "Error: Failed to allocate memory for input buffer.\n");
+      drwav_free(p_input_samples, NULL);
+      return 1;
+    }
+    for(size_t i = 0; i < total_frame_count * channels; i++) d[i] = ((float*)p_input_samples)[i];
+    drwav_free(p_input_samples, NULL);
+    p_input_samples = d;
+  }
+
   drwav_uint64 output_frame_count = (drwav_uint64)((double)total_frame_count * (double)out_rate / (double)in_rate + 0.5) * 2;
-  float* p_output_samples = (float*)malloc(sizeof(float) * output_frame_count * channels);
+  void* p_output_samples = malloc(ssize * output_frame_count * channels);
   if (p_output_samples == NULL) {
     fprintf(stderr, "Error: Failed to allocate memory for output buffer.\n");
-    drwav_free(p_input_samples, NULL);
+    if (dtype == SOXR_FLOAT64_I) free(p_input_samples); else drwav_free(p_input_samples, NULL);
     return 1;
   }
 
   size_t odone;
   soxr_error_t error;
 
-  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
-  soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_MQ, 0);
+  // With split, each channel is passed in a buffer of its own
+  void* p_in_arg = p_input_samples;
+  void* p_out_arg = p_output_samples;
+  char* p_in_split = NULL;
+  char* p_out_split = NULL;
+  const void** in_ch = NULL;
+  void** out_ch = NULL;
+  soxr_datatype_t iotype = dtype;
+
+  if (split) {
+    switch(dtype) {
+    case SOXR_FLOAT64_I: iotype = SOXR_FLOAT64_S; break;
+    case SOXR_INT32_I: iotype = SOXR_INT32_S; break;
+    case SOXR_INT16_I: iotype = SOXR_INT16_S; break;
+    default: iotype = SOXR_FLOAT32_S; break;
+    }
+
+    p_in_split = (char*)malloc(ssize * total_frame_count * channels);
+    p_out_split = (char*)malloc(ssize * output_frame_count * channels);
+    in_ch = (const void**)malloc(sizeof(void*) * channels);
+    out_ch = (void**)malloc(sizeof(void*) * channels);
+    if (p_in_split == NULL || p_out_split == NULL || in_ch == NULL || out_ch == NULL) {
+      fprintf(stderr, "Error: Failed to allocate memory for channel buffers.\n");
+      return 1;
+    }
+
+    for(unsigned c = 0; c < channels; c++) {
+      in_ch[c] = p_in_split + ssize * total_frame_count * c;
+      out_ch[c] = p_out_split + ssize * output_frame_count * c;
+      for(size_t i = 0; i < total_frame_count; i++)
+	memcpy((char*)in_ch[c] + ssize * i, (char*)p_input_samples + ssize * (i * channels + c), ssize);
+    }
+
+    p_in_arg = (void*)in_ch;
+    p_out_arg = (void*)out_ch;
+  }
+
+  soxr_io_spec_t io_spec = soxr_io_spec(iotype, iotype);
+  soxr_quality_spec_t q_spec = soxr_quality_spec(dtype == SOXR_FLOAT64_I ? SOXR_HQ : SOXR_MQ, 0);
 
   fprintf(stderr, "\nStarting resampling...\n");
   fprintf(stderr, "  - From: %u Hz\n", in_rate);
   fprintf(stderr, "  - To:   %u Hz\n", out_rate);
 
   error = soxr_oneshot(in_rate, out_rate, channels,
-		       p_input_samples, total_frame_count, NULL,
-		       p_output_samples, output_frame_count, &odone,
+		       p_in_arg, total_frame_count, NULL,
+		       p_out_arg, output_frame_count, &odone,
 		       &io_spec, &q_spec, NULL);
 
-  drwav_free(p_input_samples, NULL);
+  if (split) {
+    if (!error) {
+      for(unsigned c = 0; c < channels; c++)
+	for(size_t i = 0; i < odone; i++)
+	  memcpy((char*)p_output_samples + ssize * (i * channels + c), (char*)out_ch[c] + ssize * i, ssize);
+    }
+    free(p_in_split);
+    free(p_out_split);
+    free(in_ch);
+    free(out_ch);
+  }
+
+  if (dtype == SOXR_FLOAT64_I) free(p_input_samples); else drwav_free(p_input_samples, NULL);
 
   if (error) {
     fprintf(stderr, "Error: soxr_oneshot failed: %s\n", soxr_strerror(error));
@@ -84,6 +167,23 @@ int main(int argc, char *argv[]) {
 
   fprintf(stderr, "Resampling complete. Output frames: %zu\n", odone);
 
+  // The output file is written in float
+  float* p_output_float = (float*)malloc(sizeof(float) * odone * channels);
+  if (p_output_float == NULL && odone != 0) {
+    fprintf(stderr, "Error: Failed to allocate memory for output buffer.\n");
+    free(p_output_samples);
+    return 1;
+  }
+  for(size_t i = 0; i < odone * channels; i++) {
+    switch(dtype) {
+    case SOXR_FLOAT64_I: p_output_float[i] = ((double*)p_output_samples)[i]; break;
+    case SOXR_INT32_I: p_output_float[i] = ((int32_t*)p_output_samples)[i] * (1.0 / 2147483648.0); break;
+    case SOXR_INT16_I: p_output_float[i] = ((int16_t*)p_output_samples)[i] * (1.0 / 32768.0); break;
+    default: p_output_float[i] = ((float*)p_output_samples)[i]; break;
+    }
+  }
+  free(p_output_samples);
+
   drwav wav_out;
   drwav_data_format format;
   format.container = drwav_container_riff;
@@ -94,13 +194,13 @@ int main(int argc, char *argv[]) {
 
   if (!drwav_init_file_write(&wav_out, out_filename, &format, NULL)) {
     fprintf(stderr, "Error: Failed to initialize output WAV file: %s\n", out_filename);
-    free(p_output_samples);
+    free(p_output_float);
     return 1;
   }
 
-  drwav_uint64 frames_written = drwav_write_pcm_frames(&wav_out, odone, p_output_samples);
+  drwav_uint64 frames_written = drwav_write_pcm_frames(&wav_out, odone, p_output_float);
   drwav_uninit(&wav_out);
-  free(p_output_samples);
+  free(p_output_float);
 
   if (frames_written != odone) {
     fprintf(stderr, "Error: Failed to write all frames to output file.\n");
@@ -0,0 +1,224 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include "shibatch/ssrc.hpp"
+#include "shibatch/ssrcsoxr.h"
+
+// An outlet over a vector
+class VectorOutlet : public ssrc::StageOutlet<float> {
+    const std::vector<float> &v;
+    size_t pos = 0;
+public:
+    VectorOutlet(const std::vector<float> &v_) : v(v_) {}
+    bool atEnd() { return pos == v.size(); }
+    size_t read(float *ptr, size_t n) {
+        size_t z = std::min(n, v.size() - pos);
+        std::copy(v.begin() + pos, v.begin() + pos + z, ptr);
+        pos += z;
+        return z;
+    }
+};
+
+void convert_file(const std::string& in_path, const std::string& out_path, int dstRate) {
+    try {
+        auto reader = std::make_shared<ssrc::WavReader<float>>(in_path);
+        ssrc::WavFormat srcFormat = reader->getFormat();
+
+        ssrc::WavFormat dstFormat(ssrc::WavFormat::IEEE_FLOAT, srcFormat.channels, dstRate, 32);
+        ssrc::ContainerFormat dstContainer(ssrc::ContainerFormat::RIFF);
+
+        // 1. Read the whole source
+        std::vector<std::vector<float>> src(srcFormat.channels);
+        for (int i = 0; i < srcFormat.channels; ++i) {
+            std::vector<float> buf(65536);
+            for(size_t z;(z = reader->getOutlet(i)->read(buf.data(), buf.size())) != 0;)
+                src[i].insert(src[i].end(), buf.begin(), buf.begin() + z);
+        }
+
+        std::vector<std::vector<float>> data(srcFormat.channels);
+        uint32_t seed = 1;
+        auto rnd = [&seed](uint32_t n) { seed = seed * 1103515245 + 12345; return (seed >> 8) % n; };
+
+        for (int i = 0; i < srcFormat.channels; ++i) {
+            // 2. Push the source in blocks of random sizes, with random output capacities
+            ssrc::PushSSRC<float> resampler(srcFormat.sampleRate, dstRate, 14, 145, 2.0);
+            std::vector<float> out(65536);
+
+            for(size_t pos = 0;pos < src[i].size();) {
+                size_t nIn = std::min<size_t>(rnd(4096), src[i].size() - pos);
+                size_t z = resampler.process(src[i].data() + pos, nIn, out.data(), rnd(8192));
+                data[i].insert(data[i].end(), out.begin(), out.begin() + z);
+                pos += nIn;
+            }
+
+            for(size_t z;(z = resampler.flush(out.data(), rnd(8192) + 1)) != 0;)
+                data[i].insert(data[i].end(), out.begin(), out.begin() + z);
+
+            if (!resampler.atEnd()) throw std::runtime_error("atEnd() is false after flush");
+
+            // 3. The output must be identical to that of the pull API
+            ssrc::SSRC<float> pull(std::make_shared<VectorOutlet>(src[i]), srcFormat.sampleRate, dstRate, 14, 145, 2.0,
+                                   1, false, 0, false);
+            std::vector<float> ref;
+            for(size_t z;(z = pull.read(out.data(), out.size())) != 0;)
+                ref.insert(ref.end(), out.begin(), out.begin() + z);
+
+            if (ref != data[i]) throw std::runtime_error("The output differs from that of the pull API");
+        }
+
+        std::vector<std::shared_ptr<ssrc::StageOutlet<float>>> outlets;
+        for (int i = 0; i < srcFormat.channels; ++i) outlets.push_back(std::make_shared<VectorOutlet>(data[i]));
+
+        auto writer = std::make_shared<ssrc::WavWriter<float>>(out_path, dstFormat, dstContainer, outlets);
+
+        std::cout << "Converting " << in_path << " to " << out_path << "..." << std::endl;
+        writer->execute();
+        std::cout << "Conversion complete." << std::endl;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        exit(-1);
+    }
+}
+
+// Tells a denormal from zero even while denormals are treated as zero
+bool is_nonzero(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return (u & 0x7fffffff) != 0;
+}
+
+// Converts a constant denormal input and returns the number of nonzero output samples
+size_t count_nonzero(ssrc::PushSSRC<float> &resampler) {
+    std::vector<float> in(4096, 1e-39f), out(8192);
+    size_t n = 0;
+    for(int i=0;i<16;i++) {
+        size_t z = resampler.process(in.data(), in.size(), out.data(), out.size());
+        for(size_t j=0;j<z;j++) if (is_nonzero(out[j])) n++;
+    }
+    for(size_t z;(z = resampler.flush(out.data(), out.size())) != 0;)
+        for(size_t j=0;j<z;j++) if (is_nonzero(out[j])) n++;
+    return n;
+}
+
+// The conversion must run with the floating-point mode of the calling
+// thread, not of the thread that constructed the resampler
+void check_fp_mode() {
+    ssrc::PushSSRC<float> ref(44100, 48000);
+    if (count_nonzero(ref) == 0) {
+        std::cerr << "Error: the denormal input gives no output without flushing" << std::endl;
+        exit(-1);
+    }
+
+    ssrc::PushSSRC<float> resampler(44100, 48000);
+    ssrc::ThreadPolicy policy;
+    policy.flushDenormals = true;
+    if (!policy.apply()) {
+        std::cout << "Flushing denormals is not supported, skipped." << std::endl;
+        return;
+    }
+
+    size_t n = count_nonzero(resampler);
+    if (n != 0) {
+        std::cerr << "Error: " << n << " denormal output samples with the denormals flushed" << std::endl;
+        exit(-1);
+    }
+    std::cout << "The floating-point mode follows the caller." << std::endl;
+}
+
+// Converts a constant denormal input with the soxr API and returns the number of nonzero output samples
+size_t count_nonzero_soxr(unsigned nThreads) {
+    const unsigned nch = 4;
+    ssrc_soxr_error_t err = nullptr;
+    ssrc_soxr_io_spec_t iospec = ssrc_soxr_io_spec(SSRC_SOXR_FLOAT32, SSRC_SOXR_FLOAT32);
+    ssrc_soxr_runtime_spec_t rtspec = { nThreads };
+    struct ssrc_soxr *soxr = ssrc_soxr_create(44100, 48000, nch, &err, &iospec, nullptr, &rtspec);
+    if (!soxr) {
+        std::cerr << "Error: ssrc_soxr_create failed : " << err << std::endl;
+        exit(-1);
+    }
+
+    std::vector<float> in(4096 * nch, 1e-39f), out(8192 * nch);
+    size_t n = 0, odone = 0;
+    for(int i=0;i<16;i++) {
+        if ((err = ssrc_soxr_process(soxr, in.data(), 4096, nullptr, out.data(), 8192, &odone)) != nullptr) break;
+        for(size_t j=0;j<odone * nch;j++) if (is_nonzero(out[j])) n++;
+    }
+    while(!err) {
+        if ((err = ssrc_soxr_process(soxr, nullptr, 0, nullptr, out.data(), 8192, &odone)) != nullptr || odone == 0) break;
+        for(size_t j=0;j<odone * nch;j++) if (is_nonzero(out[j])) n++;
+    }
+    ssrc_soxr_delete(soxr);
+
+    if (err) {
+        std::cerr << "Error: ssrc_soxr_process failed : " << err << std::endl;
+        exit(-1);
+    }
+    return n;
+}
+
+// Every channel of a soxr resampler, whether it is converted on the
+// calling thread or on the pool, must flush the denormals as the
+// thread policy says
+void check_soxr_fp_mode() {
+    ssrc::ThreadPolicy policy;
+    policy.flushDenormals = true;
+
+    bool supported = false;
+    std::thread([&]() { supported = policy.apply(); }).join();
+    if (!supported) {
+        std::cout << "Flushing denormals is not supported, skipped." << std::endl;
+        return;
+    }
+
+    if (count_nonzero_soxr(1) == 0) {
+        std::cerr << "Error: the denormal input gives no output without flushing" << std::endl;
+        exit(-1);
+    }
+
+    ssrc::setThreadPolicy(policy);
+
+    for(unsigned nThreads : { 0, 1 }) {
+        size_t n = count_nonzero_soxr(nThreads);
+        if (n != 0) {
+            std::cerr << "Error: " << n << " denormal output samples with num_threads = " << nThreads << std::endl;
+            exit(-1);
+        }
+    }
+
+    // The mode of the calling thread must be restored after each call
+    ssrc::setThreadPolicy(ssrc::ThreadPolicy());
+    if (count_nonzero_soxr(1) == 0) {
+        std::cerr << "Error: the denormals of the calling thread are still flushed" << std::endl;
+        exit(-1);
+    }
+
+    std::cout << "The soxr channels follow the thread policy." << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && std::string(argv[1]) == "--fpMode") {
+    check_fp_mode();
+    return 0;
+  }
+
+  if (argc == 2 && std::string(argv[1]) == "--soxrFPMode") {
+    check_soxr_fp_mode();
+    return 0;
+  }
+
+  if (argc == 4) {
+    convert_file(argv[1], argv[2], atoi(argv[3]));
+    return 0;
+  }
+
+  std::cerr << "Usage : " << argv[0] << " <input.wav> <output.wav> <new_rate>" << std::endl;
+  std::cerr << "        " << argv[0] << " --fpMode" << std::endl;
+  std::cerr << "        " << argv[0] << " --soxrFPMode" << std::endl;
+
+  return -1;
+}
@@ -16,11 +16,25 @@
 #define BUFFER_FRAMES 3000
 
 void print_usage(const char *prog_name) {
-  printf("Usage: %s <new_rate> <output.wav> <input1.wav> [input2.wav] ...\n", prog_name);
+  printf("Usage: %s [--threads <n>] <new_rate> <output.wav> <input1.wav> [input2.wav] ...\n", prog_name);
   printf("  Concatenates and resamples multiple WAV files into a single output file.\n");
+  printf("  --threads gives n as num_threads of the runtime spec, which is NULL otherwise.\n");
 }
 
 int main(int argc, char *argv[]) {
+  soxr_runtime_spec_t rt_spec, *rt = NULL;
+  if (argc >= 3 && strcmp(argv[1], "--threads") == 0) {
+#ifdef USE_SOXR
+    rt_spec = soxr_runtime_spec(atoi(argv[2]));
+#else
+    rt_spec.num_threads = atoi(argv[2]);
+#endif
+    rt = &rt_spec;
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+
   if (argc < 4) {
     print_usage(argv[0]);
     return 1;
@@ -49,7 +63,7 @@ int main(int argc, char *argv[]) {
   soxr_error_t error;
   soxr_io_spec_t io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
   soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_MQ, minPhase ? SOXR_MINIMUM_PHASE : 0);
-  soxr_t soxr = soxr_create(current_in_rate, out_rate, num_channels, &error, &io_spec, &q_spec, NULL);
+  soxr_t soxr = soxr_create(current_in_rate, out_rate, num_channels, &error, &io_spec, &q_spec, rt);
   if (!soxr) {
     fprintf(stderr, "soxr_create failed: %s\n", soxr_strerror(error));
     return 1;
@@ -93,7 +107,7 @@ int main(int argc, char *argv[]) {
       current_in_rate = (double)wav_in.sampleRate;
       fprintf(stderr, "  -> Sample rate is %.0f Hz. Recreating resampler.\n", current_in_rate);
       soxr_delete(soxr);
-      soxr = soxr_create(current_in_rate, out_rate, num_channels, &error, &io_spec, &q_spec, NULL);
+      soxr = soxr_create(current_in_rate, out_rate, num_channels, &error, &io_spec, &q_spec, rt);
       if (!soxr) {
 	fprintf(stderr, "soxr_create failed during recreation. Aborting.\n");
 	drwav_uninit(&wav_in);